@@ -7,7 +7,9 @@
 //
 //===----------------------------------------------------------------------===//
 //
-// This pass removes type checks that are statically proven safe
+// This pass removes type checks that are statically proven safe, checks made
+// redundant by an earlier equal check or store, and loop-invariant or per
+// element checks in loops.
 //
 //===----------------------------------------------------------------------===//
 
@@ -17,10 +19,14 @@
 #include "dsa/TypeSafety.h"
 
 #include "llvm/Pass.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/IR/Dominators.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/CallSite.h"
 
 #include <list>
+#include <vector>
 
 namespace llvm {
 
@@ -33,8 +39,18 @@ private:
 
   // Analysis from other passes.
   dsa::TypeSafety<TDDataStructures> *TS;
+  TDDataStructures *DS;
+  DominatorTree *DT;
+  ScalarEvolution *SE;
   std::list<Instruction *> toDelete;
 
+  const DSNode *getNode(Value *V, Function &F);
+  bool writesShadow(Instruction *I, Value *&Ptr, bool &Clobbers);
+  void removeRedundantChecks(Function &F);
+  void optimizeLoop(Loop *L, Function &F);
+  bool makeRangeCheck(Loop *L, CallInst *CI);
+  void removeUnusedTypeTags(Value *MD);
+
 public:
   static char ID;
   TypeChecksOpt() : ModulePass(ID) {}
@@ -42,6 +58,10 @@ public:
 
   virtual void getAnalysisUsage(AnalysisUsage &AU) const {
     AU.addRequired<dsa::TypeSafety<TDDataStructures> >();
+    AU.addRequired<TDDataStructures>();
+    AU.addRequired<DominatorTreeWrapperPass>();
+    AU.addRequired<LoopInfoWrapperPass>();
+    AU.addRequired<ScalarEvolutionWrapperPass>();
   }
 
 };
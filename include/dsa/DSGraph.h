@@ -17,6 +17,8 @@
 
 #include "dsa/DSNode.h"
 #include "dsa/DSCallGraph.h"
+#include "dsa/stable_map.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/EquivalenceClasses.h"
 #include "llvm/IR/Function.h"
 
@@ -27,6 +29,7 @@
 namespace llvm {
 
 class DataLayout;
+class DSNodeArena;
 class GlobalValue;
 
 //===----------------------------------------------------------------------===//
@@ -41,18 +44,35 @@ class GlobalValue;
 /// globals or unique node handles active in the function.
 ///
 class DSScalarMap {
-  typedef std::map<const Value*, DSNodeHandle> ValueMapTy;
+  // The handles of the map are held on to while other scalars are added, so
+  // they must not move.
+  typedef stable_map<const Value*, DSNodeHandle> ValueMapTy;
   ValueMapTy ValueMap;
 
   typedef std::set<const GlobalValue*> GlobalSetTy;
   GlobalSetTy GlobalSet;
 
   EquivalenceClasses<const GlobalValue*> &GlobalECs;
+
 public:
-  DSScalarMap(EquivalenceClasses<const GlobalValue*> &ECs) : GlobalECs(ECs) {}
+  typedef DenseMap<const GlobalValue*, const GlobalValue*> LeaderTableTy;
+
+private:
+  // If set, the leader of each global in GlobalECs, looked up instead of
+  // GlobalECs itself.  Finding a leader in GlobalECs compresses its path, so
+  // graphs built on several threads at once read this snapshot instead.
+  const LeaderTableTy *LeaderTable;
+
+public:
+  DSScalarMap(EquivalenceClasses<const GlobalValue*> &ECs)
+    : GlobalECs(ECs), LeaderTable(0) {}
 
   EquivalenceClasses<const GlobalValue*> &getGlobalECs() const { return GlobalECs; }
 
+  /// setLeaderTable - Look up the leaders of globals in Table, which must
+  /// match GlobalECs, until this is called again with a null table.
+  void setLeaderTable(const LeaderTableTy *Table) { LeaderTable = Table; }
+
   // Compatibility methods: provide an interface compatible with a map of
   // Value* to DSNodeHandle's.
   typedef ValueMapTy::const_iterator const_iterator;
@@ -63,6 +83,10 @@ public:
   const_iterator end() const { return ValueMap.end(); }
 
   const GlobalValue *getLeaderForGlobal(const GlobalValue *GV) const {
+    if (LeaderTable) {
+      LeaderTableTy::const_iterator I = LeaderTable->find(GV);
+      return I == LeaderTable->end() ? GV : I->second;
+    }
     EquivalenceClasses<const GlobalValue*>::iterator ECI = GlobalECs.findValue(GV);
     if (ECI == GlobalECs.end()) return GV;
     return *GlobalECs.findLeader(ECI);
@@ -124,8 +148,9 @@ public:
   void replaceScalar(const Value *Old, const Value *New) {
     iterator I = find(Old);
     assert(I != end() && "Old value is not in the map!");
-    ValueMap.insert(std::make_pair(New, I->second));
-    erase(I);
+    DSNodeHandle NH = I->second;
+    erase(I);   // Inserting New would invalidate I.
+    ValueMap.insert(std::make_pair(New, NH));
   }
 
   /// copyScalarIfExists - If Old exists in the scalar map, make New point to
@@ -202,7 +227,7 @@ public:
   /// NodeMapTy - This data type is used when cloning one graph into another to
   /// keep track of the correspondence between the nodes in the old and new
   /// graphs.
-  typedef std::map<const DSNode*, DSNodeHandle> NodeMapTy;
+  typedef stable_map<const DSNode*, DSNodeHandle> NodeMapTy;
 
   // InvNodeMapTy - This data type is used to represent the inverse of a node
   // map.
@@ -223,6 +248,11 @@ private:
   NodeListTy Nodes;
   ScalarMapTy ScalarMap;
 
+  // Arenas - The arenas the nodes of this graph are allocated in.  New nodes
+  // come from the last one; the others were taken over from spliced graphs.
+  //
+  std::vector<DSNodeArena*> Arenas;
+
   // ReturnNodes - A return value for every function merged into this graph.
   // Each DSGraph may have multiple functions merged into it at any time, which
   // is used for representing SCCs.
@@ -277,6 +307,10 @@ public:
           unsigned CloneFlags = 0);
   ~DSGraph();
 
+  /// clear - Remove all nodes, call sites and scalars from the graph, leaving
+  /// it as it was constructed.
+  void clear();
+
   DSGraph *getGlobalsGraph() const { return GlobalsGraph; }
   void setGlobalsGraph(DSGraph *G) { GlobalsGraph = G; }
 
@@ -290,6 +324,10 @@ public:
     return TypeSS;
   }
 
+  /// getNodeArena - Return the arena new nodes of this graph are allocated in.
+  ///
+  DSNodeArena *getNodeArena();
+
   /// getDataLayout - Return the DataLayout object for the current target.
   ///
   const DataLayout &getDataLayout() const { return TD; }
@@ -621,6 +659,12 @@ public:
 
   void AssertGraphOK() const;
 
+  /// compactForwardingNodes - Point every handle in the graph straight at the
+  /// node it refers to, so that no forwarding node has a referrer left and all
+  /// of them are deleted.  Edges and types left empty by merging are dropped.
+  ///
+  void compactForwardingNodes();
+
   /// removeTriviallyDeadNodes - After the graph has been constructed, this
   /// method removes all unreachable nodes that are created because they got
   /// merged with other nodes in the graph.  This is used as the first step of
@@ -649,9 +693,9 @@ class ReachabilityCloner {
 
   // NodeMap - A mapping from nodes in the source graph to the nodes that
   // represent them in the destination graph.
-  // We cannot use a densemap here as references into it are not stable across
-  // insertion
-  typedef std::map<const DSNode*, DSNodeHandle> RCNodeMap;
+  // References into it are held across insertion, so a plain DenseMap cannot
+  // be used.
+  typedef stable_map<const DSNode*, DSNodeHandle> RCNodeMap;
   RCNodeMap NodeMap;
 
 public:
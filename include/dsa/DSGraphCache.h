@@ -0,0 +1,101 @@
+//===- DSGraphCache.h - Keep DSGraphs between runs --------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file declares DSGraphCache, a directory of DSGraphs saved by earlier
+// runs of the DSA passes.  Each graph is saved under a key computed from all
+// of the inputs it was calculated from, so that a later run on a program whose
+// functions have not changed reads the graphs back instead of calculating them
+// again.  The directory is named with -dsa-cache-dir; there is no cache unless
+// it is given.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_ANALYSIS_DSGRAPHCACHE_H
+#define LLVM_ANALYSIS_DSGRAPHCACHE_H
+
+#include "llvm/ADT/EquivalenceClasses.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Mutex.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace llvm {
+
+class DSGraph;
+class Function;
+class GlobalValue;
+class Module;
+
+class DSGraphCache {
+  std::string Dir;
+  Module &M;
+
+  /// ModuleKey - A hash of the inputs which every graph depends on: the data
+  /// layout and the bodies of the named types.
+  std::string ModuleKey;
+
+  /// GlobalKey - A hash of what the interprocedural passes see of the whole
+  /// module, for the graphs they calculate.
+  std::string GlobalKey;
+
+  /// Summaries - The hash of the finished graph of each function, which the
+  /// graphs calculated from it record.
+  std::map<const Function*, std::string> Summaries;
+
+  /// Lock - Guards the directory, the summaries, and the creation of types
+  /// while graphs are read.
+  sys::Mutex Lock;
+
+  DSGraphCache(StringRef Dir, Module &M);
+
+  std::string getPath(StringRef Key) const;
+
+public:
+  /// create - Return the cache named by -dsa-cache-dir, or null if no cache
+  /// directory was given or it cannot be created.
+  static DSGraphCache *create(Module &M);
+
+  /// setGlobalState - Make the keys computed from now on depend on the global
+  /// equivalence classes and on which functions have bodies, which decide the
+  /// callees the interprocedural passes find.
+  void setGlobalState(const EquivalenceClasses<const GlobalValue*> &ECs);
+
+  /// getKey - Return the key of a graph calculated by the named pass from the
+  /// inputs described by Data.
+  std::string getKey(StringRef Pass, StringRef Data) const;
+
+  /// writeGraph - Write G to Out in the format the cache keeps graphs in.
+  /// Return false if G refers to a value or type which cannot be named outside
+  /// of this run, in which case the graph cannot be cached.
+  static bool writeGraph(const DSGraph &G, std::string &Out);
+
+  /// load - Read the graph saved under Key into G, which must be empty, and
+  /// the functions whose graphs it was calculated from into Deps, if given.
+  /// This fails if there is no such graph, or if one of the graphs it was
+  /// calculated from has a different summary now; G should then be discarded,
+  /// as it may hold part of the saved graph.
+  bool load(StringRef Key, DSGraph &G,
+            std::vector<const Function*> *Deps = 0);
+
+  /// store - Save G under Key.  Deps lists the functions whose finished graphs
+  /// G was calculated from; if one of them has no summary, G is not saved.
+  void store(StringRef Key, const DSGraph &G,
+             const std::vector<const Function*> &Deps =
+               std::vector<const Function*>());
+
+  /// setSummary - Record the summary of G, a finished graph, for each of its
+  /// functions.
+  void setSummary(const DSGraph &G);
+};
+
+} // End llvm namespace
+
+#endif
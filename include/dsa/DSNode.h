@@ -17,8 +17,10 @@
 #include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/ilist_node.h"
 #include "llvm/ADT/ilist.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/raw_ostream.h"
+#include "dsa/svmap.h"
 #include "dsa/svset.h"
 #include "dsa/super_set.h"
 #include "dsa/keyiterator.h"
@@ -33,6 +35,30 @@ namespace llvm {
 template<typename BaseType>
 class DSNodeIterator;          // Data structure graph traversal iterator
 
+//===----------------------------------------------------------------------===//
+/// DSNodeArena - The memory that the nodes of a DSGraph are allocated from.
+/// Nodes are bump allocated, and the memory of a deleted node is reused for
+/// the next one.  The arena is freed all at once when its graph has let go of
+/// it and its last node is deleted; nodes may outlive their graph, as a
+/// forwarding node is only deleted once the last handle to it is dropped.
+/// Like its graph, an arena is used by one thread at a time.
+///
+class DSNodeArena {
+  BumpPtrAllocator Allocator;
+  void *FreeList;      // The memory of deleted nodes
+  unsigned NumLive;    // The number of nodes not yet deleted
+  bool Released;       // Set once the graph allocates no more nodes here
+public:
+  DSNodeArena() : FreeList(0), NumLive(0), Released(false) {}
+
+  void *allocate(size_t Size);
+  void deallocate(void *P);
+
+  /// release - Called by the graph when it is destroyed.  The arena is freed
+  /// now if it holds no nodes, or else when the last of them is deleted.
+  void release();
+};
+
 //===----------------------------------------------------------------------===//
 /// DSNode - Data structure node class
 ///
@@ -42,8 +68,11 @@ class DSNodeIterator;          // Data structure graph traversal iterator
 ///
 class DSNode : public ilist_node<DSNode> {
 public:
-  typedef std::map<unsigned, SuperSet<Type*>::setPtr> TyMapTy;
-  typedef std::map<unsigned, DSNodeHandle> LinkMapTy;
+  // The types and links are kept in sorted vectors.  Most nodes are scalars,
+  // with one type and at most one link, so one entry of each is kept inline;
+  // room for more only makes every node larger.
+  typedef svmap<unsigned, SuperSet<Type*>::setPtr, 1> TyMapTy;
+  typedef svmap<unsigned, DSNodeHandle, 1> LinkMapTy;
 
 private:
   friend struct ilist_sentinel_traits<DSNode>;
@@ -139,6 +168,14 @@ public:
   DSNode(const DSNode &, DSGraph *G, bool NullLinks = false);
   ~DSNode();
 
+  /// Nodes are allocated in the arena of a graph, with "new (G) DSNode(G)".
+  /// Nodes made without a graph come from the heap.
+  ///
+  void *operator new(size_t Size, DSGraph *G);
+  void *operator new(size_t Size) { return operator new(Size, (DSGraph*)0); }
+  void operator delete(void *P);
+  void operator delete(void *P, DSGraph *) { operator delete(P); }
+
   // Iterator for graph interface... Defined in DSGraphTraits.h
   typedef DSNodeIterator<DSNode> iterator;
   typedef DSNodeIterator<const DSNode> const_iterator;
@@ -249,6 +286,13 @@ public:
   void mergeTypeInfo(const TyMapTy::mapped_type TyIt, unsigned Offset);
   void mergeTypeInfo(const DSNode* D, unsigned Offset);
 
+  /// setTypeInfo - Replace the type record at the specified offset.  Unlike
+  /// mergeTypeInfo, this neither grows nor collapses the node; it is used to
+  /// restore a node exactly as it was saved.
+  void setTypeInfo(unsigned Offset, TyMapTy::mapped_type TyIt) {
+    TyMap[Offset] = TyIt;
+  }
+
   // Types records might exist without types in them
   bool hasNoType() {
     type_iterator ii = type_begin(), ee = type_end();
@@ -283,7 +327,9 @@ public:
   ///
   void setLink(unsigned Offset, const DSNodeHandle &NH) {
     assert(Offset < getSize() && "Link index is out of range!");
-    Links[Offset] = NH;
+    // NH may be another link of this node, which inserting the new one moves.
+    DSNodeHandle Tmp(NH);
+    Links[Offset] = Tmp;
   }
 
   /// addEdgeTo - Add an edge from the current node to the specified node.  This
@@ -434,7 +480,7 @@ public:
   /// remapLinks - Change all of the Links in the current node according to the
   /// specified mapping.
   ///
-  void remapLinks(std::map<const DSNode*, DSNodeHandle> &OldNodeMap);
+  void remapLinks(stable_map<const DSNode*, DSNodeHandle> &OldNodeMap);
 
   /// markReachableNodes - This method recursively traverses the specified
   /// DSNodes, marking any nodes which are reachable.  All reachable nodes it
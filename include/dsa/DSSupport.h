@@ -20,6 +20,7 @@
 #include <set>
 
 #include "llvm/ADT/DenseSet.h"
+#include "dsa/stable_map.h"
 #include "llvm/IR/CallSite.h"
 
 namespace llvm {
@@ -177,9 +178,10 @@ private:
   }
 
   static void InitNH(DSNodeHandle &NH, const DSNodeHandle &Src,
-                     const std::map<const DSNode*, DSNodeHandle> &NodeMap) {
+                     const stable_map<const DSNode*, DSNodeHandle> &NodeMap) {
     if (DSNode *N = Src.getNode()) {
-      std::map<const DSNode*, DSNodeHandle>::const_iterator I = NodeMap.find(N);
+      stable_map<const DSNode*, DSNodeHandle>::const_iterator I =
+        NodeMap.find(N);
       assert(I != NodeMap.end() && "Node not in mapping!");
 
       DSNode *NN = I->second.getNode(); // Call getNode before getOffset()
@@ -287,6 +289,20 @@ public:
     CallArgs.push_back(NH);
   }
 
+  void addMappedSite(CallSite CS) {
+    MappedSites.insert(CS);
+  }
+
+  /// forwardHandles - Point every handle of this call site straight at the
+  /// node it refers to, skipping any forwarding nodes.
+  void forwardHandles() const {
+    CalleeN.getNode();
+    RetVal.getNode();
+    VarArgVal.getNode();
+    for (unsigned i = 0, e = CallArgs.size(); i != e; ++i)
+      CallArgs[i].getNode();
+  }
+
   void swap(DSCallSite &CS) {
     if (this != &CS) {
       std::swap(Site, CS.Site);
@@ -27,6 +27,7 @@
 #include "llvm/ADT/DenseSet.h"
 
 #include <map>
+#include <set>
 
 namespace llvm {
 
@@ -34,6 +35,7 @@ class Type;
 class Instruction;
 class GlobalValue;
 class DSGraph;
+class DSGraphCache;
 class DSCallSite;
 class DSNode;
 class DSNodeHandle;
@@ -66,6 +68,12 @@ class DataStructures : public ModulePass {
   // DSInfo, one graph for each function
   DSInfoTy DSInfo;
 
+  // The graphs which the globals graph has not been merged into yet, as
+  // their pass deferred it with deferGlobalsInto.
+  mutable std::set<DSGraph*> GlobalsPending;
+
+  void finishGlobalsInto(DSGraph* G, const DSGraph* GG) const;
+
   // Name for printing
   const char* printname;
 
@@ -93,6 +101,7 @@ protected:
   
   void cloneIntoGlobals(DSGraph* G, unsigned cloneFlags);
   void cloneGlobalsInto(DSGraph* G, unsigned cloneFlags);
+  void deferGlobalsInto(DSGraph* G);
 
   void restoreCorrectCallGraph();
   
@@ -126,6 +135,8 @@ public:
   virtual DSGraph *getDSGraph(const Function &F) const {
     std::map<const Function*, DSGraph*>::const_iterator I = DSInfo.find(&F);
     assert(I != DSInfo.end() && "Function not in module!");
+    if (!GlobalsPending.empty() && GlobalsPending.count(I->second))
+      finishGlobalsInto(I->second, GlobalsGraph);
     return I->second;
   }
 
@@ -234,11 +245,12 @@ public:
   //Child constructor (CBU)
   BUDataStructures(char & CID, const char* name, const char* printname,
       bool filter)
-    : DataStructures(CID, printname), debugname(name), filterCallees(filter) {}
+    : DataStructures(CID, printname), debugname(name), filterCallees(filter),
+      Scheduler(0), Cache(0) {}
   //main constructor
   BUDataStructures()
     : DataStructures(ID, "bu."), debugname("dsa-bu"),
-    filterCallees(true) {}
+    filterCallees(true), Scheduler(0), Cache(0) {}
   ~BUDataStructures() { releaseMemory(); }
 
   virtual bool runOnModule(Module &M);
@@ -257,13 +269,24 @@ private:
   typedef std::vector<const Function*>        TarjanStack;
   typedef svset<const Function*>              FuncSet;
 
+  // Scheduler - Set while the graphs of independent SCCs are calculated on
+  // worker threads.
+  struct SCCScheduler;
+  SCCScheduler *Scheduler;
+
+  // Cache - The graphs saved by earlier runs, if -dsa-cache-dir is given.
+  DSGraphCache *Cache;
+
   void postOrderInline (Module & M);
+  void scheduleSCCs(Module &M, unsigned Threads, TarjanMap &ValMap);
   unsigned calculateGraphs (const Function *F,
                             TarjanStack & Stack,
                             unsigned & NextID,
                             TarjanMap & ValMap);
 
   void calculateGraph(DSGraph* G);
+  bool loadCalculatedGraph(DSGraph* G, const std::string &Key);
+  void finishGraph(DSGraph* G);
 
   void CloneAuxIntoGlobal(DSGraph* G);
 
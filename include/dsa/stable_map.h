@@ -0,0 +1,170 @@
+#ifndef _STABLE_MAP_HH_
+#define _STABLE_MAP_HH_ 1
+
+#include "llvm/ADT/DenseMap.h"
+
+#include <deque>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// A hash map whose entries never move.  Keys are looked up in an
+/// llvm::DenseMap, which holds a pointer to each entry; the entries themselves
+/// are kept in a deque, and the slots of erased entries are reused.
+/// References to a value stay valid until its key is erased, as DSA holds on
+/// to node handles while inserting into the same map.  Iterators are
+/// invalidated by insert, and the order of iteration is unspecified.
+template< typename Key, typename T >
+class stable_map {
+public:
+  typedef Key                    key_type;
+  typedef T                      mapped_type;
+  typedef std::pair<Key, T>      value_type;
+  typedef unsigned               size_type;
+
+private:
+  typedef llvm::DenseMap<Key, value_type*> index_type;
+
+  index_type index_;
+  std::deque<value_type> entries_;
+  std::vector<value_type*> free_;
+
+  template< typename IndexIt, typename Value >
+  class iterator_base
+    : public std::iterator<std::forward_iterator_tag, Value> {
+    friend class stable_map;
+    IndexIt i_;
+  public:
+    iterator_base() {}
+    explicit iterator_base(IndexIt i) : i_(i) {}
+    template< typename OtherIt, typename OtherValue >
+    iterator_base(const iterator_base<OtherIt, OtherValue>& rhs)
+    : i_(rhs.i_) {}
+
+    Value& operator*() const { return *i_->second; }
+    Value* operator->() const { return i_->second; }
+
+    iterator_base& operator++() {
+      ++i_;
+      return *this;
+    }
+    iterator_base operator++(int) {
+      iterator_base tmp = *this;
+      ++i_;
+      return tmp;
+    }
+
+    bool operator==(const iterator_base& rhs) const { return i_ == rhs.i_; }
+    bool operator!=(const iterator_base& rhs) const { return i_ != rhs.i_; }
+
+    template< typename OtherIt, typename OtherValue >
+    friend class iterator_base;
+  };
+
+public:
+  typedef iterator_base<typename index_type::iterator, value_type> iterator;
+  typedef iterator_base<typename index_type::const_iterator,
+                        const value_type> const_iterator;
+
+  /// Empty constructor.
+  stable_map() { }
+
+  /// Copy-constructor.  The copy has entries of its own.
+  stable_map(const stable_map& rhs) {
+    for (const_iterator i = rhs.begin(), e = rhs.end(); i != e; ++i)
+      insert(*i);
+  }
+
+  stable_map & operator=(const stable_map& rhs) {
+    if (&rhs != this) {
+      clear();
+      for (const_iterator i = rhs.begin(), e = rhs.end(); i != e; ++i)
+        insert(*i);
+    }
+    return *this;
+  }
+
+  iterator begin() { return iterator(index_.begin()); }
+  iterator end()   { return iterator(index_.end()); }
+  const_iterator begin() const { return const_iterator(index_.begin()); }
+  const_iterator end() const   { return const_iterator(index_.end()); }
+
+  bool empty() const {
+    return index_.empty();
+  }
+
+  size_type size() const {
+    return index_.size();
+  }
+
+  /// Insert x unless its key is already in the map.
+  std::pair<iterator,bool>
+  insert(const value_type& x) {
+    std::pair<typename index_type::iterator, bool> r =
+      index_.insert(std::make_pair(x.first, (value_type*)0));
+    if (r.second) {
+      if (free_.empty()) {
+        entries_.push_back(x);
+        r.first->second = &entries_.back();
+      } else {
+        r.first->second = free_.back();
+        free_.pop_back();
+        *r.first->second = x;
+      }
+    }
+    return std::make_pair(iterator(r.first), r.second);
+  }
+
+  /// Return the value of key k, inserting a default one if there is none.
+  mapped_type& operator[](const key_type& k) {
+    typename index_type::iterator i = index_.find(k);
+    if (i != index_.end())
+      return i->second->second;
+    return insert(value_type(k, mapped_type())).first->second;
+  }
+
+  void erase(iterator position) {
+    value_type *v = position.i_->second;
+    v->second = mapped_type();
+    free_.push_back(v);
+    index_.erase(position.i_);
+  }
+
+  size_type erase(const key_type& k) {
+    iterator i = find(k);
+    if (i != end()) {
+      erase(i);
+      return 1;
+    }
+    return 0;
+  }
+
+  void swap(stable_map& s) {
+    index_.swap(s.index_);
+    entries_.swap(s.entries_);
+    free_.swap(s.free_);
+  }
+
+  void clear() {
+    index_.clear();
+    entries_.clear();
+    free_.clear();
+  }
+
+  /// Find the key k.
+  iterator find(const key_type& k) {
+    return iterator(index_.find(k));
+  }
+
+  const_iterator find(const key_type& k) const {
+    return const_iterator(index_.find(k));
+  }
+
+  size_type count(const key_type& k) const {
+    return index_.count(k);
+  }
+};
+
+#endif
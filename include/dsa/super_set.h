@@ -9,35 +9,82 @@
 #define	_SUPER_SET_H
 
 #include "dsa/svset.h"
-#include <set>
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/Support/Mutex.h"
+#include <deque>
+#include <unordered_map>
 
 // Contains stable references to a set
 // The sets can be grown.
+// Sets may be created from several threads at once; the local graphs of
+// different functions, and the bottom-up graphs of independent SCCs, are built
+// concurrently.
+//
+// Each distinct set is kept once (hash-consed), so sets can be compared by
+// pointer.  Sets are found by a hash of their contents, and the result of
+// adding one element to a set is remembered, as the type merging of DSNodes
+// adds the same types to the same sets over and over.
 
 template<typename Ty>
 class SuperSet {
-  //std::set provides stable iterators, and that matters a lot
   typedef svset<Ty> InnerSetTy;
-  typedef std::set<InnerSetTy> OuterSetTy;
+  //std::deque provides stable references, and that matters a lot
+  typedef std::deque<InnerSetTy> OuterSetTy;
   OuterSetTy container;
 public:
-  typedef const typename OuterSetTy::value_type* setPtr;
+  typedef const InnerSetTy* setPtr;
 
+private:
+  // The sets with each hash
+  std::unordered_multimap<size_t, setPtr> Index;
+  // The set made by adding an element to a set
+  llvm::DenseMap<std::pair<setPtr, Ty>, setPtr> Added;
+  llvm::sys::Mutex Lock;
+
+  static size_t hash(const InnerSetTy& S) {
+    return llvm::hash_combine_range(S.begin(), S.end());
+  }
+
+  // Lock must be held
+  setPtr intern(const InnerSetTy& S) {
+    size_t H = hash(S);
+    typedef typename std::unordered_multimap<size_t, setPtr>::const_iterator
+      index_iterator;
+    std::pair<index_iterator, index_iterator> R = Index.equal_range(H);
+    for (index_iterator ii = R.first; ii != R.second; ++ii)
+      if (*ii->second == S)
+        return ii->second;
+    container.push_back(S);
+    setPtr P = &container.back();
+    Index.insert(std::make_pair(H, P));
+    return P;
+  }
+
+public:
   setPtr getOrCreate(svset<Ty>& S) {
     if (S.empty()) return 0;
-    return &(*container.insert(S).first);
+    llvm::sys::ScopedLock Guard(Lock);
+    return intern(S);
   }
 
   setPtr getOrCreate(setPtr P, Ty t) {
-    svset<Ty> s;
-    if (P)
-      s.insert(P->begin(), P->end());
-    s.insert(t);
-    return getOrCreate(s);
+    // Sets never change once made, so they can be searched without the lock
+    if (P && P->count(t))
+      return P;
+    llvm::sys::ScopedLock Guard(Lock);
+    setPtr &Result = Added[std::make_pair(P, t)];
+    if (!Result) {
+      svset<Ty> s;
+      if (P)
+        s.insert(P->begin(), P->end());
+      s.insert(t);
+      Result = intern(s);
+    }
+    return Result;
   }
 };
 
 
 
 #endif	/* _SUPER_SET_H */
-
@@ -0,0 +1,136 @@
+#ifndef _SV_ORDERED_MAP_HH_
+#define _SV_ORDERED_MAP_HH_ 1
+
+#include "llvm/ADT/SmallVector.h"
+
+#include <algorithm>
+#include <utility>
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/// A map implemented atop a sorted vector of (key, value) pairs.  The first
+/// InlineSize entries are kept in the object itself, so small maps need no
+/// heap allocation.
+/// Iterators and references are not stable accross insert or delete
+template< typename Key, typename T, unsigned InlineSize = 4 >
+class svmap {
+public:
+  typedef Key                    key_type;
+  typedef T                      mapped_type;
+  typedef std::pair<Key, T>      value_type;
+
+private:
+  typedef llvm::SmallVector<value_type, InlineSize> internal_type;
+
+public:
+  typedef typename internal_type::iterator iterator;
+  typedef typename internal_type::const_iterator const_iterator;
+  typedef typename internal_type::size_type size_type;
+
+private:
+
+  internal_type container_;
+
+  static bool key_less(const value_type& v, const key_type& k) {
+    return v.first < k;
+  }
+
+public:
+  /// Empty constructor.
+  svmap()
+  : container_() { }
+
+  /// Copy-constructor.
+  svmap(const svmap& rhs)
+  : container_(rhs.container_)
+  {}
+
+  /// Affectation of a sorted vector to another one.
+  svmap & operator=(const svmap& rhs) {
+    if (&rhs != this) {
+      this->container_ = rhs.container_;
+    }
+    return *this;
+  }
+
+  /// Returns the beginning of the sorted vector.
+  const_iterator begin() const {
+    return container_.begin();
+  }
+
+  /// Returns the end of the sorted vector.
+  const_iterator end() const {
+    return container_.end();
+  }
+
+  /// Returns the beginning of the sorted vector.
+  iterator begin() {
+    return container_.begin();
+  }
+
+  /// Returns the end of the sorted vector.
+  iterator end() {
+    return container_.end();
+  }
+
+  bool empty() const {
+    return container_.empty();
+  }
+
+  size_type size() const {
+    return container_.size();
+  }
+
+  /// Return the value of key k, inserting a default one if there is none.
+  mapped_type& operator[](const key_type& k) {
+    iterator i = std::lower_bound(container_.begin(), container_.end(), k,
+                                  key_less);
+    if (i == container_.end() || k < i->first)
+      i = container_.insert(i, value_type(k, mapped_type()));
+    return i->second;
+  }
+
+  iterator erase(iterator position) {
+    return container_.erase(position);
+  }
+
+  size_type erase(const key_type& k) {
+    iterator i = find(k);
+    if (i != end()) {
+      erase(i);
+      return 1;
+    }
+    return 0;
+  }
+
+  /// Swap the content of two sorted_vector.
+  void swap(svmap& s) {
+    container_.swap(s.container_);
+  }
+
+  void clear() {
+    container_.clear();
+  }
+
+  /// Find the key k.
+
+  const_iterator find(const key_type& k) const {
+    const_iterator i = std::lower_bound(container_.begin(), container_.end(), k,
+                                        key_less);
+    if (i != container_.end() && i->first == k) return i;
+    return container_.end();
+  }
+
+  iterator find(const key_type& k) {
+    iterator i = std::lower_bound(container_.begin(), container_.end(), k,
+                                  key_less);
+    if (i != container_.end() && i->first == k) return i;
+    return container_.end();
+  }
+
+  bool count(const key_type& k) const {
+    return find(k) != end();
+  }
+};
+
+#endif
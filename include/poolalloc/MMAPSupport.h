@@ -12,6 +12,9 @@
 //
 //===----------------------------------------------------------------------===//
 
+#ifndef POOLALLOC_MMAPSUPPORT_H
+#define POOLALLOC_MMAPSUPPORT_H
+
 #include "poolalloc/Config/config.h"
 #include <cstdlib>
 #include <cassert>
@@ -55,3 +58,5 @@ AllocateSpaceWithMMAP(size_t Size, bool UseNoReserve = false) {
   assert(Mem != MAP_FAILED && "couldn't get space!");
   return Mem;
 }
+
+#endif
@@ -0,0 +1,329 @@
+//===- PageCache.h - Thread safe page allocator -----------------*- C++ -*-===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the page allocation half of the PageManager.h interface
+// for the pool allocator runtimes: AllocatePage, FreePage, AllocateNPages and
+// FreeNPages.  A runtime includes it into exactly one source file, after its
+// own PageManager.h, which provides PageSize.
+//
+// Single pages come from a small cache private to each thread, backed by a
+// global lock-free stack of free pages.  When both are empty, pages are mapped
+// in batches which grow each time the process runs dry.  Runs of several pages
+// are kept in a separate list, which AllocateNPages searches before mapping a
+// new run, so the pages of freed arrays are reused.  Once more than
+// MaxIdlePages pages sit unused, the excess is handed back to the operating
+// system with madvise; the address space itself is never unmapped, so a stale
+// pointer into a free page can still be read safely.
+//
+// The idle page limit defaults to 1024 pages and can be changed with the
+// POOLALLOC_MAX_IDLE_PAGES environment variable.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef POOLALLOC_PAGECACHE_H
+#define POOLALLOC_PAGECACHE_H
+
+#include "poolalloc/MMAPSupport.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+namespace {
+  enum {
+    LocalCacheSize = 64,      // Pages cached by each thread.
+    MaxMapBatch = 512,        // The most single pages mapped at once.
+    TrimChunk = 64            // Pages released per madvise pass.
+  };
+
+  // LocalPageCache - The pages owned by one thread.
+  struct LocalPageCache {
+    unsigned Count;
+    void *Pages[LocalCacheSize];
+  };
+
+  // PageRun - A free run of contiguous pages.
+  struct PageRun {
+    char *Start;
+    unsigned NumPages;
+    bool Resident;            // Not yet released with madvise.
+  };
+}
+
+static __thread LocalPageCache LocalPages;
+static __thread bool LocalPagesRegistered;
+
+static pthread_once_t PageCacheOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t PageCacheKey;
+static unsigned MaxIdlePages = 1024;
+
+// The global stack of free pages.  Each free page holds the address of the
+// next one in its first word.  Pages are PageSize aligned, so the low bits of
+// the head carry a counter which is bumped on every update; a pop racing with
+// other threads only succeeds if the head was not changed underneath it.
+static volatile uintptr_t FreeStackHead;
+static volatile long FreeStackSize;
+
+// The number of pages the next mapping will provide.
+static volatile unsigned MapBatch = 8;
+
+// Pages which have been released to the system.  Their contents are gone, so
+// they cannot be linked through the stack above.
+static pthread_mutex_t ReleasedLock = PTHREAD_MUTEX_INITIALIZER;
+static void **ReleasedPages;
+static unsigned NumReleasedPages, ReleasedCapacity;
+
+// Free runs of pages, and how many of their pages are still resident.
+static pthread_mutex_t RunLock = PTHREAD_MUTEX_INITIALIZER;
+static PageRun *Runs;
+static unsigned NumRuns, RunsCapacity;
+static unsigned long IdleRunPages;
+
+static void pushFreePage(void *Page) {
+  uintptr_t TagMask = PageSize - 1, Old, New;
+  do {
+    Old = FreeStackHead;
+    *(uintptr_t*)Page = Old & ~TagMask;
+    New = (uintptr_t)Page | ((Old + 1) & TagMask);
+  } while (!__sync_bool_compare_and_swap(&FreeStackHead, Old, New));
+  __sync_fetch_and_add(&FreeStackSize, 1);
+}
+
+static void *popFreePage() {
+  uintptr_t TagMask = PageSize - 1, Old, New, Top;
+  do {
+    Old = FreeStackHead;
+    Top = Old & ~TagMask;
+    if (!Top) return 0;
+    // Another thread may already own this page; the value read is only used
+    // if the head is unchanged, in which case it is still the link.
+    New = *(volatile uintptr_t*)Top | ((Old + 1) & TagMask);
+  } while (!__sync_bool_compare_and_swap(&FreeStackHead, Old, New));
+  __sync_fetch_and_sub(&FreeStackSize, 1);
+  return (void*)Top;
+}
+
+static void releaseToSystem(void *Start, size_t Size) {
+#ifdef MADV_DONTNEED
+  madvise(Start, Size, MADV_DONTNEED);
+#endif
+}
+
+static int comparePages(const void *A, const void *B) {
+  char *PA = *(char*const*)A, *PB = *(char*const*)B;
+  return PA < PB ? -1 : PA > PB;
+}
+
+// trimFreePages - Release pages from the global stack until at most half of
+// MaxIdlePages remain there.
+static void trimFreePages() {
+  void *Pages[TrimChunk];
+  while (FreeStackSize > (long)MaxIdlePages / 2) {
+    unsigned N = 0;
+    while (N != TrimChunk && FreeStackSize > (long)MaxIdlePages / 2)
+      if (void *Page = popFreePage())
+        Pages[N++] = Page;
+      else
+        break;
+    if (N == 0) return;
+
+    // Release neighbouring pages with one call.
+    qsort(Pages, N, sizeof(void*), comparePages);
+    for (unsigned i = 0; i != N; ) {
+      unsigned e = i + 1;
+      while (e != N && (char*)Pages[e] == (char*)Pages[e-1] + PageSize) ++e;
+      releaseToSystem(Pages[i], (e - i) * PageSize);
+      i = e;
+    }
+
+    pthread_mutex_lock(&ReleasedLock);
+    if (NumReleasedPages + N > ReleasedCapacity) {
+      ReleasedCapacity = ReleasedCapacity ? ReleasedCapacity * 2 : 256;
+      if (ReleasedCapacity < NumReleasedPages + N)
+        ReleasedCapacity = NumReleasedPages + N;
+      ReleasedPages = (void**)realloc(ReleasedPages,
+                                      ReleasedCapacity * sizeof(void*));
+    }
+    for (unsigned i = 0; i != N; ++i)
+      ReleasedPages[NumReleasedPages++] = Pages[i];
+    pthread_mutex_unlock(&ReleasedLock);
+  }
+}
+
+// flushLocalPages - Move Num pages from the thread's cache to the global
+// stack.
+static void flushLocalPages(LocalPageCache *Cache, unsigned Num) {
+  while (Num--)
+    pushFreePage(Cache->Pages[--Cache->Count]);
+  if (FreeStackSize > (long)MaxIdlePages)
+    trimFreePages();
+}
+
+static void threadExit(void *Cache) {
+  LocalPageCache *C = (LocalPageCache*)Cache;
+  flushLocalPages(C, C->Count);
+}
+
+static void initPageCache() {
+  pthread_key_create(&PageCacheKey, threadExit);
+  if (const char *Limit = getenv("POOLALLOC_MAX_IDLE_PAGES"))
+    MaxIdlePages = strtoul(Limit, 0, 0);
+}
+
+// getLocalPages - Return the calling thread's cache, arranging for its pages
+// to be given back when the thread exits.
+static inline LocalPageCache *getLocalPages() {
+  if (__builtin_expect(!LocalPagesRegistered, 0)) {
+    pthread_once(&PageCacheOnce, initPageCache);
+    pthread_setspecific(PageCacheKey, &LocalPages);
+    LocalPagesRegistered = true;
+  }
+  return &LocalPages;
+}
+
+// takeFromRuns - Carve Num pages out of the smallest free run which is large
+// enough, or return null if there is none.
+static void *takeFromRuns(unsigned Num) {
+  if (!NumRuns) return 0;
+  pthread_mutex_lock(&RunLock);
+  unsigned Best = NumRuns;
+  for (unsigned i = 0; i != NumRuns; ++i)
+    if (Runs[i].NumPages >= Num &&
+        (Best == NumRuns || Runs[i].NumPages < Runs[Best].NumPages))
+      Best = i;
+
+  char *Result = 0;
+  if (Best != NumRuns) {
+    PageRun &R = Runs[Best];
+    Result = R.Start;
+    if (R.Resident)
+      IdleRunPages -= IdleRunPages < Num ? IdleRunPages : Num;
+    if (R.NumPages == Num)
+      R = Runs[--NumRuns];
+    else {
+      R.Start += Num * PageSize;
+      R.NumPages -= Num;
+    }
+  }
+  pthread_mutex_unlock(&RunLock);
+  return Result;
+}
+
+static void *takeReleasedPage() {
+  if (!NumReleasedPages) return 0;
+  void *Page = 0;
+  pthread_mutex_lock(&ReleasedLock);
+  if (NumReleasedPages)
+    Page = ReleasedPages[--NumReleasedPages];
+  pthread_mutex_unlock(&ReleasedLock);
+  return Page;
+}
+
+// mapPages - Map a new batch of single pages, keep one, and stock the caches
+// with the rest.  Each batch is twice the size of the last, up to MaxMapBatch.
+static void *mapPages(LocalPageCache *Cache) {
+  unsigned Batch = MapBatch;
+  if (Batch < MaxMapBatch)
+    __sync_bool_compare_and_swap(&MapBatch, Batch, Batch * 2);
+
+  char *Ptr = (char*)AllocateSpaceWithMMAP(Batch * PageSize);
+  unsigned i = 1;
+  for (; i != Batch && Cache->Count != LocalCacheSize / 2; ++i)
+    Cache->Pages[Cache->Count++] = Ptr + i*PageSize;
+  for (; i != Batch; ++i)
+    pushFreePage(Ptr + i*PageSize);
+  return Ptr;
+}
+
+/// AllocatePage - This function returns a chunk of memory with size and
+/// alignment specified by PageSize.
+void *AllocatePage() {
+  LocalPageCache *Cache = getLocalPages();
+  if (__builtin_expect(Cache->Count != 0, 1))
+    return Cache->Pages[--Cache->Count];
+
+  // Refill half of the cache from the global stack.
+  void *Page = popFreePage();
+  if (Page) {
+    while (Cache->Count != LocalCacheSize / 2)
+      if (void *Next = popFreePage())
+        Cache->Pages[Cache->Count++] = Next;
+      else
+        break;
+    return Page;
+  }
+
+  if ((Page = takeReleasedPage()) || (Page = takeFromRuns(1)))
+    return Page;
+  return mapPages(Cache);
+}
+
+/// FreePage - This function returns the specified page to the pagemanager for
+/// future allocation.
+void FreePage(void *Page) {
+  LocalPageCache *Cache = getLocalPages();
+  if (__builtin_expect(Cache->Count == LocalCacheSize, 0))
+    flushLocalPages(Cache, LocalCacheSize / 2);
+  Cache->Pages[Cache->Count++] = Page;
+}
+
+/// AllocateNPages - Return Num contiguous pages, aligned to PageSize.
+void *AllocateNPages(unsigned Num) {
+  if (Num <= 1) return AllocatePage();
+  if (void *Run = takeFromRuns(Num))
+    return Run;
+  return AllocateSpaceWithMMAP(Num * PageSize);
+}
+
+/// FreeNPages - Return Num contiguous pages obtained from AllocateNPages, or
+/// any part of such a run, to the page manager.  Neighbouring free runs are
+/// merged.
+void FreeNPages(void *Page, unsigned Num) {
+  if (Num <= 1) {
+    if (Num) FreePage(Page);
+    return;
+  }
+
+  PageRun New;
+  New.Start = (char*)Page;
+  New.NumPages = Num;
+  New.Resident = true;
+
+  pthread_mutex_lock(&RunLock);
+  for (unsigned i = 0; i != NumRuns; ) {
+    PageRun &R = Runs[i];
+    if (R.Start + R.NumPages * PageSize == New.Start)
+      New.Start = R.Start;
+    else if (New.Start + New.NumPages * PageSize != R.Start) {
+      ++i;
+      continue;
+    }
+    New.NumPages += R.NumPages;
+    R = Runs[--NumRuns];
+  }
+
+  if (NumRuns == RunsCapacity) {
+    RunsCapacity = RunsCapacity ? RunsCapacity * 2 : 16;
+    Runs = (PageRun*)realloc(Runs, RunsCapacity * sizeof(PageRun));
+  }
+  Runs[NumRuns++] = New;
+
+  // Release every resident run once too many pages are idle.
+  IdleRunPages += Num;
+  if (IdleRunPages > MaxIdlePages) {
+    for (unsigned i = 0; i != NumRuns; ++i)
+      if (Runs[i].Resident) {
+        releaseToSystem(Runs[i].Start, Runs[i].NumPages * PageSize);
+        Runs[i].Resident = false;
+      }
+    IdleRunPages = 0;
+  }
+  pthread_mutex_unlock(&RunLock);
+}
+
+#endif
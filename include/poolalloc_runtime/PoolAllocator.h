@@ -1,8 +1,9 @@
-#include "poolalloc_runtime/Support/SplayTree.h"
+#include "poolalloc_runtime/Support/RangePageMap.h"
 #include "llvm/ADT/hash_map.h"
 #include <algorithm>
 #include <cassert>
 #include <cstdlib>
+#include <stdint.h>
 #include <sys/mman.h>
 
 template<class SlabManager >
@@ -50,12 +51,15 @@ class PoolAllocator : SlabManager {
 
 };
 
+// MallocSlabManager - Allocate objects from DataAllocator and record their
+// ranges in a RangePageMap, so that looking up an object does not modify any
+// shared state.
 template<class SafeAllocator = std::allocator<void>, class DataAllocator = std::allocator<void> >
 class MallocSlabManager {
   typedef typename DataAllocator::template rebind<char>::other DAlloc;
   typedef typename SafeAllocator::template rebind<void>::other SAlloc;
 
-  RangeSplaySet<SAlloc> objs;
+  RangePageMap<SAlloc> objs;
   unsigned objsize;
 
   DAlloc allocator;
@@ -101,22 +105,37 @@ class MallocSlabManager {
 template<class PageManager, unsigned PageShiftAmount = 6, unsigned load = 80,
   class SafeAllocator = std::allocator<void> >
 class BitMaskSlabManager {
+  // Each slab has one bit per object, set when the object is allocated, and a
+  // summary with one bit per bitmask word, set when that word is full.  Free
+  // objects are found by scanning the summary and then one bitmask word, a
+  // word at a time.
+  //
+  // Slabs are aligned to their size, so the slab holding an object is found by
+  // masking its address, and the metadata with one lookup keyed by the slab.
+  // The metadata is kept out of the slab so that stray pointers can be checked
+  // without touching memory that may not be mapped.  Slabs which have free
+  // space, other than the one being allocated from, are kept on a list.
   struct slab_metadata {
     void* data;
     unsigned* free_bitmask;
+    unsigned* full_summary;
+    slab_metadata* next_partial;
+    bool on_partial_list;
   };
 
+  enum { BitsPerWord = sizeof(unsigned) * 8 };
+
   typedef typename SafeAllocator::template rebind<std::pair<void*, slab_metadata> >::other SAlloc;
   typedef typename SafeAllocator::template rebind<unsigned>::other SBMAlloc;
   typedef hash_map<void*, slab_metadata , hash<void*>, std::equal_to<void*>, SAlloc> MapTy;
 
   MapTy slabmetadata;
-  hash_map<void*, void*, hash<void*>, std::equal_to<void*>, SAlloc> mappedPages;
 
   SBMAlloc BMAlloc;
 
   unsigned objsize;
   slab_metadata* CurAllocSlab;
+  slab_metadata* PartialSlabs;
   unsigned totalslots;
   unsigned totalallocs;
 
@@ -125,15 +144,21 @@ class BitMaskSlabManager {
   }
 
   unsigned numIntsPerSlabMeta() const {
-    return (numObjsPerSlab() + (sizeof(unsigned) * 8 - 1)) / (sizeof(unsigned) * 8);
+    return (numObjsPerSlab() + BitsPerWord - 1) / BitsPerWord;
+  }
+
+  unsigned numIntsPerSummary() const {
+    return (numIntsPerSlabMeta() + BitsPerWord - 1) / BitsPerWord;
+  }
+
+  unsigned slabSize() const {
+    return PageManager::pageSize << PageShiftAmount;
   }
 
   slab_metadata* getSlabForObj(void* obj) {
     intptr_t ptr = (intptr_t)obj;
-    ptr &= ~(PageManager::pageSize - 1);
-    void* page = (void*)ptr;
-    page = mappedPages[page];
-    typename MapTy::iterator ii = slabmetadata.find(page);
+    ptr &= ~(intptr_t)(slabSize() - 1);
+    typename MapTy::iterator ii = slabmetadata.find((void*)ptr);
     if (ii == slabmetadata.end()) return 0;
     return &ii->second;
   }
@@ -143,66 +168,84 @@ class BitMaskSlabManager {
   }
 
   unsigned findFree(slab_metadata* slab) const {
-    // FIXME: free_bitmask is treated as a linear array.  A bit-tree representation would be faster
-    
-    for (unsigned y = 0; y < numIntsPerSlabMeta(); ++y) {
-      unsigned zone = slab->free_bitmask[y];
-      if (zone != ~0)
-        for (unsigned x = 0; x < sizeof(unsigned); ++x)
-          if ((zone >> (x * 8) & 0x00FF) != 0x00FF)
-            for (int z = 0; z < 8; ++z)
-              if (!(zone & 1 << (x * 8 + z)))
-                return y * sizeof(unsigned) + x * 8 + z;
+    for (unsigned s = 0, e = numIntsPerSummary(); s != e; ++s) {
+      unsigned notfull = ~slab->full_summary[s];
+      if (notfull) {
+        unsigned y = s * BitsPerWord + __builtin_ctz(notfull);
+        return y * BitsPerWord + __builtin_ctz(~slab->free_bitmask[y]);
+      }
     }
-    return ~0;
+    return ~0U;
   }
 
   bool isFree(slab_metadata* slab, unsigned loc) const {
-    return !(slab->free_bitmask[loc / sizeof(unsigned)] & ( 1 << (loc % sizeof(unsigned))));
+    return !(slab->free_bitmask[loc / BitsPerWord] & (1U << (loc % BitsPerWord)));
   }
 
   void setFree(slab_metadata* slab, unsigned loc) {
-    slab->free_bitmask[loc / sizeof(unsigned)] &= ~( 1 << (loc % sizeof(unsigned)));
+    slab->free_bitmask[loc / BitsPerWord] &= ~(1U << (loc % BitsPerWord));
+    slab->full_summary[loc / (BitsPerWord * BitsPerWord)] &=
+      ~(1U << (loc / BitsPerWord % BitsPerWord));
     --totalallocs;
   }
 
   void setUsed(slab_metadata* slab, unsigned loc) {
-    slab->free_bitmask[loc / sizeof(unsigned)] |= ( 1 << (loc % sizeof(unsigned)));
+    unsigned& word = slab->free_bitmask[loc / BitsPerWord];
+    word |= 1U << (loc % BitsPerWord);
+    if (word == ~0U)
+      slab->full_summary[loc / (BitsPerWord * BitsPerWord)] |=
+        1U << (loc / BitsPerWord % BitsPerWord);
     ++totalallocs;
   }
 
+  // initBitmaps - Clear the bitmaps of a new slab.  The bits past the last
+  // object, in the bitmask and in the summary, are set so that they are never
+  // found free.
+  void initBitmaps(slab_metadata& slab) {
+    unsigned ints = numIntsPerSlabMeta();
+    std::fill(slab.free_bitmask, slab.free_bitmask + ints, 0);
+    std::fill(slab.full_summary, slab.full_summary + numIntsPerSummary(), 0);
+    if (unsigned tail = numObjsPerSlab() % BitsPerWord)
+      slab.free_bitmask[ints - 1] = ~0U << tail;
+    if (unsigned tail = ints % BitsPerWord)
+      slab.full_summary[ints / BitsPerWord] = ~0U << tail;
+  }
+
   void createOrSetNewSlab() {
-    if (!totalslots || ((totalallocs * 100) / totalslots > load)) {
-      // Create new slab
-      void* mem = PageManager::getPages(1 << PageShiftAmount);
-      slab_metadata& slab = slabmetadata[mem];
-      slab.data = mem;
-      slab.free_bitmask = BMAlloc.allocate(numIntsPerSlabMeta());
-      std::fill(slab.free_bitmask, slab.free_bitmask + numIntsPerSlabMeta(), 0);
-      CurAllocSlab = &slab;
-      totalslots += numObjsPerSlab();
-      for (unsigned x = 0; x < (1 << PageShiftAmount); ++x)
-        mappedPages[(void*) &(((char*)mem)[x * PageManager::pageSize])] = mem;
-    } else {
-      // Find a slab with some free space
-      for (typename MapTy::iterator ii = slabmetadata.begin(),
-             ee = slabmetadata.end(); ii != ee; ++ii)
-        if (findFree(&ii->second)) {
-          CurAllocSlab = &ii->second;
-          break;
-        }
+    if (PartialSlabs && totalallocs * 100 / totalslots <= load) {
+      // Reuse a slab with some free space
+      CurAllocSlab = PartialSlabs;
+      PartialSlabs = CurAllocSlab->next_partial;
+      CurAllocSlab->on_partial_list = false;
+      return;
     }
+
+    // Create new slab
+    void* mem = PageManager::getPages(1 << PageShiftAmount);
+    assert(((intptr_t)mem & (slabSize() - 1)) == 0 && "Slab is not aligned!");
+    slab_metadata& slab = slabmetadata[mem];
+    slab.data = mem;
+    slab.free_bitmask =
+      BMAlloc.allocate(numIntsPerSlabMeta() + numIntsPerSummary());
+    slab.full_summary = slab.free_bitmask + numIntsPerSlabMeta();
+    slab.next_partial = 0;
+    slab.on_partial_list = false;
+    initBitmaps(slab);
+    CurAllocSlab = &slab;
+    totalslots += numObjsPerSlab();
   }
 
   public:
   BitMaskSlabManager(unsigned Osize, unsigned Alignment) 
-  :objsize(Osize), CurAllocSlab(0), totalslots(0), totalallocs(0)
+  :objsize(Osize), CurAllocSlab(0), PartialSlabs(0), totalslots(0),
+   totalallocs(0)
   {}
   ~BitMaskSlabManager() {
     for (typename MapTy::const_iterator ii = slabmetadata.begin(),
            ee = slabmetadata.end(); ii != ee; ++ii) {
       PageManager::freePages(ii->second.data, 1 << PageShiftAmount);
-      BMAlloc.deallocate(ii->second.free_bitmask, numIntsPerSlabMeta());
+      BMAlloc.deallocate(ii->second.free_bitmask,
+                         numIntsPerSlabMeta() + numIntsPerSummary());
     }
   }
     
@@ -214,7 +257,7 @@ class BitMaskSlabManager {
     if (!CurAllocSlab)
       createOrSetNewSlab();
     unsigned loc = findFree(CurAllocSlab);
-    if (loc == ~0) {
+    if (loc == ~0U) {
       CurAllocSlab = 0;
       return slab_alloc(num);
     }
@@ -228,6 +271,14 @@ class BitMaskSlabManager {
       abort();
     }
     setFree(slab, getObjLoc(slab, obj));
+
+    // A slab other than the current one is either already on the partial
+    // list or was full until now.
+    if (slab != CurAllocSlab && !slab->on_partial_list) {
+      slab->next_partial = PartialSlabs;
+      slab->on_partial_list = true;
+      PartialSlabs = slab;
+    }
   }
   bool slab_valid(void* obj) {
     slab_metadata* slab = getSlabForObj(obj);
@@ -243,8 +294,8 @@ class BitMaskSlabManager {
     if (!slab) return false;
     unsigned loc = getObjLoc(slab, obj);
     if (isFree(slab, loc)) return false;
-    start = &(char*)(slab->data)[loc * objsize];
-    end = &(char*)(slab->data)[loc * objsize] - 1;
+    start = &((char*)slab->data)[loc * objsize];
+    end = &((char*)slab->data)[(loc + 1) * objsize] - 1;
     return true;
   }
 };
@@ -288,8 +339,21 @@ class CompoundSlabManager {
 class LinuxMmap {
  public:
   enum d {pageSize = 4096};
+  // getPages - Return num pages aligned to their size rounded up to a power of
+  // two.  More is mapped than needed and the ends are unmapped again.
   static void* getPages(unsigned num) {
-    return mmap(0, pageSize * num, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t size = (size_t)pageSize * num;
+    size_t align = pageSize;
+    while (align < size) align <<= 1;
+    size_t mapped = size + align - pageSize;
+    char* mem = (char*)mmap(0, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == (char*)MAP_FAILED) return 0;
+    char* start = (char*)(((uintptr_t)mem + align - 1) & ~(uintptr_t)(align - 1));
+    if (start != mem)
+      munmap(mem, start - mem);
+    if (start + size != mem + mapped)
+      munmap(start + size, mem + mapped - (start + size));
+    return start;
   }
   static void freePages(void* page, unsigned num) {
     munmap(page, num * pageSize);
@@ -0,0 +1,347 @@
+//===-- RangePageMap.h - Page indexed map of address ranges -----*- C++ -*-===//
+//
+//                         Automatic Pool Allocation
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements RangePageMap, a set of disjoint address ranges with the
+// same interface as RangeSplaySet.  A three level radix tree indexed by page
+// number leads to a sorted array of the ranges which overlap each page, so a
+// lookup is a few dependent loads and a binary search.
+//
+// Ranges spanning more than MaxPages pages would need an entry in every page,
+// so they are kept in a separate sorted array instead, as are ranges beyond
+// the 48 bit address space the radix tree covers.  Large ranges are rare, so
+// inserting into and removing from that array by moving its tail is cheap
+// enough.
+//
+// Unlike the splay tree, find only reads the map, whether the range is found
+// in the radix tree or in the array of large ranges, and it never allocates,
+// so any number of threads may look up ranges at the same time.  Inserting and
+// removing must still be serialized with respect to everything else.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef SUPPORT_RANGEPAGEMAP_H
+#define SUPPORT_RANGEPAGEMAP_H
+
+#include <cstring>
+#include <memory>
+#include <stdint.h>
+
+template<class Allocator = std::allocator<void>, unsigned MaxPages = 8>
+class RangePageMap {
+  enum {
+    PageShift = 12,
+    LevelBits = 12,
+    LevelSize = 1 << LevelBits
+  };
+
+  struct range {
+    char* start;
+    char* end;            // The last valid address.
+  };
+
+  // page_ranges - The ranges overlapping one page, sorted by address.
+  struct page_ranges {
+    unsigned count;
+    unsigned capacity;
+    range ranges[1];
+  };
+
+  typedef page_ranges* leaf_node[LevelSize];
+  typedef leaf_node* mid_node[LevelSize];
+
+  typedef typename Allocator::template rebind<char>::other CAlloc;
+
+  CAlloc alloc;
+  mid_node** root;        // LevelSize entries, allocated on first insert
+
+  // The large ranges, sorted by address.
+  range* large;
+  unsigned large_count;
+  unsigned large_capacity;
+
+  static uintptr_t page_of(const void* p) {
+    return (uintptr_t)p >> PageShift;
+  }
+
+  // in_tree - Return true if the page is covered by the radix tree.
+  static bool in_tree(uintptr_t page) {
+    return ((uint64_t)page >> (3 * LevelBits)) == 0;
+  }
+
+  template<class T>
+  T* allocate_zeroed(size_t n) {
+    T* p = (T*)alloc.allocate(n * sizeof(T));
+    memset(p, 0, n * sizeof(T));
+    return p;
+  }
+
+  template<class T>
+  void deallocate(T* p, size_t n) {
+    alloc.deallocate((char*)p, n * sizeof(T));
+  }
+
+  // get_page - Return the ranges of the page, or null if there are none.
+  page_ranges* get_page(uintptr_t page) const {
+    if (!root || !in_tree(page)) return 0;
+    mid_node* m = root[page >> (2 * LevelBits)];
+    if (!m) return 0;
+    leaf_node* l = (*m)[(page >> LevelBits) & (LevelSize - 1)];
+    if (!l) return 0;
+    return (*l)[page & (LevelSize - 1)];
+  }
+
+  // get_slot - Return where the ranges of the page are kept, creating the
+  // radix tree nodes on the way if needed.
+  page_ranges*& get_slot(uintptr_t page) {
+    if (!root)
+      root = allocate_zeroed<mid_node*>(LevelSize);
+    mid_node*& m = root[page >> (2 * LevelBits)];
+    if (!m)
+      m = allocate_zeroed<mid_node>(1);
+    leaf_node*& l = (*m)[(page >> LevelBits) & (LevelSize - 1)];
+    if (!l)
+      l = allocate_zeroed<leaf_node>(1);
+    return (*l)[page & (LevelSize - 1)];
+  }
+
+  static size_t page_ranges_bytes(unsigned capacity) {
+    return sizeof(page_ranges) + (capacity - 1) * sizeof(range);
+  }
+
+  // lower_bound - Return the index of the first range in p ending at or after
+  // key.
+  static unsigned lower_bound(const page_ranges* p, const char* key) {
+    unsigned lo = 0, hi = p->count;
+    while (lo < hi) {
+      unsigned mid = (lo + hi) / 2;
+      if (p->ranges[mid].end < key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo;
+  }
+
+  const range* find_small(void* key) const {
+    page_ranges* p = get_page(page_of(key));
+    if (!p) return 0;
+    unsigned i = lower_bound(p, (char*)key);
+    if (i == p->count || p->ranges[i].start > (char*)key) return 0;
+    return &p->ranges[i];
+  }
+
+  // find_large - Return the large range containing key, or null.
+  const range* find_large(void* key) const {
+    unsigned lo = 0, hi = large_count;
+    while (lo < hi) {
+      unsigned mid = (lo + hi) / 2;
+      if (large[mid].end < (char*)key)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == large_count || large[lo].start > (char*)key) return 0;
+    return &large[lo];
+  }
+
+  void add_large(char* start, char* end) {
+    if (large_count == large_capacity) {
+      unsigned capacity = large_capacity ? large_capacity * 2 : 16;
+      range* n = (range*)alloc.allocate(capacity * sizeof(range));
+      if (large) {
+        memcpy(n, large, large_count * sizeof(range));
+        deallocate(large, large_capacity);
+      }
+      large = n;
+      large_capacity = capacity;
+    }
+    unsigned i = 0;
+    while (i != large_count && large[i].start < start)
+      ++i;
+    memmove(&large[i + 1], &large[i], (large_count - i) * sizeof(range));
+    large[i].start = start;
+    large[i].end = end;
+    ++large_count;
+  }
+
+  void remove_large(const range* r) {
+    unsigned i = r - large;
+    memmove(&large[i], &large[i + 1], (large_count - i - 1) * sizeof(range));
+    --large_count;
+  }
+
+  // visit_large - Call act once for every large range, and free the array if
+  // release is set.
+  template<class O>
+  void visit_large(O& act, bool release) {
+    for (unsigned i = 0; i != large_count; ++i)
+      act(large[i].start, large[i].end);
+    if (release) {
+      if (large)
+        deallocate(large, large_capacity);
+      large = 0;
+      large_count = large_capacity = 0;
+    }
+  }
+
+  void add_to_page(uintptr_t page, char* start, char* end) {
+    page_ranges*& p = get_slot(page);
+    if (!p || p->count == p->capacity) {
+      unsigned capacity = p ? p->capacity * 2 : 4;
+      page_ranges* n = (page_ranges*)alloc.allocate(page_ranges_bytes(capacity));
+      n->count = p ? p->count : 0;
+      n->capacity = capacity;
+      if (p) {
+        memcpy(n->ranges, p->ranges, p->count * sizeof(range));
+        alloc.deallocate((char*)p, page_ranges_bytes(p->capacity));
+      }
+      p = n;
+    }
+    unsigned i = lower_bound(p, start);
+    memmove(&p->ranges[i + 1], &p->ranges[i], (p->count - i) * sizeof(range));
+    p->ranges[i].start = start;
+    p->ranges[i].end = end;
+    ++p->count;
+  }
+
+  void remove_from_page(uintptr_t page, char* start) {
+    page_ranges*& p = get_slot(page);
+    unsigned i = lower_bound(p, start);
+    memmove(&p->ranges[i], &p->ranges[i + 1], (p->count - i - 1) * sizeof(range));
+    if (--p->count == 0) {
+      alloc.deallocate((char*)p, page_ranges_bytes(p->capacity));
+      p = 0;
+    }
+  }
+
+  static bool is_small(void* start, void* end) {
+    return in_tree(page_of(end)) && page_of(end) - page_of(start) < MaxPages;
+  }
+
+  // visit - Call act once for every range in the radix tree, at the page it
+  // starts in, and free the tree if release is set.
+  template<class O>
+  void visit(O& act, bool release) {
+    if (!root) return;
+    for (unsigned r = 0; r != LevelSize; ++r) {
+      mid_node* m = root[r];
+      if (!m) continue;
+      for (unsigned i = 0; i != LevelSize; ++i) {
+        leaf_node* l = (*m)[i];
+        if (!l) continue;
+        for (unsigned j = 0; j != LevelSize; ++j) {
+          page_ranges* p = (*l)[j];
+          if (!p) continue;
+          uintptr_t page = ((uintptr_t)r << (2 * LevelBits)) |
+                           ((uintptr_t)i << LevelBits) | j;
+          for (unsigned k = 0; k != p->count; ++k)
+            if (page_of(p->ranges[k].start) == page)
+              act(p->ranges[k].start, p->ranges[k].end);
+          if (release)
+            alloc.deallocate((char*)p, page_ranges_bytes(p->capacity));
+        }
+        if (release) deallocate(l, 1);
+      }
+      if (release) deallocate(m, 1);
+    }
+    if (release) {
+      deallocate(root, LevelSize);
+      root = 0;
+    }
+  }
+
+  struct count_actor {
+    unsigned n;
+    void operator()(char*, char*) { ++n; }
+  };
+
+  template<class O>
+  struct call_actor {
+    O& act;
+    explicit call_actor(O& a) : act(a) {}
+    void operator()(char* start, char* end) {
+      void* s = start;
+      void* e = end;
+      act(s, e);
+    }
+  };
+
+  struct null_actor {
+    void operator()(char*, char*) {}
+  };
+
+  RangePageMap(const RangePageMap&);
+  void operator=(const RangePageMap&);
+
+ public:
+  explicit RangePageMap(const Allocator& A = Allocator())
+    : alloc(A), root(0), large(0), large_count(0), large_capacity(0) {}
+  ~RangePageMap() { clear(); }
+
+  // insert - Add the range [start, end].  Fails if start is already in a
+  // range.
+  bool insert(void* start, void* end) {
+    if (find(start)) return false;
+    if (!is_small(start, end)) {
+      add_large((char*)start, (char*)end);
+      return true;
+    }
+    for (uintptr_t p = page_of(start), e = page_of(end); p <= e; ++p)
+      add_to_page(p, (char*)start, (char*)end);
+    return true;
+  }
+
+  // remove - Remove the range containing key.
+  bool remove(void* key) {
+    const range* r = find_small(key);
+    if (!r) {
+      if (!(r = find_large(key))) return false;
+      remove_large(r);
+      return true;
+    }
+    char* start = r->start;
+    for (uintptr_t p = page_of(start), e = page_of(r->end); p <= e; ++p)
+      remove_from_page(p, start);
+    return true;
+  }
+
+  unsigned count() {
+    count_actor act;
+    act.n = 0;
+    visit(act, false);
+    return act.n + large_count;
+  }
+
+  void clear() {
+    null_actor act;
+    visit(act, true);
+    visit_large(act, true);
+  }
+
+  template <class O>
+  void clear(O& act) {
+    call_actor<O> fwd(act);
+    visit(fwd, true);
+    visit_large(fwd, true);
+  }
+
+  bool find(void* key, void*& start, void*& end) const {
+    const range* r = find_small(key);
+    if (!r && !(r = find_large(key))) return false;
+    start = r->start;
+    end = r->end;
+    return true;
+  }
+
+  bool find(void* key) const {
+    return find_small(key) || find_large(key);
+  }
+};
+
+#endif
@@ -7,8 +7,9 @@
 //
 //===----------------------------------------------------------------------===//
 //
-// This file implements a test pass which helps test the generation of formulas
-// and constraints.
+// This file implements a pass which counts how often each load and store runs,
+// and how many of those are type safe.  The counts are kept per thread and
+// written out by the runtime in runtime/DynCount.
 //
 //===----------------------------------------------------------------------===//
 
@@ -16,13 +17,18 @@
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "dsa/TypeSafety.h"
 
+#include <vector>
+
 using namespace llvm;
 class Dyncount : public ModulePass {
 protected:
-  void instrumentLoad (GlobalVariable * Counter, LoadInst * LI);
-  void instrumentStore (GlobalVariable * Counter, StoreInst * SI);
+  void instrumentAccess (Constant * Counters, unsigned Id, Instruction * I);
+  void registerThread (Function & F, Constant * Counters, unsigned NumSites,
+                       GlobalVariable * Ready);
   dsa::TypeSafety<TDDataStructures> *TS;
 
 public:
@@ -42,37 +48,72 @@ static RegisterPass<Dyncount>
 X ("dyncount", "Instrument code to count number of Load/Stores");
 
 
+//
+// Method: instrumentAccess()
+//
+// Description:
+//  Increment the counter of the load or store I, which is element Id of the
+//  thread-local array Counters.
+//
 void
-Dyncount::instrumentLoad (GlobalVariable * Counter, LoadInst * LI) {
+Dyncount::instrumentAccess (Constant * Counters, unsigned Id, Instruction * I) {
   //
-  // Generate a load, increment, and store right before the GEP.
+  // Generate a load, increment, and store right before the access.
   //
-  LLVMContext & Context = Counter->getParent()->getContext();
-  ConstantInt * One = ConstantInt::get (Type::getInt64Ty(Context), 1); 
-  LoadInst * OldValue = new LoadInst (Counter, "count", LI);
+  LLVMContext & Context = Counters->getContext();
+  Type * Int64Ty = Type::getInt64Ty(Context);
+  Constant * Idx[] = { ConstantInt::get (Int64Ty, 0),
+                       ConstantInt::get (Int64Ty, Id) };
+  Constant * Counter = ConstantExpr::getInBoundsGetElementPtr (
+    cast<PointerType>(Counters->getType())->getElementType(), Counters, Idx);
+  ConstantInt * One = ConstantInt::get (Int64Ty, 1);
+  LoadInst * OldValue = new LoadInst (Counter, "count", I);
   Instruction * NewValue = BinaryOperator::Create (BinaryOperator::Add,
                                                    OldValue,
                                                    One,
                                                    "count",
-                                                   LI);
-  new StoreInst (NewValue, Counter, LI);
+                                                   I);
+  new StoreInst (NewValue, Counter, I);
   return;
 }
+
+//
+// Method: registerThread()
+//
+// Description:
+//  Make F register the calling thread's counters with the runtime, unless the
+//  thread-local flag Ready shows it has done so already.  The check is placed
+//  after the allocas of the entry block, so that they stay static.
+//
 void
-Dyncount::instrumentStore (GlobalVariable * Counter, StoreInst * SI) {
-  //
-  // Generate a load, increment, and store right before the GEP.
-  //
-  LLVMContext & Context = Counter->getParent()->getContext();
-  ConstantInt * One = ConstantInt::get (Type::getInt64Ty(Context), 1); 
-  LoadInst * OldValue = new LoadInst (Counter, "count", SI);
-  Instruction * NewValue = BinaryOperator::Create (BinaryOperator::Add,
-                                                   OldValue,
-                                                   One,
-                                                   "count",
-                                                   SI);
-  new StoreInst (NewValue, Counter, SI);
-  return;
+Dyncount::registerThread (Function & F, Constant * Counters, unsigned NumSites,
+                          GlobalVariable * Ready) {
+  Module & M = *F.getParent();
+  LLVMContext & Context = M.getContext();
+  BasicBlock::iterator InsertPt = F.getEntryBlock().getFirstInsertionPt();
+  while (isa<AllocaInst>(&*InsertPt))
+    ++InsertPt;
+
+  LoadInst * Flag = new LoadInst (Ready, "ready", &*InsertPt);
+  Value * NotReady = new ICmpInst (&*InsertPt, ICmpInst::ICMP_EQ, Flag,
+                                   ConstantInt::get (Flag->getType(), 0),
+                                   "notready");
+  MDNode * Unlikely = MDBuilder(Context).createBranchWeights (1, 1 << 20);
+  TerminatorInst * Then = SplitBlockAndInsertIfThen (NotReady, &*InsertPt,
+                                                     false, Unlikely);
+
+  Constant * Register = M.getOrInsertFunction ("DYN_COUNT_register",
+                                               Type::getVoidTy(Context),
+                                               Type::getInt64PtrTy(Context),
+                                               Type::getInt32Ty(Context),
+                                               Ready->getType(),
+                                               NULL);
+  std::vector<Value *> args;
+  args.push_back (ConstantExpr::getPointerCast (Counters,
+                                                Type::getInt64PtrTy(Context)));
+  args.push_back (ConstantInt::get (Type::getInt32Ty(Context), NumSites));
+  args.push_back (Ready);
+  CallInst::Create (Register, args, "", Then);
 }
 
 //
@@ -83,43 +124,67 @@ Dyncount::instrumentStore (GlobalVariable * Counter, StoreInst * SI) {
 //
 bool
 Dyncount::runOnModule (Module & M) {
-  //
-  // Create two global counters within the module.
-  //
   TS = &getAnalysis<dsa::TypeSafety<TDDataStructures> >();
-  ConstantInt * Zero = ConstantInt::get (Type::getInt64Ty(M.getContext()), 0); 
-  GlobalVariable * Total = new GlobalVariable (M,
-                                               Type::getInt64Ty(M.getContext()),
-                                               false,
-                                               GlobalValue::InternalLinkage,
-                                               Zero,
-                                               "Total");
-  GlobalVariable * Safe = new GlobalVariable (M,
-                                              Type::getInt64Ty(M.getContext()),
-                                              false,
-                                              GlobalValue::InternalLinkage,
-                                              Zero,
-                                              "Safe");
+  LLVMContext & Context = M.getContext();
 
+  //
+  // Number the loads and stores, and record which of them are type safe.
+  //
+  std::vector<Instruction *> Sites;
+  std::vector<uint8_t> SiteIsSafe;
+  std::vector<Function *> Counted;
   for (Module::iterator F = M.begin(); F != M.end(); ++F){
+    unsigned FirstSite = Sites.size();
     for (Function::iterator B = F->begin(), FE = F->end(); B != FE; ++B) {      
       for (BasicBlock::iterator I = B->begin(), BE = B->end(); I != BE; I++) {
         if(LoadInst *LI = dyn_cast<LoadInst>(I)) {
-          instrumentLoad(Total, LI);
-          if(TS->isTypeSafe(LI->getOperand(0),LI->getParent()->getParent()))
-            instrumentLoad(Safe, LI);
-
-          // check if safe
+          Sites.push_back (LI);
+          SiteIsSafe.push_back (TS->isTypeSafe(LI->getOperand(0), &*F));
         } else if(StoreInst *SI = dyn_cast<StoreInst>(I)) {
-          instrumentStore(Total, SI);
-          if(TS->isTypeSafe(SI->getOperand(1),SI->getParent()->getParent()))
-            instrumentStore(Safe, SI);
-          // check if safe
+          Sites.push_back (SI);
+          SiteIsSafe.push_back (TS->isTypeSafe(SI->getOperand(1), &*F));
         }
       }
     }
+    if (Sites.size() != FirstSite)
+      Counted.push_back (&*F);
   }
 
+  //
+  // Create the per-thread counters.  The array is padded and aligned to whole
+  // cache lines, so that the counters of different threads never share one.
+  //
+  Type * Int64Ty = Type::getInt64Ty(Context);
+  unsigned NumCounters = (Sites.size() + 7) & ~7u;
+  if (NumCounters == 0)
+    NumCounters = 8;
+  ArrayType * CountersTy = ArrayType::get (Int64Ty, NumCounters);
+  GlobalVariable * Counters =
+    new GlobalVariable (M, CountersTy, false, GlobalValue::InternalLinkage,
+                        ConstantAggregateZero::get (CountersTy),
+                        "DynCountSites", 0,
+                        GlobalVariable::GeneralDynamicTLSModel);
+  Counters->setAlignment (64);
+  Type * Int8Ty = Type::getInt8Ty(Context);
+  GlobalVariable * Ready =
+    new GlobalVariable (M, Int8Ty, false, GlobalValue::InternalLinkage,
+                        ConstantInt::get (Int8Ty, 0), "DynCountReady", 0,
+                        GlobalVariable::GeneralDynamicTLSModel);
+  Constant * SafeInit = ConstantDataArray::get (Context, SiteIsSafe);
+  GlobalVariable * Safe =
+    new GlobalVariable (M, SafeInit->getType(), true,
+                        GlobalValue::InternalLinkage, SafeInit,
+                        "DynCountSafe");
+
+  for (unsigned i = 0, e = Sites.size(); i != e; ++i)
+    instrumentAccess (Counters, i, Sites[i]);
+
+  //
+  // Any function with a counter may be the first a new thread runs.
+  //
+  for (unsigned i = 0, e = Counted.size(); i != e; ++i)
+    registerThread (*Counted[i], Counters, Sites.size(), Ready);
+
   //
   // Add a call to main() that will record the values on exit().
   //
@@ -127,13 +192,13 @@ Dyncount::runOnModule (Module & M) {
     : M.getFunction ("MAIN__");
 
   BasicBlock & BB = MainFunc->getEntryBlock();
-  Constant * Setup = M.getOrInsertFunction ("DYN_COUNT_setup", Type::getVoidTy(M.getContext()), Total->getType(), Safe->getType(), NULL);
+  Type * SafePtrTy = Type::getInt8PtrTy(Context);
+  Constant * Setup = M.getOrInsertFunction ("DYN_COUNT_setup", Type::getVoidTy(M.getContext()), SafePtrTy, Type::getInt32Ty(Context), NULL);
   std::vector<Value *> args;
-  args.push_back (Total);
-  args.push_back (Safe);
-  CallInst::Create (Setup, args, "", BB.getFirstNonPHI());
+  args.push_back (ConstantExpr::getPointerCast (Safe, SafePtrTy));
+  args.push_back (ConstantInt::get (Type::getInt32Ty(Context), Sites.size()));
+  CallInst::Create (Setup, args, "", &*BB.getFirstInsertionPt());
 
 
   return true;
 }
-
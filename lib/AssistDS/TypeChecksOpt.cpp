@@ -7,7 +7,11 @@
 //
 //===----------------------------------------------------------------------===//
 //
-// This pass removes type checks that are statically proven safe
+// This pass removes type checks that are statically proven safe.  Of the
+// checks that remain, it removes those made redundant by an earlier equal check
+// or store with no change to the type tags of the same DSNode in between, moves
+// loop-invariant checks to the loop preheader, and replaces the check of every
+// element of an array walked by a loop with one range check before the loop.
 //
 //===----------------------------------------------------------------------===//
 
@@ -24,7 +28,14 @@
 #include "llvm/IR/Intrinsics.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/CFG.h"
 
+#include <map>
 #include <vector>
 
 using namespace llvm;
@@ -36,6 +47,9 @@ TC("typechecks-opt", "Remove safe runtime type checks", false, true);
 
 // Pass statistics
 STATISTIC(numSafe,  "Number of statically proven safe type checks");
+STATISTIC(numRedundant, "Number of redundant type checks removed");
+STATISTIC(numHoisted, "Number of loop-invariant type checks hoisted");
+STATISTIC(numRange, "Number of array type checks replaced by range checks");
 
 static Type *VoidTy = 0;
 static Type *Int8Ty = 0;
@@ -53,8 +67,69 @@ static Constant *copyTypeInfo;
 static Constant *setTypeInfo;
 static Constant *checkTypeInst;
 static Constant *getTypeTag;
+static Constant *checkTypeRange;
 static Constant *MallocFunc;
 
+namespace {
+  // The runtime functions which only change the type tags of the memory their
+  // pointer argument points into, and the index of that argument.
+  struct ShadowWriter {
+    const char *Name;
+    unsigned PtrArg;
+  };
+
+  const ShadowWriter ShadowWriters[] = {
+    {"trackStoreInst", 0}, {"trackInitInst", 0}, {"trackUnInitInst", 0},
+    {"copyTypeInfo", 0}, {"setTypeInfo", 0}, {"trackGlobal", 0},
+    {"trackArray", 0}, {"trackStringInput", 0}, {"trackStrncpyInst", 0},
+    {"trackStrcpyInst", 0}, {"trackStrcatInst", 0}, {"trackgetcwd", 0},
+    {"trackgethostname", 0}, {"trackaccept", 0}, {"trackgetsockname", 0},
+    {"trackpoll", 0}, {"trackpipe", 0}, {"trackReadLink", 0},
+    {"checkType", 3}, {"checkTypeRange", 2}
+  };
+
+  // The runtime functions which never change type tags.
+  const char *const ShadowReaders[] = {
+    "getTypeTag", "checkVAArgType", "setVAInfo", "copyVAInfo"
+  };
+
+  // CheckKey - The pointer, type and size of a checkType or trackStoreInst
+  // call.  Two calls with the same key read or write the same type tags.
+  typedef std::pair<Value *, std::pair<Value *, Value *> > CheckKey;
+
+  // CheckFacts - The keys of one function, numbered for the dataflow analysis.
+  // Fact 2*i means that key i has been checked, fact 2*i+1 that its tags were
+  // set by trackStoreInst, which implies the former.
+  struct CheckFacts {
+    std::map<CheckKey, unsigned> Ids;
+    std::vector<const DSNode *> Nodes;
+  };
+}
+
+// getCheckKey - If CI is a checkType or trackStoreInst call, return its key.
+static bool getCheckKey(CallInst *CI, CheckKey &Key, bool &IsStore) {
+  if (CI->getCalledValue() == checkTypeInst) {
+    Key = std::make_pair(CI->getArgOperand(3)->stripPointerCasts(),
+                         std::make_pair(CI->getArgOperand(0),
+                                        CI->getArgOperand(1)));
+    IsStore = false;
+    return true;
+  }
+  if (CI->getCalledValue() == trackStoreInst) {
+    Key = std::make_pair(CI->getArgOperand(0)->stripPointerCasts(),
+                         std::make_pair(CI->getArgOperand(1),
+                                        CI->getArgOperand(2)));
+    IsStore = true;
+    return true;
+  }
+  return false;
+}
+
+// Values without a DSNode may point anywhere.
+static bool mayAlias(const DSNode *A, const DSNode *B) {
+  return !A || !B || A == B;
+}
+
 bool TypeChecksOpt::runOnModule(Module &M) {
   TS = &getAnalysis<dsa::TypeSafety<TDDataStructures> >();
 
@@ -135,7 +210,17 @@ bool TypeChecksOpt::runOnModule(Module &M) {
                                      TypeTagPtrTy, /*dest for type tag*/
                                      Int32Ty, /*tag*/
                                      NULL);
+  checkTypeRange = M.getOrInsertFunction("checkTypeRange",
+                                         VoidTy,
+                                         TypeTagTy,/*type*/
+                                         Int64Ty,/*size*/
+                                         VoidPtrTy,/*ptr*/
+                                         Int64Ty,/*count*/
+                                         Int64Ty,/*stride*/
+                                         Int32Ty,/*tag*/
+                                         NULL);
   MallocFunc = M.getFunction("malloc");
+  DS = &getAnalysis<TDDataStructures>();
 
   for(Value::user_iterator User = trackGlobal->user_begin(); User != trackGlobal->user_end(); ++User) {
     CallInst *CI = dyn_cast<CallInst>(*User);
@@ -257,6 +342,7 @@ bool TypeChecksOpt::runOnModule(Module &M) {
   }
 
   numSafe += toDelete.size();
+  bool Changed = !toDelete.empty();
 
   while(!toDelete.empty()) {
     Instruction *I = toDelete.back();
@@ -264,7 +350,324 @@ bool TypeChecksOpt::runOnModule(Module &M) {
     I->eraseFromParent();
   }
 
-  return (numSafe > 0);
+  unsigned NumBefore = numRedundant + numHoisted + numRange;
+  for (Module::iterator MI = M.begin(), ME = M.end(); MI != ME; ++MI) {
+    Function &F = *MI;
+    if (F.isDeclaration() || !DS->hasDSGraph(F))
+      continue;
+    removeRedundantChecks(F);
+
+    // Each request runs all of the function analyses over F again.  The
+    // dominator tree and the loop info are recomputed in place, but the
+    // ScalarEvolution pass replaces its ScalarEvolution object, so it must be
+    // fetched last.
+    DT = &getAnalysis<DominatorTreeWrapperPass>(F).getDomTree();
+    LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>(F).getLoopInfo();
+    SE = &getAnalysis<ScalarEvolutionWrapperPass>(F).getSE();
+
+    // Visit inner loops first, so that their hoisted checks can move on out
+    // of the enclosing loops.
+    std::vector<Loop *> Loops;
+    for (LoopInfo::iterator I = LI.begin(), E = LI.end(); I != E; ++I)
+      for (po_iterator<Loop *> PI = po_begin(*I), PE = po_end(*I);
+           PI != PE; ++PI)
+        Loops.push_back(*PI);
+    for (unsigned i = 0, e = Loops.size(); i != e; ++i)
+      optimizeLoop(Loops[i], F);
+  }
+
+  return Changed || (numRedundant + numHoisted + numRange != NumBefore);
+}
+
+// getNode - Return the DSNode V points to, or null if it is not known.
+const DSNode *TypeChecksOpt::getNode(Value *V, Function &F) {
+  DSGraph *G = DS->getDSGraph(F);
+  if (!G->hasNodeForValue(V))
+    return 0;
+  return G->getNodeForValue(V).getNode();
+}
+
+// writesShadow - Return true if I may change any type tags.  If only the tags
+// of the memory Ptr points into may change, Clobbers is set to false.
+//
+// Calls to functions defined in the module may reach instrumented code, as may
+// external functions given a function pointer to call back.  Any other
+// external function only changes type tags through the tracking calls the
+// instrumentation places around it.
+bool TypeChecksOpt::writesShadow(Instruction *I, Value *&Ptr, bool &Clobbers) {
+  CallSite CS(I);
+  if (!CS)
+    return false;
+
+  Clobbers = true;
+  Function *F = dyn_cast<Function>(CS.getCalledValue()->stripPointerCasts());
+  if (!F)
+    return true;
+  if (F->isIntrinsic())
+    return false;
+
+  StringRef Name = F->getName();
+  for (unsigned i = 0; i != array_lengthof(ShadowWriters); ++i)
+    if (Name == ShadowWriters[i].Name) {
+      Ptr = CS.getArgument(ShadowWriters[i].PtrArg)->stripPointerCasts();
+      Clobbers = false;
+      return true;
+    }
+  for (unsigned i = 0; i != array_lengthof(ShadowReaders); ++i)
+    if (Name == ShadowReaders[i])
+      return false;
+
+  if (!F->isDeclaration() || Name.startswith("track") || Name == "shadowInit")
+    return true;
+  for (CallSite::arg_iterator A = CS.arg_begin(), E = CS.arg_end(); A != E; ++A)
+    if (PointerType *PT = dyn_cast<PointerType>((*A)->getType()))
+      if (PT->getElementType()->isFunctionTy())
+        return true;
+  return false;
+}
+
+// removeUnusedTypeTags - Remove the getTypeTag calls filling in the metadata
+// buffer MD if nothing else reads it any more.
+void TypeChecksOpt::removeUnusedTypeTags(Value *MD) {
+  AllocaInst *AI = dyn_cast<AllocaInst>(MD->stripPointerCasts());
+  if (!AI)
+    return;
+  std::vector<CallInst *> Fills;
+  for (Value::user_iterator U = AI->user_begin(); U != AI->user_end(); ++U) {
+    CallInst *CI = dyn_cast<CallInst>(*U);
+    if (!CI || CI->getCalledValue() != getTypeTag)
+      return;
+    Fills.push_back(CI);
+  }
+  for (unsigned i = 0, e = Fills.size(); i != e; ++i)
+    Fills[i]->eraseFromParent();
+  AI->eraseFromParent();
+}
+
+// removeRedundantChecks - Remove each checkType call whose key was checked or
+// stored on every path reaching it, and each trackStoreInst call whose key was
+// stored on every path reaching it, with no call in between which may change
+// the type tags of the same DSNode.
+//
+// This is a forward must-availability analysis over the facts of CheckFacts.
+// A redundant call does not change any tags, so it does not kill any facts.
+void TypeChecksOpt::removeRedundantChecks(Function &F) {
+  CheckFacts Facts;
+  for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+    if (CallInst *CI = dyn_cast<CallInst>(&*I)) {
+      CheckKey Key;
+      bool IsStore;
+      if (getCheckKey(CI, Key, IsStore) && !Facts.Ids.count(Key)) {
+        Facts.Ids[Key] = Facts.Nodes.size();
+        Facts.Nodes.push_back(getNode(Key.first, F));
+      }
+    }
+  if (Facts.Nodes.empty())
+    return;
+
+  unsigned NumFacts = 2 * Facts.Nodes.size();
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  std::map<BasicBlock *, BitVector> Out;
+  for (ReversePostOrderTraversal<Function *>::rpo_iterator
+       BI = RPOT.begin(), BE = RPOT.end(); BI != BE; ++BI)
+    Out[*BI] = BitVector(NumFacts, true);
+
+  std::vector<CallInst *> Redundant;
+  bool Changed = true;
+  for (bool Final = false; !Final; ) {
+    // Once nothing changes, make one more pass to find the redundant calls.
+    Final = !Changed;
+    Changed = false;
+    for (ReversePostOrderTraversal<Function *>::rpo_iterator
+         BI = RPOT.begin(), BE = RPOT.end(); BI != BE; ++BI) {
+      BasicBlock *BB = *BI;
+      BitVector Avail(NumFacts, BB != &F.getEntryBlock());
+      for (pred_iterator PI = pred_begin(BB), PE = pred_end(BB); PI != PE; ++PI)
+        if (Out.count(*PI))
+          Avail &= Out[*PI];
+
+      for (BasicBlock::iterator I = BB->begin(), E = BB->end(); I != E; ++I) {
+        Value *Ptr = 0;
+        bool Clobbers;
+        if (!writesShadow(&*I, Ptr, Clobbers))
+          continue;
+        if (Clobbers) {
+          Avail.reset();
+          continue;
+        }
+
+        CheckKey Key;
+        bool IsStore = false;
+        int Id = -1;
+        if (getCheckKey(cast<CallInst>(&*I), Key, IsStore)) {
+          Id = Facts.Ids[Key];
+          if (Avail.test(2*Id + 1) || (!IsStore && Avail.test(2*Id))) {
+            if (Final)
+              Redundant.push_back(cast<CallInst>(&*I));
+            continue;
+          }
+        }
+
+        const DSNode *N = getNode(Ptr, F);
+        for (unsigned i = 0, e = Facts.Nodes.size(); i != e; ++i)
+          if (mayAlias(Facts.Nodes[i], N)) {
+            Avail.reset(2*i);
+            Avail.reset(2*i + 1);
+          }
+        if (Id >= 0) {
+          Avail.set(2*Id);
+          if (IsStore)
+            Avail.set(2*Id + 1);
+        }
+      }
+
+      if (Avail != Out[BB]) {
+        Out[BB] = Avail;
+        Changed = true;
+      }
+    }
+  }
+
+  for (unsigned i = 0, e = Redundant.size(); i != e; ++i) {
+    CallInst *CI = Redundant[i];
+    Value *MD = 0;
+    if (CI->getCalledValue() == checkTypeInst)
+      MD = CI->getArgOperand(2);
+    CI->eraseFromParent();
+    if (MD)
+      removeUnusedTypeTags(MD);
+  }
+  numRedundant += Redundant.size();
+}
+
+// optimizeLoop - Hoist the loop-invariant checks of L to its preheader and
+// replace the checks of the elements of arrays walked by L with range checks.
+// This is only done for checks of DSNodes whose type tags nothing in the loop
+// changes.
+void TypeChecksOpt::optimizeLoop(Loop *L, Function &F) {
+  BasicBlock *Preheader = L->getLoopPreheader();
+  if (!Preheader)
+    return;
+
+  std::vector<std::pair<Instruction *, const DSNode *> > Writes;
+  std::vector<CallInst *> Checks;
+  for (Loop::block_iterator BI = L->block_begin(), BE = L->block_end();
+       BI != BE; ++BI)
+    for (BasicBlock::iterator I = (*BI)->begin(), E = (*BI)->end();
+         I != E; ++I) {
+      Value *Ptr = 0;
+      bool Clobbers;
+      if (!writesShadow(&*I, Ptr, Clobbers))
+        continue;
+      if (Clobbers)
+        return;
+      Writes.push_back(std::make_pair(&*I, getNode(Ptr, F)));
+      if (cast<CallInst>(&*I)->getCalledValue() == checkTypeInst)
+        Checks.push_back(cast<CallInst>(&*I));
+    }
+
+  SmallVector<BasicBlock *, 8> Exiting;
+  L->getExitingBlocks(Exiting);
+
+  for (unsigned c = 0, ce = Checks.size(); c != ce; ++c) {
+    CallInst *CI = Checks[c];
+    Value *Ptr = CI->getArgOperand(3)->stripPointerCasts();
+    const DSNode *N = getNode(Ptr, F);
+    bool Written = false;
+    for (unsigned i = 0, e = Writes.size(); i != e && !Written; ++i)
+      Written = Writes[i].first != CI && mayAlias(Writes[i].second, N);
+    if (Written)
+      continue;
+
+    // The metadata must come from a single getTypeTag of the same pointer in
+    // the loop.
+    AllocaInst *MD = dyn_cast<AllocaInst>(CI->getArgOperand(2));
+    if (!MD)
+      continue;
+    CallInst *Fill = 0;
+    bool OneFill = true;
+    for (Value::user_iterator U = MD->user_begin(); U != MD->user_end(); ++U)
+      if (CallInst *UI = dyn_cast<CallInst>(*U))
+        if (UI->getCalledValue() == getTypeTag) {
+          OneFill = !Fill;
+          Fill = UI;
+        }
+    if (!Fill || !OneFill || !L->contains(Fill) ||
+        Fill->getArgOperand(0)->stripPointerCasts() != Ptr ||
+        Fill->getArgOperand(1) != CI->getArgOperand(1))
+      continue;
+
+    bool Changed = false;
+    if (L->makeLoopInvariant(CI->getArgOperand(3), Changed) &&
+        L->makeLoopInvariant(Fill->getArgOperand(0), Changed) &&
+        L->isLoopInvariant(CI->getArgOperand(0)) &&
+        L->isLoopInvariant(CI->getArgOperand(1))) {
+      // Only hoist checks made on every trip through the loop.
+      bool Always = true;
+      for (unsigned i = 0, e = Exiting.size(); i != e; ++i)
+        Always &= DT->dominates(CI->getParent(), Exiting[i]) &&
+                  DT->dominates(Fill->getParent(), Exiting[i]);
+      if (!Always)
+        continue;
+      Fill->moveBefore(Preheader->getTerminator());
+      CI->moveBefore(Preheader->getTerminator());
+      ++numHoisted;
+      continue;
+    }
+
+    if (makeRangeCheck(L, CI))
+      ++numRange;
+  }
+}
+
+// makeRangeCheck - If CI checks one element of an array on each iteration of
+// L, check all of the elements with one checkTypeRange call in the preheader
+// instead.  The check must be made exactly once per iteration: L must leave
+// only from its latch, which the check dominates.
+bool TypeChecksOpt::makeRangeCheck(Loop *L, CallInst *CI) {
+  BasicBlock *Latch = L->getLoopLatch();
+  if (!Latch || L->getExitingBlock() != Latch)
+    return false;
+  if (!DT->dominates(CI->getParent(), Latch))
+    return false;
+
+  ConstantInt *Size = dyn_cast<ConstantInt>(CI->getArgOperand(1));
+  if (!Size || !L->isLoopInvariant(CI->getArgOperand(0)))
+    return false;
+
+  Value *Ptr = CI->getArgOperand(3)->stripPointerCasts();
+  const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(SE->getSCEV(Ptr));
+  if (!AR || AR->getLoop() != L || !AR->isAffine() ||
+      !SE->isLoopInvariant(AR->getStart(), L))
+    return false;
+  const SCEV *Stride = AR->getStepRecurrence(*SE);
+  const SCEVConstant *Step = dyn_cast<SCEVConstant>(Stride);
+  if (!Step || Step->getValue()->getSExtValue() < (int64_t)Size->getZExtValue())
+    return false;
+  const SCEV *Trips = SE->getBackedgeTakenCount(L);
+  if (isa<SCEVCouldNotCompute>(Trips))
+    return false;
+
+  Instruction *InsertPt = L->getLoopPreheader()->getTerminator();
+  Module *M = Latch->getParent()->getParent();
+  SCEVExpander Expander(*SE, M->getDataLayout(), "typechecks");
+  Value *Start = Expander.expandCodeFor(AR->getStart(), VoidPtrTy, InsertPt);
+  Trips = SE->getTruncateOrZeroExtend(Trips, Int64Ty);
+  const SCEV *Count = SE->getAddExpr(Trips, SE->getConstant(Int64Ty, 1));
+
+  std::vector<Value *> Args;
+  Args.push_back(CI->getArgOperand(0));
+  Args.push_back(Size);
+  Args.push_back(Start);
+  Args.push_back(Expander.expandCodeFor(Count, Int64Ty, InsertPt));
+  Args.push_back(ConstantInt::get(Int64Ty, Step->getValue()->getSExtValue()));
+  Args.push_back(CI->getArgOperand(4));
+  CallInst::Create(checkTypeRange, Args, "", InsertPt);
+
+  Value *MD = CI->getArgOperand(2);
+  CI->eraseFromParent();
+  removeUnusedTypeTags(MD);
+  return true;
 }
 
 
@@ -18,10 +18,18 @@
 #include "llvm/IR/Constants.h"
 #include "dsa/DataStructure.h"
 #include "dsa/DSGraph.h"
+#include "dsa/DSGraphCache.h"
 #include "llvm/IR/Module.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/FormattedStream.h"
+#include "llvm/Support/Mutex.h"
+#include "llvm/Support/ThreadPool.h"
+
+#include <algorithm>
+#include <set>
+#include <thread>
 
 using namespace llvm;
 
@@ -35,6 +43,20 @@ namespace {
   STATISTIC (NumEmptyCalls, "Number of calls we know nothing about");
   STATISTIC (NumRecalculations, "Number of DSGraph recalculations");
   STATISTIC (NumRecalculationsSkipped, "Number of DSGraph recalculations skipped");
+  STATISTIC (NumSCCsDeferred, "Number of SCCs left to the serial walk");
+
+  cl::opt<unsigned> BUThreads("dsa-bu-threads",
+         cl::desc("Number of threads calculating bottom-up graphs "
+                  "(0 = one per core)"),
+         cl::init(1));
+
+  // MaybeLock - Hold a lock for the lifetime of the object, if there is one.
+  class MaybeLock {
+    sys::Mutex *M;
+  public:
+    explicit MaybeLock(sys::Mutex *M) : M(M) { if (M) M->lock(); }
+    ~MaybeLock() { if (M) M->unlock(); }
+  };
 
   RegisterPass<BUDataStructures>
   X("dsa-bu", "Bottom-up Data Structure Analysis");
@@ -57,6 +79,7 @@ bool BUDataStructures::runOnModule(Module &M) {
 // inline bottom up
 //
 bool BUDataStructures::runOnModuleInternal(Module& M) {
+  Cache = DSGraphCache::create(M);
 
   //
   // Make sure we have a DSGraph for all declared functions in the Module.
@@ -128,6 +151,8 @@ bool BUDataStructures::runOnModuleInternal(Module& M) {
   callgraph.buildSCCs();
   callgraph.buildRoots();
 
+  delete Cache;
+  Cache = 0;
   return false;
 }
 
@@ -234,6 +259,8 @@ BUDataStructures::postOrderInline (Module & M) {
   std::map<const Function*, unsigned> ValMap;
   unsigned NextID = 1;
 
+  if (Cache)
+    Cache->setGlobalState(GlobalECs);
 
   // Do post order traversal on the global ctors. Use this information to update
   // the globals graph.
@@ -274,6 +301,8 @@ BUDataStructures::postOrderInline (Module & M) {
       // record one global per DSNode.
       //
       formGlobalECs();
+      if (Cache)
+        Cache->setGlobalState(GlobalECs);
       // propogte information calculated 
       // from the globals graph to the other graphs.
       for (Module::iterator F = M.begin(); F != M.end(); ++F) {
@@ -287,17 +316,68 @@ BUDataStructures::postOrderInline (Module & M) {
                                      DSGraph::IgnoreGlobals);
           Graph->computeExternalFlags(DSGraph::DontMarkFormalsExternal);
           Graph->computeIntPtrFlags();
+          // Finished graphs have changed, so their summaries must too.
+          if (Cache && ValMap.count(&*F))
+            Cache->setSummary(*Graph);
         }
       }
     }
   }
  
+  Function *MainFunc = M.getFunction ("main");
+
+  //
+  // With several threads, calculate the graphs of SCCs whose callees are all
+  // finished at the same time.  Finish whatever the scheduler left with the
+  // serial traversal, then merge the unresolved call sites of the roots of
+  // the call graph into the globals graph, as the serial traversal does.
+  //
+  unsigned Threads = BUThreads;
+  if (!Threads)
+    Threads = std::max(1u, std::thread::hardware_concurrency());
+  if (Threads > 1) {
+    scheduleSCCs(M, Threads, ValMap);
+
+    std::vector<const Function*> Roots;
+    if (MainFunc && !MainFunc->isDeclaration())
+      Roots.push_back(MainFunc);
+    for (Module::iterator I = M.begin(), E = M.end(); I != E; ++I)
+      if (!I->isDeclaration())
+        Roots.push_back(&*I);
+
+    for (unsigned i = 0, e = Roots.size(); i != e; ++i)
+      if (!ValMap.count(Roots[i])) {
+        calculateGraphs(Roots[i], Stack, NextID, ValMap);
+        DSGraph *G = getDSGraph(*Roots[i]);
+        for (DSGraph::retnodes_iterator RI = G->retnodes_begin(),
+             RE = G->retnodes_end(); RI != RE; ++RI)
+          if (getDSGraph(*RI->first) == G)
+            ValMap[RI->first] = ~0U;
+      }
+
+    std::set<const Function*> Reached;
+    for (unsigned i = 0, e = Roots.size(); i != e; ++i) {
+      if (!Reached.insert(Roots[i]).second)
+        continue;
+      CloneAuxIntoGlobal(getDSGraph(*Roots[i]));
+      std::vector<const Function*> Worklist(1, Roots[i]);
+      while (!Worklist.empty()) {
+        const Function *F = Worklist.back();
+        Worklist.pop_back();
+        for (DSCallGraph::flat_iterator CI = callgraph.flat_callee_begin(F),
+             CE = callgraph.flat_callee_end(F); CI != CE; ++CI)
+          if (Reached.insert(*CI).second)
+            Worklist.push_back(*CI);
+      }
+    }
+    return;
+  }
+
   //
   // Start the post order traversal with the main() function.  If there is no
   // main() function, don't worry; we'll have a separate traversal for inlining
   // graphs for functions not reachable from main().
   //
-  Function *MainFunc = M.getFunction ("main");
   if (MainFunc && !MainFunc->isDeclaration()) {
     calculateGraphs(MainFunc, Stack, NextID, ValMap);
     CloneAuxIntoGlobal(getDSGraph(*MainFunc));
@@ -526,6 +606,274 @@ BUDataStructures::calculateGraphs (const Function *F,
   }
 }
 
+//
+// Class: SCCScheduler
+//
+// Description:
+//  The state shared by the threads calculating bottom-up graphs.  The
+//  functions which are not finished yet are partitioned into the SCCs of the
+//  graph formed by their resolvable call sites, with the functions sharing a
+//  DSGraph kept together.  A component becomes ready once the components it
+//  calls are finished, and is then calculated on the thread pool.
+//
+//  A component which finds new callees which are not finished yet is given up
+//  on; it and its callers are left to the serial traversal.
+//
+struct BUDataStructures::SCCScheduler {
+  enum { NumGraphLocks = 64 };
+
+  struct Component {
+    std::vector<const Function*> Functions;
+    FuncSet Callees;                // Resolvable callees of all functions.
+    std::vector<unsigned> Callers;  // Components which call this one.
+    unsigned Pending;               // Callee components not finished yet.
+    bool Done;
+    Component() : Pending(0), Done(false) {}
+  };
+
+  BUDataStructures &BU;
+  ThreadPool &Pool;
+  std::vector<Component> Components;
+  std::map<const Function*, unsigned> ComponentOf;
+
+  // Lock - Guards Pending and Done.
+  sys::Mutex Lock;
+
+  // SharedLock - Guards the globals graph, the call graph and the map from
+  // functions to their graphs.
+  sys::Mutex SharedLock;
+
+  // GraphLocks - Serialize inlining from the same finished graph into several
+  // callers, because copying its node handles changes the referrer counts of
+  // its nodes.
+  sys::Mutex GraphLocks[NumGraphLocks];
+
+  SCCScheduler(BUDataStructures &BU, ThreadPool &Pool) : BU(BU), Pool(Pool) {}
+
+  sys::Mutex *getGraphLock(const DSGraph *G) {
+    return &GraphLocks[(reinterpret_cast<uintptr_t>(G) / sizeof(void*)) %
+                       NumGraphLocks];
+  }
+
+  unsigned findComponents(const Function *F, TarjanStack &Stack,
+                          unsigned &NextID, TarjanMap &IDs,
+                          const TarjanMap &Finished);
+  void addDependences();
+  bool canInline(const FuncSet &Callees, const DSGraph *G);
+  void run(unsigned C);
+};
+
+//
+// Method: findComponents()
+//
+// Description:
+//  Tarjan's algorithm over the functions which are not in Finished.  The
+//  successors of a function are the resolvable callees of its graph and the
+//  other functions sharing that graph.  Components are numbered callees first.
+//
+unsigned BUDataStructures::SCCScheduler::
+findComponents(const Function *F, TarjanStack &Stack, unsigned &NextID,
+               TarjanMap &IDs, const TarjanMap &Finished) {
+  unsigned Min = NextID++, MyID = Min;
+  IDs[F] = Min;
+  Stack.push_back(F);
+
+  DSGraph *G = BU.getDSGraph(*F);
+  FuncSet Succs;
+  BU.getAllAuxCallees(G, Succs);
+  for (DSGraph::retnodes_iterator I = G->retnodes_begin(),
+       E = G->retnodes_end(); I != E; ++I)
+    Succs.insert(I->first);
+
+  for (FuncSet::iterator I = Succs.begin(), E = Succs.end(); I != E; ++I) {
+    const Function *Succ = *I;
+    if (Succ->isDeclaration() || Finished.count(Succ))
+      continue;
+    TarjanMap::iterator It = IDs.find(Succ);
+    unsigned M = It == IDs.end() ?
+      findComponents(Succ, Stack, NextID, IDs, Finished) : It->second;
+    if (M < Min) Min = M;
+  }
+
+  if (Min != MyID)
+    return Min;
+
+  unsigned C = Components.size();
+  Components.push_back(Component());
+  const Function *NF;
+  do {
+    NF = Stack.back();
+    Stack.pop_back();
+    IDs[NF] = ~0U;
+    ComponentOf[NF] = C;
+    Components[C].Functions.push_back(NF);
+  } while (NF != F);
+  return MyID;
+}
+
+//
+// Method: addDependences()
+//
+// Description:
+//  Record the callees of every component, and count the components each one
+//  has to wait for.
+//
+void BUDataStructures::SCCScheduler::addDependences() {
+  for (unsigned C = 0, e = Components.size(); C != e; ++C) {
+    Component &Comp = Components[C];
+    std::set<unsigned> Deps;
+    for (unsigned i = 0, e = Comp.Functions.size(); i != e; ++i) {
+      FuncSet Callees;
+      BU.getAllAuxCallees(BU.getDSGraph(*Comp.Functions[i]), Callees);
+      for (FuncSet::iterator I = Callees.begin(), E = Callees.end();
+           I != E; ++I) {
+        Comp.Callees.insert(*I);
+        std::map<const Function*, unsigned>::iterator It =
+          ComponentOf.find(*I);
+        if (It != ComponentOf.end() && It->second != C)
+          Deps.insert(It->second);
+      }
+    }
+    for (std::set<unsigned>::iterator I = Deps.begin(), E = Deps.end();
+         I != E; ++I)
+      Components[*I].Callers.push_back(C);
+    Comp.Pending = Deps.size();
+  }
+}
+
+//
+// Method: canInline()
+//
+// Description:
+//  Return true if the graphs of all of the specified callees are finished, or
+//  are G itself, so that they may be inlined into G.
+//
+bool BUDataStructures::SCCScheduler::canInline(const FuncSet &Callees,
+                                               const DSGraph *G) {
+  for (FuncSet::const_iterator I = Callees.begin(), E = Callees.end();
+       I != E; ++I) {
+    std::map<const Function*, unsigned>::iterator It = ComponentOf.find(*I);
+    if (It == ComponentOf.end())
+      continue;
+    {
+      sys::ScopedLock Guard(Lock);
+      if (Components[It->second].Done)
+        continue;
+    }
+    sys::ScopedLock Guard(SharedLock);
+    if (BU.getDSGraph(**I) != G)
+      return false;
+  }
+  return true;
+}
+
+//
+// Method: run()
+//
+// Description:
+//  Calculate the graph of component C on the calling thread, then queue the
+//  callers which no longer wait for anything.
+//
+void BUDataStructures::SCCScheduler::run(unsigned C) {
+  Component &Comp = Components[C];
+
+  //
+  // Splice the graphs of the component into one, as calculateGraphs does for
+  // an SCC.
+  //
+  DSGraph *G;
+  unsigned SCCSize = 1;
+  {
+    sys::ScopedLock Guard(SharedLock);
+    G = BU.getDSGraph(*Comp.Functions[0]);
+    for (unsigned i = 1, e = Comp.Functions.size(); i != e; ++i) {
+      DSGraph *FG = BU.getDSGraph(*Comp.Functions[i]);
+      if (FG == G)
+        continue;
+      for (DSGraph::retnodes_iterator I = FG->retnodes_begin(),
+           E = FG->retnodes_end(); I != E; ++I)
+        BU.setDSGraph(*I->first, G);
+      G->spliceFrom(FG);
+      delete FG;
+      ++SCCSize;
+    }
+    if (SCCSize > 1)
+      G->removeDeadNodes(DSGraph::KeepUnreachableGlobals);
+  }
+
+  //
+  // Calculate the graph until it finds no new callees, like calculateGraphs.
+  // Callees which are not finished yet would have to be calculated first, so
+  // leave those components to the serial traversal.
+  //
+  for (;;) {
+    BU.calculateGraph(G);
+    FuncSet NewCallees;
+    BU.getAllAuxCallees(G, NewCallees);
+    if (NewCallees.empty())
+      break;
+    if (!hasNewCallees(NewCallees, Comp.Callees)) {
+      ++NumRecalculationsSkipped;
+      break;
+    }
+    if (!canInline(NewCallees, G)) {
+      ++NumSCCsDeferred;
+      return;
+    }
+    ++NumRecalculations;
+    Comp.Callees.swap(NewCallees);
+  }
+
+  std::vector<unsigned> Ready;
+  {
+    sys::ScopedLock Guard(Lock);
+    if (MaxSCC < SCCSize)
+      MaxSCC = SCCSize;
+    Comp.Done = true;
+    for (unsigned i = 0, e = Comp.Callers.size(); i != e; ++i)
+      if (--Components[Comp.Callers[i]].Pending == 0)
+        Ready.push_back(Comp.Callers[i]);
+  }
+  for (unsigned i = 0, e = Ready.size(); i != e; ++i)
+    Pool.async(&SCCScheduler::run, this, Ready[i]);
+}
+
+//
+// Method: scheduleSCCs()
+//
+// Description:
+//  Calculate the graphs of the functions not in ValMap on Threads threads,
+//  and mark those which were finished in ValMap.
+//
+void BUDataStructures::scheduleSCCs(Module &M, unsigned Threads,
+                                    TarjanMap &ValMap) {
+  ThreadPool Pool(Threads);
+  SCCScheduler S(*this, Pool);
+
+  TarjanStack Stack;
+  TarjanMap IDs;
+  unsigned NextID = 1;
+  Function *MainFunc = M.getFunction("main");
+  if (MainFunc && !MainFunc->isDeclaration() && !ValMap.count(MainFunc))
+    S.findComponents(MainFunc, Stack, NextID, IDs, ValMap);
+  for (Module::iterator I = M.begin(), E = M.end(); I != E; ++I)
+    if (!I->isDeclaration() && !ValMap.count(&*I) && !IDs.count(&*I))
+      S.findComponents(&*I, Stack, NextID, IDs, ValMap);
+  S.addDependences();
+
+  Scheduler = &S;
+  for (unsigned C = 0, e = S.Components.size(); C != e; ++C)
+    if (!S.Components[C].Pending)
+      Pool.async(&SCCScheduler::run, &S, C);
+  Pool.wait();
+  Scheduler = 0;
+
+  for (unsigned C = 0, e = S.Components.size(); C != e; ++C)
+    if (S.Components[C].Done)
+      for (unsigned i = 0, e = S.Components[C].Functions.size(); i != e; ++i)
+        ValMap[S.Components[C].Functions[i]] = ~0U;
+}
+
 //
 // Method: CloneAuxIntoGlobal()
 //
@@ -623,8 +971,31 @@ void BUDataStructures::CloneAuxIntoGlobal(DSGraph* G) {
 //  dealt with
 //
 void BUDataStructures::calculateGraph(DSGraph* Graph) {
-  DEBUG(Graph->AssertGraphOK(); Graph->getGlobalsGraph()->AssertGraphOK());
-  Graph->buildCallGraph(callgraph, GlobalFunctionList, filterCallees);
+  // While SCCs are calculated in parallel, the state shared with the other
+  // threads is only touched under the scheduler's lock.
+  sys::Mutex *SharedLock = Scheduler ? &Scheduler->SharedLock : 0;
+
+  DEBUG(Graph->AssertGraphOK();
+        if (!Scheduler) Graph->getGlobalsGraph()->AssertGraphOK());
+  {
+    MaybeLock Guard(SharedLock);
+    Graph->buildCallGraph(callgraph, GlobalFunctionList, filterCallees);
+  }
+
+  // If an earlier run calculated this graph from the same graph and callees,
+  // read the result back instead.
+  std::string Key;
+  if (Cache) {
+    std::string Input;
+    if (DSGraphCache::writeGraph(*Graph, Input))
+      Key = Cache->getKey(std::string(debugname) +
+                          (filterCallees ? "" : " unfiltered"), Input);
+    if (!Key.empty() && loadCalculatedGraph(Graph, Key)) {
+      finishGraph(Graph);
+      return;
+    }
+  }
+  std::vector<const Function*> Inlined;
 
   // Move our call site list into TempFCs so that inline call sites go into the
   // new call site list and doesn't invalidate our iterators!
@@ -633,7 +1004,8 @@ void BUDataStructures::calculateGraph(DSGraph* Graph) {
   TempFCs.swap(AuxCallsList);
 
   for (auto &CS : TempFCs) {
-    DEBUG(Graph->AssertGraphOK(); Graph->getGlobalsGraph()->AssertGraphOK());
+    DEBUG(Graph->AssertGraphOK();
+          if (!Scheduler) Graph->getGlobalsGraph()->AssertGraphOK());
 
 
     // Fast path for noop calls.  Note that we don't care about merging globals
@@ -661,6 +1033,16 @@ void BUDataStructures::calculateGraph(DSGraph* Graph) {
       AuxCallsList.push_back(CS);
       continue;
     }
+
+    // Graphs which another thread may still be changing cannot be inlined.
+    // Keep the call site; the scheduler sees the new callees afterwards.
+    // The result then depends on the timing, so it is not cached.
+    if (Scheduler && !Scheduler->canInline(CalledFuncs, Graph)) {
+      AuxCallsList.push_back(CS);
+      Key.clear();
+      continue;
+    }
+
     // If we get to this point, we know the callees, and can inline.
     // This means, that either it is a direct call site. Or if it is
     // an indirect call site, its calleeNode is complete, and we can
@@ -677,8 +1059,14 @@ void BUDataStructures::calculateGraph(DSGraph* Graph) {
     for (auto *Callee : CalledFuncs) {
       // Get the data structure graph for the called function.
 
-      GI = getDSGraph(*Callee);  // Graph to inline
-      DEBUG(GI->AssertGraphOK(); GI->getGlobalsGraph()->AssertGraphOK());
+      {
+        MaybeLock Guard(SharedLock);
+        GI = getDSGraph(*Callee);  // Graph to inline
+      }
+      MaybeLock GraphGuard(Scheduler && GI != Graph ?
+                           Scheduler->getGraphLock(GI) : 0);
+      DEBUG(GI->AssertGraphOK();
+            if (!Scheduler) GI->getGlobalsGraph()->AssertGraphOK());
       DEBUG(errs() << "    Inlining graph for " << Callee->getName()
 	    << "[" << GI->getGraphSize() << "+"
 	    << GI->getAuxFunctionCalls().size() << "] into '"
@@ -696,6 +1084,8 @@ void BUDataStructures::calculateGraph(DSGraph* Graph) {
       //
       Graph->mergeInGraph(CS, *Callee, *GI,
                           DSGraph::StripAllocaBit|DSGraph::DontCloneCallNodes);
+      if (GI != Graph)
+        Inlined.push_back(Callee);
       ++NumInlines;
       DEBUG(Graph->AssertGraphOK(););
     }
@@ -708,19 +1098,66 @@ void BUDataStructures::calculateGraph(DSGraph* Graph) {
   Graph->computeExternalFlags(DSGraph::DontMarkFormalsExternal);
   Graph->computeIntPtrFlags();
 
-  //
-  // Update the callgraph with the new information that we have gleaned.
-  // NOTE : This must be called before removeDeadNodes, so that no 
-  // information is lost due to deletion of DSCallNodes.
-  Graph->buildCallGraph(callgraph, GlobalFunctionList, filterCallees);
+  if (!Key.empty())
+    Cache->store(Key, *Graph, Inlined);
+  finishGraph(Graph);
+}
 
-  // Delete dead nodes.  Treat globals that are unreachable but that can
-  // reach live nodes as live.
-  Graph->removeDeadNodes(DSGraph::KeepUnreachableGlobals);
+//
+// Method: loadCalculatedGraph()
+//
+// Description:
+//  Replace the contents of G with the graph saved under Key, if the graphs
+//  it was calculated from are unchanged.  G is left alone otherwise.
+//
+bool BUDataStructures::loadCalculatedGraph(DSGraph* G, const std::string &Key) {
+  DSGraph *Saved = new DSGraph(G->getGlobalECs(), G->getDataLayout(),
+                               G->getTypeSS(), G->getGlobalsGraph());
+  std::vector<const Function*> Deps;
+  bool Loaded = Cache->load(Key, *Saved, &Deps);
+
+  // A summary may belong to a graph another thread is still changing.
+  if (Loaded && Scheduler) {
+    FuncSet Callees;
+    Callees.insert(Deps.begin(), Deps.end());
+    Loaded = Scheduler->canInline(Callees, G);
+  }
+  if (Loaded) {
+    G->clear();
+    G->spliceFrom(Saved);
+  }
+  delete Saved;
+  return Loaded;
+}
 
-  cloneIntoGlobals(Graph, DSGraph::DontCloneCallNodes |
-                        DSGraph::DontCloneAuxCallNodes |
-                        DSGraph::StripAllocaBit);
+//
+// Method: finishGraph()
+//
+// Description:
+//  Update the call graph and the globals graph from a graph whose call sites
+//  have been inlined, and drop its dead nodes.
+//
+void BUDataStructures::finishGraph(DSGraph* Graph) {
+  sys::Mutex *SharedLock = Scheduler ? &Scheduler->SharedLock : 0;
+  {
+    //
+    // Update the callgraph with the new information that we have gleaned.
+    // NOTE : This must be called before removeDeadNodes, so that no 
+    // information is lost due to deletion of DSCallNodes.
+    MaybeLock Guard(SharedLock);
+    Graph->buildCallGraph(callgraph, GlobalFunctionList, filterCallees);
+
+    // Delete dead nodes.  Treat globals that are unreachable but that can
+    // reach live nodes as live.
+    Graph->removeDeadNodes(DSGraph::KeepUnreachableGlobals);
+
+    cloneIntoGlobals(Graph, DSGraph::DontCloneCallNodes |
+                          DSGraph::DontCloneAuxCallNodes |
+                          DSGraph::StripAllocaBit);
+  }
   //Graph->writeGraphToFile(cerr, "bu_" + F.getName());
+
+  if (Cache)
+    Cache->setSummary(*Graph);
 }
 
@@ -116,6 +116,18 @@ DSGraph::DSGraph(DSGraph* G, EquivalenceClasses<const GlobalValue*> &ECs,
 }
 
 DSGraph::~DSGraph() {
+  clear();
+  for (unsigned i = 0, e = Arenas.size(); i != e; ++i)
+    Arenas[i]->release();
+}
+
+DSNodeArena *DSGraph::getNodeArena() {
+  if (Arenas.empty())
+    Arenas.push_back(new DSNodeArena());
+  return Arenas.back();
+}
+
+void DSGraph::clear() {
   FunctionCalls.clear();
   AuxFunctionCalls.clear();
   ScalarMap.clear();
@@ -161,7 +173,7 @@ void DSGraph::removeFunctionCalls(Function& F) {
 /// and does not point to any other objects in the graph.
 DSNode *DSGraph::addObjectToGraph(Value *Ptr, bool UseDeclaredType) {
   assert(isa<PointerType>(Ptr->getType()) && "Ptr is not a pointer!");
-  DSNode *N = new DSNode(this);
+  DSNode *N = new (this) DSNode(this);
   assert(ScalarMap[Ptr].isNull() && "Object already in this graph!");
   ScalarMap[Ptr] = N;
 
@@ -199,7 +211,7 @@ void DSGraph::cloneInto( DSGraph* G, unsigned CloneFlags) {
   for (node_const_iterator I = G->node_begin(), E = G->node_end(); I != E; ++I) {
     assert(!I->isForwarding() &&
            "Forward nodes shouldn't be in node list!");
-    DSNode *New = new DSNode(*I, this);
+    DSNode *New = new (this) DSNode(*I, this);
     New->maskNodeTypes(~BitsToClear);
     OldNodeMap[&*I] = New;
   }
@@ -270,8 +282,11 @@ void DSGraph::spliceFrom(DSGraph* RHS) {
   for (NodeListTy::iterator I = RHS->Nodes.begin(), E = RHS->Nodes.end();
        I != E; ++I)
     I->setParentGraph(this);
-  // Take all of the nodes.
+  // Take all of the nodes, and the arenas they live in.  Ours stays last, so
+  // that new nodes keep coming from it.
   splice(Nodes, RHS->Nodes);
+  Arenas.insert(Arenas.begin(), RHS->Arenas.begin(), RHS->Arenas.end());
+  RHS->Arenas.clear();
 
   // Take all of the calls.
   splice(FunctionCalls, RHS->FunctionCalls);
@@ -907,6 +922,42 @@ static void removeIdenticalCalls(DSGraph::FunctionListTy &Calls) {
   if (NumDeleted)
     DEBUG(errs() << "Merged " << NumDeleted << " call nodes.\n");
 }
+// compactForwardingNodes - Call getNode on every handle in the graph.  Each
+// call points the handle straight at the end of its forwarding chain and drops
+// a referrer from the forwarding nodes it skipped, so once every handle has
+// been visited, no forwarding node is referred to and all have been deleted.
+//
+void DSGraph::compactForwardingNodes() {
+  // Loop over all of the nodes in the graph, calling getNode on each field.
+  // Further, reclaim any memory used by useless edge or type entries.  A node
+  // is cleaned only once its own edges are forwarded, as cleaning moves the
+  // entries the iterators point to.
+  for (node_iterator NI = node_begin(), E = node_end(); NI != E; ++NI) {
+    for (DSNode::edge_iterator ii = NI->edge_begin(), ee = NI->edge_end();
+         ii != ee; ++ii)
+      ii->second.getNode();
+    NI->cleanEdges();
+  }
+
+  // Likewise, forward any edges from the scalar nodes...
+  for (DSScalarMap::iterator I = ScalarMap.begin(), E = ScalarMap.end();
+       I != E; ++I)
+    I->second.getNode();
+
+  // ... the return and vararg nodes of the functions ...
+  for (ReturnNodesTy::iterator I = ReturnNodes.begin(), E = ReturnNodes.end();
+       I != E; ++I)
+    I->second.getNode();
+  for (VANodesTy::iterator I = VANodes.begin(), E = VANodes.end(); I != E; ++I)
+    I->second.getNode();
+
+  // ... and the call sites.
+  for (fc_iterator I = fc_begin(), E = fc_end(); I != E; ++I)
+    I->forwardHandles();
+  for (afc_iterator I = afc_begin(), E = afc_end(); I != E; ++I)
+    I->forwardHandles();
+}
+
 // removeTriviallyDeadNodes - After the graph has been constructed, this method
 // removes all unreachable nodes that are created because they got merged with
 // other nodes in the graph.  These nodes will all be trivially unreachable, so
@@ -916,21 +967,9 @@ void DSGraph::removeTriviallyDeadNodes() {
   /// NOTE: This code is disabled.  This slows down DSA on 177.mesa
   /// substantially!
 
-  // Loop over all of the nodes in the graph, calling getNode on each field.
-  // This will cause all nodes to update their forwarding edges, causing
-  // forwarded nodes to be delete-able.  Further, reclaim any memory used by
-  // useless edge or type entries
-  for (node_iterator NI = node_begin(), E = node_end(); NI != E; ++NI)
-    for (DSNode::edge_iterator ii = NI->edge_begin(), ee = NI->edge_end();
-         ii != ee; ++ii) {
-      ii->second.getNode()->cleanEdges();
-    }
-
-  // Likewise, forward any edges from the scalar nodes.  While we are at it,
-  // clean house a bit.
-  for (DSScalarMap::iterator I = ScalarMap.begin(), E = ScalarMap.end();
-       I != E; ++I)
-    I->second.getNode();
+  // Get rid of the forwarding nodes first, so that the nodes they were merged
+  // into are not kept alive by them.
+  compactForwardingNodes();
 
   bool isGlobalsGraph = !GlobalsGraph;
 
@@ -1398,11 +1437,8 @@ void DSGraph::computeGGToGMapping(InvNodeMapTy &InvNodeMap) {
   NodeMapTy NodeMap;
   computeGToGGMapping(NodeMap);
 
-  while (!NodeMap.empty()) {
-    InvNodeMap.insert(std::make_pair(NodeMap.begin()->second,
-                                     NodeMap.begin()->first));
-    NodeMap.erase(NodeMap.begin());
-  }
+  for (NodeMapTy::iterator I = NodeMap.begin(), E = NodeMap.end(); I != E; ++I)
+    InvNodeMap.insert(std::make_pair(I->second, I->first));
 }
 
 
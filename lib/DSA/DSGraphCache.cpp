@@ -0,0 +1,998 @@
+//===- DSGraphCache.cpp - Keep DSGraphs between runs ----------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements DSGraphCache.  Each graph is kept as text in a file of
+// its own, named by its key.  Values are named by their place in the module
+// rather than by address: globals by name, arguments and instructions by
+// their function and position, and other constants by the operands which lead
+// to them from an instruction.  Types are spelled out, except for named
+// structs, which are named.
+//
+// A file starts with the summaries of the graphs the saved graph was
+// calculated from, so that it is only used while they are unchanged.
+//
+//===----------------------------------------------------------------------===//
+
+#define DEBUG_TYPE "dsa-cache"
+#include "dsa/DSGraphCache.h"
+#include "dsa/DSGraph.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/TypeFinder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cctype>
+#include <set>
+
+using namespace llvm;
+
+namespace {
+  STATISTIC (NumHits, "Number of graphs read from the cache");
+  STATISTIC (NumMisses, "Number of cache lookups which found no graph");
+  STATISTIC (NumStale, "Number of saved graphs whose callees changed");
+  STATISTIC (NumStored, "Number of graphs saved in the cache");
+
+  cl::opt<std::string> CacheDir("dsa-cache-dir",
+         cl::desc("Keep DSA graphs in this directory between runs"),
+         cl::value_desc("directory"), cl::init(""));
+}
+
+// Bump this whenever the format of the files, or what the graphs of a pass are
+// calculated from, changes.
+static const unsigned FormatVersion = 1;
+
+static std::string getNameToken(StringRef Name) {
+  return utostr(Name.size()) + ":" + Name.str();
+}
+
+static std::string hashString(StringRef Data) {
+  MD5 Hash;
+  Hash.update(Data);
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  SmallString<32> Str;
+  MD5::stringifyResult(Result, Str);
+  return Str.str();
+}
+
+/// writeType - Spell out Ty.  Return false if it is, or contains, a struct
+/// without a name which is not a literal struct.
+static bool writeType(Type *Ty, raw_ostream &OS) {
+  switch (Ty->getTypeID()) {
+  case Type::VoidTyID:      OS << 'v'; return true;
+  case Type::HalfTyID:      OS << 'h'; return true;
+  case Type::FloatTyID:     OS << 'f'; return true;
+  case Type::DoubleTyID:    OS << 'd'; return true;
+  case Type::X86_FP80TyID:  OS << 'x'; return true;
+  case Type::FP128TyID:     OS << 'q'; return true;
+  case Type::PPC_FP128TyID: OS << 'Q'; return true;
+  case Type::LabelTyID:     OS << 'l'; return true;
+  case Type::MetadataTyID:  OS << 'm'; return true;
+  case Type::X86_MMXTyID:   OS << 'X'; return true;
+  case Type::TokenTyID:     OS << 't'; return true;
+  case Type::IntegerTyID:
+    OS << 'i' << cast<IntegerType>(Ty)->getBitWidth();
+    return true;
+  case Type::PointerTyID:
+    OS << 'p' << cast<PointerType>(Ty)->getAddressSpace();
+    return writeType(cast<PointerType>(Ty)->getElementType(), OS);
+  case Type::ArrayTyID:
+    OS << 'a' << cast<ArrayType>(Ty)->getNumElements();
+    return writeType(cast<ArrayType>(Ty)->getElementType(), OS);
+  case Type::VectorTyID:
+    OS << 'e' << cast<VectorType>(Ty)->getNumElements();
+    return writeType(cast<VectorType>(Ty)->getElementType(), OS);
+  case Type::FunctionTyID: {
+    FunctionType *FT = cast<FunctionType>(Ty);
+    OS << 'F' << FT->getNumParams() << ':' << (unsigned)FT->isVarArg();
+    if (!writeType(FT->getReturnType(), OS))
+      return false;
+    for (unsigned i = 0, e = FT->getNumParams(); i != e; ++i)
+      if (!writeType(FT->getParamType(i), OS))
+        return false;
+    return true;
+  }
+  case Type::StructTyID: {
+    StructType *ST = cast<StructType>(Ty);
+    if (!ST->isLiteral()) {
+      if (!ST->hasName())
+        return false;
+      OS << 'N' << getNameToken(ST->getName());
+      return true;
+    }
+    OS << (ST->isPacked() ? 'S' : 's') << ST->getNumElements();
+    for (unsigned i = 0, e = ST->getNumElements(); i != e; ++i)
+      if (!writeType(ST->getElementType(i), OS))
+        return false;
+    return true;
+  }
+  }
+  return false;
+}
+
+namespace {
+  // GraphWriter - Write a DSGraph in the format GraphReader reads.  Nodes are
+  // numbered from one in the order of the graph's node list; everything
+  // which is kept in a map keyed by address is sorted, so that equal graphs
+  // are written identically.
+  class GraphWriter {
+    const DSGraph &G;
+    raw_ostream &OS;
+    DenseMap<const DSNode*, unsigned> NodeIDs;
+    DenseMap<const Value*, std::string> Refs;
+    std::set<const Function*> Indexed;
+
+    void indexFunction(const Function *F);
+    void indexConstant(const Value *V, const std::string &Prefix,
+                       std::vector<unsigned> &Path);
+    bool getRef(const Value *V, std::string &Ref);
+    bool writeNodeID(const DSNode *N);
+    bool writeHandle(const DSNodeHandle &NH);
+    bool writeNode(const DSNode &N);
+    bool writeFunctionMap(const char *Name,
+                          const std::map<const Function*, DSNodeHandle> &Map);
+    bool writeCalls(const char *Name, const DSGraph::FunctionListTy &Calls);
+  public:
+    GraphWriter(const DSGraph &G, raw_ostream &OS) : G(G), OS(OS) {}
+    bool write();
+  };
+
+  // GraphReader - Read a graph, and the summaries it depends on, from a file
+  // written by DSGraphCache::store.
+  class GraphReader {
+    StringRef Buf;
+    size_t Pos;
+    Module &M;
+    DSGraph &G;
+    std::vector<DSNode*> Nodes;
+    std::map<const Function*, std::vector<Instruction*> > Insts;
+
+    void skipSpace() {
+      while (Pos != Buf.size() && isspace((unsigned char)Buf[Pos]))
+        ++Pos;
+    }
+    bool expect(StringRef Word) {
+      skipSpace();
+      if (!Buf.substr(Pos).startswith(Word))
+        return false;
+      Pos += Word.size();
+      return true;
+    }
+    bool readDigits(uint64_t &N);
+    bool readNumber(uint64_t &N) {
+      skipSpace();
+      return readDigits(N);
+    }
+    bool readName(StringRef &Name);
+    Type *readType();
+    bool readValue(Value *&V);
+    bool readHandle(DSNodeHandle &NH);
+    bool readNodes();
+    bool readScalars();
+    bool readFunctionMap(StringRef Name, bool VarArgs);
+    bool readCalls(StringRef Name, DSGraph::FunctionListTy &Calls);
+  public:
+    GraphReader(StringRef Buf, Module &M, DSGraph &G)
+      : Buf(Buf), Pos(0), M(M), G(G) {}
+    bool readDependences(std::vector<std::pair<StringRef, StringRef> > &Deps);
+    bool read();
+  };
+}
+
+//===----------------------------------------------------------------------===//
+// GraphWriter Implementation
+//===----------------------------------------------------------------------===//
+
+/// indexFunction - Name the arguments and instructions of F, and the constants
+/// its instructions use.
+void GraphWriter::indexFunction(const Function *F) {
+  if (!F->hasName())
+    return;
+  std::string FName = getNameToken(F->getName());
+  unsigned Idx = 0;
+  for (Function::const_arg_iterator I = F->arg_begin(), E = F->arg_end();
+       I != E; ++I, ++Idx)
+    Refs[&*I] = "a " + FName + " " + utostr(Idx);
+
+  Idx = 0;
+  std::vector<unsigned> Path;
+  for (const_inst_iterator I = inst_begin(F), E = inst_end(F); I != E;
+       ++I, ++Idx) {
+    std::string Ref = FName + " " + utostr(Idx);
+    Refs[&*I] = "i " + Ref;
+    for (unsigned i = 0, e = I->getNumOperands(); i != e; ++i) {
+      Path.push_back(i);
+      indexConstant(I->getOperand(i), "c " + Ref, Path);
+      Path.pop_back();
+    }
+  }
+}
+
+void GraphWriter::indexConstant(const Value *V, const std::string &Prefix,
+                                std::vector<unsigned> &Path) {
+  const Constant *C = dyn_cast<Constant>(V);
+  if (!C || isa<GlobalValue>(C))
+    return;
+
+  // The first path found names the constant.
+  std::string Ref = Prefix + " " + utostr(Path.size());
+  for (unsigned i = 0, e = Path.size(); i != e; ++i)
+    Ref += " " + utostr(Path[i]);
+  if (!Refs.insert(std::make_pair(V, Ref)).second)
+    return;
+
+  for (unsigned i = 0, e = C->getNumOperands(); i != e; ++i) {
+    Path.push_back(i);
+    indexConstant(C->getOperand(i), Prefix, Path);
+    Path.pop_back();
+  }
+}
+
+bool GraphWriter::getRef(const Value *V, std::string &Ref) {
+  if (!V) {
+    Ref = "-";
+    return true;
+  }
+  if (const GlobalValue *GV = dyn_cast<GlobalValue>(V)) {
+    if (!GV->hasName())
+      return false;
+    Ref = "g " + getNameToken(GV->getName());
+    return true;
+  }
+
+  DenseMap<const Value*, std::string>::iterator I = Refs.find(V);
+  if (I == Refs.end()) {
+    // Call sites may belong to functions outside of the graph.
+    const Function *F = 0;
+    if (const Argument *A = dyn_cast<Argument>(V))
+      F = A->getParent();
+    else if (const Instruction *Inst = dyn_cast<Instruction>(V))
+      F = Inst->getParent() ? Inst->getParent()->getParent() : 0;
+    if (!F || !Indexed.insert(F).second)
+      return false;
+    indexFunction(F);
+    I = Refs.find(V);
+    if (I == Refs.end())
+      return false;
+  }
+  Ref = I->second;
+  return true;
+}
+
+bool GraphWriter::writeNodeID(const DSNode *N) {
+  DenseMap<const DSNode*, unsigned>::iterator I = NodeIDs.find(N);
+  if (I == NodeIDs.end())
+    return false;
+  OS << ' ' << I->second;
+  return true;
+}
+
+bool GraphWriter::writeHandle(const DSNodeHandle &NH) {
+  DSNode *N = NH.getNode();
+  if (!N) {
+    OS << " 0 0";
+    return true;
+  }
+  if (!writeNodeID(N))
+    return false;
+  OS << ' ' << NH.getOffset();
+  return true;
+}
+
+bool GraphWriter::writeNode(const DSNode &N) {
+  OS << "n " << N.getSize() << ' ' << N.getNodeFlags();
+
+  std::vector<std::string> Globals;
+  for (DSNode::globals_iterator I = N.globals_begin(), E = N.globals_end();
+       I != E; ++I) {
+    if (!(*I)->hasName())
+      return false;
+    Globals.push_back(getNameToken((*I)->getName()));
+  }
+  std::sort(Globals.begin(), Globals.end());
+  OS << ' ' << Globals.size();
+  for (unsigned i = 0, e = Globals.size(); i != e; ++i)
+    OS << ' ' << Globals[i];
+
+  OS << ' ' << std::distance(N.type_begin(), N.type_end());
+  for (DSNode::const_type_iterator I = N.type_begin(), E = N.type_end();
+       I != E; ++I) {
+    std::vector<std::string> Types;
+    if (I->second)
+      for (svset<Type*>::const_iterator TI = I->second->begin(),
+           TE = I->second->end(); TI != TE; ++TI) {
+        std::string Str;
+        raw_string_ostream TOS(Str);
+        if (!writeType(*TI, TOS))
+          return false;
+        Types.push_back(TOS.str());
+      }
+    std::sort(Types.begin(), Types.end());
+    OS << ' ' << I->first << ' ' << Types.size();
+    for (unsigned i = 0, e = Types.size(); i != e; ++i)
+      OS << ' ' << Types[i];
+  }
+
+  OS << ' ' << std::distance(N.edge_begin(), N.edge_end());
+  for (DSNode::const_edge_iterator I = N.edge_begin(), E = N.edge_end();
+       I != E; ++I) {
+    OS << ' ' << I->first;
+    if (!writeHandle(I->second))
+      return false;
+  }
+  OS << '\n';
+  return true;
+}
+
+bool GraphWriter::writeFunctionMap(const char *Name,
+                    const std::map<const Function*, DSNodeHandle> &Map) {
+  std::vector<std::pair<std::string, const DSNodeHandle*> > Entries;
+  for (std::map<const Function*, DSNodeHandle>::const_iterator I = Map.begin(),
+       E = Map.end(); I != E; ++I) {
+    if (!I->first->hasName())
+      return false;
+    Entries.push_back(std::make_pair(getNameToken(I->first->getName()),
+                                     &I->second));
+  }
+  std::sort(Entries.begin(), Entries.end());
+
+  OS << Name << ' ' << Entries.size() << '\n';
+  for (unsigned i = 0, e = Entries.size(); i != e; ++i) {
+    OS << Entries[i].first;
+    if (!writeHandle(*Entries[i].second))
+      return false;
+    OS << '\n';
+  }
+  return true;
+}
+
+bool GraphWriter::writeCalls(const char *Name,
+                             const DSGraph::FunctionListTy &Calls) {
+  OS << Name << ' ' << Calls.size() << '\n';
+  for (DSGraph::FunctionListTy::const_iterator I = Calls.begin(),
+       E = Calls.end(); I != E; ++I) {
+    std::string Ref;
+    if (!getRef(I->getCallSite().getInstruction(), Ref))
+      return false;
+    OS << Ref;
+    if (I->isDirectCall()) {
+      const Function *F = I->getCalleeFunc();
+      if (!F->hasName())
+        return false;
+      OS << " d " << getNameToken(F->getName());
+    } else {
+      OS << " i";
+      if (!writeNodeID(I->getCalleeNode()))
+        return false;
+    }
+    if (!writeHandle(I->getRetVal()) || !writeHandle(I->getVAVal()))
+      return false;
+
+    OS << ' ' << I->getNumPtrArgs();
+    for (unsigned i = 0, e = I->getNumPtrArgs(); i != e; ++i)
+      if (!writeHandle(I->getPtrArg(i)))
+        return false;
+
+    std::vector<std::string> Mapped;
+    for (std::set<CallSite>::const_iterator MI = I->ms_begin(),
+         ME = I->ms_end(); MI != ME; ++MI) {
+      if (!getRef(MI->getInstruction(), Ref))
+        return false;
+      Mapped.push_back(Ref);
+    }
+    std::sort(Mapped.begin(), Mapped.end());
+    OS << ' ' << Mapped.size();
+    for (unsigned i = 0, e = Mapped.size(); i != e; ++i)
+      OS << ' ' << Mapped[i];
+    OS << '\n';
+  }
+  return true;
+}
+
+bool GraphWriter::write() {
+  for (DSGraph::retnodes_iterator I = G.retnodes_begin(),
+       E = G.retnodes_end(); I != E; ++I)
+    if (Indexed.insert(I->first).second)
+      indexFunction(I->first);
+
+  unsigned NumNodes = 0;
+  for (DSGraph::node_const_iterator I = G.node_begin(), E = G.node_end();
+       I != E; ++I)
+    NodeIDs[&*I] = ++NumNodes;
+  OS << "nodes " << NumNodes << '\n';
+  for (DSGraph::node_const_iterator I = G.node_begin(), E = G.node_end();
+       I != E; ++I)
+    if (!writeNode(*I))
+      return false;
+
+  const DSScalarMap &SM = G.getScalarMap();
+  std::vector<std::pair<std::string, const DSNodeHandle*> > Scalars;
+  for (DSScalarMap::const_iterator I = SM.begin(), E = SM.end(); I != E; ++I) {
+    std::string Ref;
+    if (!getRef(I->first, Ref))
+      return false;
+    Scalars.push_back(std::make_pair(Ref, &I->second));
+  }
+  std::sort(Scalars.begin(), Scalars.end());
+  OS << "scalars " << Scalars.size() << '\n';
+  for (unsigned i = 0, e = Scalars.size(); i != e; ++i) {
+    OS << Scalars[i].first;
+    if (!writeHandle(*Scalars[i].second))
+      return false;
+    OS << '\n';
+  }
+
+  return writeFunctionMap("returns", G.getReturnNodes()) &&
+         writeFunctionMap("varargs", G.getVANodes()) &&
+         writeCalls("calls", G.getFunctionCalls()) &&
+         writeCalls("aux", G.getAuxFunctionCalls());
+}
+
+//===----------------------------------------------------------------------===//
+// GraphReader Implementation
+//===----------------------------------------------------------------------===//
+
+bool GraphReader::readDigits(uint64_t &N) {
+  size_t Start = Pos;
+  N = 0;
+  while (Pos != Buf.size() && isdigit((unsigned char)Buf[Pos]))
+    N = N * 10 + (Buf[Pos++] - '0');
+  return Pos != Start;
+}
+
+bool GraphReader::readName(StringRef &Name) {
+  uint64_t Len;
+  if (!readNumber(Len) || Pos == Buf.size() || Buf[Pos] != ':' ||
+      Buf.size() - Pos - 1 < Len)
+    return false;
+  Name = Buf.substr(Pos + 1, Len);
+  Pos += Len + 1;
+  return true;
+}
+
+Type *GraphReader::readType() {
+  skipSpace();
+  if (Pos == Buf.size())
+    return 0;
+
+  LLVMContext &Ctx = M.getContext();
+  char Kind = Buf[Pos++];
+  uint64_t N;
+  switch (Kind) {
+  case 'v': return Type::getVoidTy(Ctx);
+  case 'h': return Type::getHalfTy(Ctx);
+  case 'f': return Type::getFloatTy(Ctx);
+  case 'd': return Type::getDoubleTy(Ctx);
+  case 'x': return Type::getX86_FP80Ty(Ctx);
+  case 'q': return Type::getFP128Ty(Ctx);
+  case 'Q': return Type::getPPC_FP128Ty(Ctx);
+  case 'l': return Type::getLabelTy(Ctx);
+  case 'm': return Type::getMetadataTy(Ctx);
+  case 'X': return Type::getX86_MMXTy(Ctx);
+  case 't': return Type::getTokenTy(Ctx);
+  case 'i':
+    if (!readDigits(N) || N < IntegerType::MIN_INT_BITS ||
+        N > IntegerType::MAX_INT_BITS)
+      return 0;
+    return IntegerType::get(Ctx, N);
+  case 'p':
+  case 'a':
+  case 'e': {
+    if (!readDigits(N))
+      return 0;
+    Type *Elt = readType();
+    if (!Elt)
+      return 0;
+    if (Kind == 'p')
+      return PointerType::isValidElementType(Elt) ?
+        PointerType::get(Elt, N) : 0;
+    if (Kind == 'a')
+      return ArrayType::isValidElementType(Elt) ? ArrayType::get(Elt, N) : 0;
+    return N && VectorType::isValidElementType(Elt) ?
+      VectorType::get(Elt, N) : 0;
+  }
+  case 'F': {
+    uint64_t VarArg;
+    if (!readDigits(N) || Pos == Buf.size() || Buf[Pos++] != ':' ||
+        !readDigits(VarArg))
+      return 0;
+    Type *Ret = readType();
+    if (!Ret || !FunctionType::isValidReturnType(Ret))
+      return 0;
+    std::vector<Type*> Params;
+    for (; N; --N) {
+      Type *Param = readType();
+      if (!Param || !FunctionType::isValidArgumentType(Param))
+        return 0;
+      Params.push_back(Param);
+    }
+    return FunctionType::get(Ret, Params, VarArg);
+  }
+  case 's':
+  case 'S': {
+    if (!readDigits(N))
+      return 0;
+    std::vector<Type*> Elts;
+    for (; N; --N) {
+      Type *Elt = readType();
+      if (!Elt || !StructType::isValidElementType(Elt))
+        return 0;
+      Elts.push_back(Elt);
+    }
+    return StructType::get(Ctx, Elts, Kind == 'S');
+  }
+  case 'N': {
+    StringRef Name;
+    if (!readName(Name))
+      return 0;
+    return M.getTypeByName(Name);
+  }
+  }
+  return 0;
+}
+
+bool GraphReader::readValue(Value *&V) {
+  skipSpace();
+  if (Pos == Buf.size())
+    return false;
+  char Kind = Buf[Pos++];
+  if (Kind == '-') {
+    V = 0;
+    return true;
+  }
+
+  StringRef Name;
+  if (!readName(Name))
+    return false;
+  if (Kind == 'g')
+    return (V = M.getNamedValue(Name)) != 0;
+
+  Function *F = M.getFunction(Name);
+  uint64_t Idx;
+  if (!F || !readNumber(Idx))
+    return false;
+  if (Kind == 'a') {
+    if (Idx >= F->arg_size())
+      return false;
+    Function::arg_iterator AI = F->arg_begin();
+    std::advance(AI, Idx);
+    V = &*AI;
+    return true;
+  }
+
+  std::vector<Instruction*> &FInsts = Insts[F];
+  if (FInsts.empty())
+    for (inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I)
+      FInsts.push_back(&*I);
+  if (Idx >= FInsts.size())
+    return false;
+  V = FInsts[Idx];
+  if (Kind == 'i')
+    return true;
+  if (Kind != 'c')
+    return false;
+
+  // Follow the operands down to the constant.
+  uint64_t Depth, Op;
+  if (!readNumber(Depth) || !Depth)
+    return false;
+  for (; Depth; --Depth) {
+    User *U = cast<User>(V);
+    if (!readNumber(Op) || Op >= U->getNumOperands())
+      return false;
+    V = U->getOperand(Op);
+    if (!isa<Constant>(V))
+      return false;
+  }
+  return true;
+}
+
+bool GraphReader::readHandle(DSNodeHandle &NH) {
+  uint64_t ID, Offset;
+  if (!readNumber(ID) || !readNumber(Offset) || ID > Nodes.size())
+    return false;
+  if (!ID) {
+    NH.setTo(0, 0);
+    return !Offset;
+  }
+  DSNode *N = Nodes[ID - 1];
+  if (Offset && Offset >= N->getSize())
+    return false;
+  NH.setTo(N, Offset);
+  return true;
+}
+
+bool GraphReader::readNodes() {
+  uint64_t NumNodes;
+  if (!expect("nodes") || !readNumber(NumNodes) || NumNodes > Buf.size())
+    return false;
+  for (uint64_t i = 0; i != NumNodes; ++i)
+    Nodes.push_back(new (&G) DSNode(&G));
+
+  // Links may point to nodes which come later, so they are set once the size
+  // of every node is known.
+  struct PendingLink {
+    DSNode *From;
+    unsigned Offset;
+    size_t Pos;
+  };
+  std::vector<PendingLink> Links;
+
+  for (uint64_t i = 0; i != NumNodes; ++i) {
+    DSNode *N = Nodes[i];
+    uint64_t Size, Flags, Count;
+    if (!expect("n") || !readNumber(Size) || !readNumber(Flags))
+      return false;
+    N->growSize(Size);
+    N->mergeNodeFlags(Flags);
+
+    if (!readNumber(Count))
+      return false;
+    for (; Count; --Count) {
+      StringRef Name;
+      GlobalValue *GV;
+      if (!readName(Name) || !(GV = M.getNamedValue(Name)))
+        return false;
+      N->addGlobal(GV);
+    }
+
+    if (!readNumber(Count))
+      return false;
+    for (; Count; --Count) {
+      uint64_t Offset, NumTypes;
+      if (!readNumber(Offset) || !readNumber(NumTypes))
+        return false;
+      svset<Type*> Types;
+      for (; NumTypes; --NumTypes) {
+        Type *Ty = readType();
+        if (!Ty)
+          return false;
+        Types.insert(Ty);
+      }
+      N->setTypeInfo(Offset, G.getTypeSS().getOrCreate(Types));
+    }
+
+    if (!readNumber(Count))
+      return false;
+    for (; Count; --Count) {
+      uint64_t Offset, ID, LinkOffset;
+      if (!readNumber(Offset) || Offset >= Size)
+        return false;
+      PendingLink L = { N, (unsigned)Offset, Pos };
+      if (!readNumber(ID) || !readNumber(LinkOffset))
+        return false;
+      Links.push_back(L);
+    }
+  }
+
+  size_t End = Pos;
+  for (unsigned i = 0, e = Links.size(); i != e; ++i) {
+    DSNodeHandle NH;
+    Pos = Links[i].Pos;
+    if (!readHandle(NH))
+      return false;
+    Links[i].From->setLink(Links[i].Offset, NH);
+  }
+  Pos = End;
+  return true;
+}
+
+bool GraphReader::readScalars() {
+  uint64_t Count;
+  if (!expect("scalars") || !readNumber(Count))
+    return false;
+  DSScalarMap &SM = G.getScalarMap();
+  for (; Count; --Count) {
+    Value *V;
+    DSNodeHandle NH;
+    if (!readValue(V) || !V || !readHandle(NH))
+      return false;
+    SM[V].mergeWith(NH);
+  }
+  return true;
+}
+
+bool GraphReader::readFunctionMap(StringRef Name, bool VarArgs) {
+  uint64_t Count;
+  if (!expect(Name) || !readNumber(Count))
+    return false;
+  for (; Count; --Count) {
+    StringRef FName;
+    Function *F;
+    DSNodeHandle NH;
+    if (!readName(FName) || !(F = M.getFunction(FName)) || !readHandle(NH))
+      return false;
+    if (VarArgs)
+      G.getOrCreateVANodeFor(*F) = NH;
+    else
+      G.getOrCreateReturnNodeFor(*F) = NH;
+  }
+  return true;
+}
+
+bool GraphReader::readCalls(StringRef Name, DSGraph::FunctionListTy &Calls) {
+  uint64_t Count;
+  if (!expect(Name) || !readNumber(Count))
+    return false;
+  for (; Count; --Count) {
+    Value *V;
+    if (!readValue(V))
+      return false;
+    CallSite CS;
+    if (V && !(CS = CallSite(V)))
+      return false;
+
+    skipSpace();
+    if (Pos == Buf.size())
+      return false;
+    char Kind = Buf[Pos++];
+    Function *Callee = 0;
+    DSNode *CalleeNode = 0;
+    if (Kind == 'd') {
+      StringRef FName;
+      if (!readName(FName) || !(Callee = M.getFunction(FName)))
+        return false;
+    } else if (Kind == 'i') {
+      uint64_t ID;
+      if (!readNumber(ID) || !ID || ID > Nodes.size())
+        return false;
+      CalleeNode = Nodes[ID - 1];
+    } else
+      return false;
+
+    DSNodeHandle RetVal, VAVal;
+    uint64_t NumArgs;
+    if (!readHandle(RetVal) || !readHandle(VAVal) || !readNumber(NumArgs))
+      return false;
+    std::vector<DSNodeHandle> Args;
+    for (; NumArgs; --NumArgs) {
+      DSNodeHandle NH;
+      if (!readHandle(NH))
+        return false;
+      Args.push_back(NH);
+    }
+    if (Callee)
+      Calls.push_back(DSCallSite(CS, RetVal, VAVal, Callee, Args));
+    else
+      Calls.push_back(DSCallSite(CS, RetVal, VAVal, CalleeNode, Args));
+
+    uint64_t NumMapped;
+    if (!readNumber(NumMapped))
+      return false;
+    for (; NumMapped; --NumMapped) {
+      if (!readValue(V) || !V || !CallSite(V))
+        return false;
+      Calls.back().addMappedSite(CallSite(V));
+    }
+  }
+  return true;
+}
+
+bool GraphReader::readDependences(
+                          std::vector<std::pair<StringRef, StringRef> > &Deps) {
+  uint64_t Version, Count;
+  if (!expect("dsa-graph") || !readNumber(Version) ||
+      Version != FormatVersion || !expect("deps") || !readNumber(Count))
+    return false;
+  for (; Count; --Count) {
+    StringRef Name, Summary;
+    if (!readName(Name) || !readName(Summary))
+      return false;
+    Deps.push_back(std::make_pair(Name, Summary));
+  }
+  return true;
+}
+
+bool GraphReader::read() {
+  if (!readNodes() || !readScalars() ||
+      !readFunctionMap("returns", false) || !readFunctionMap("varargs", true) ||
+      !readCalls("calls", G.getFunctionCalls()) ||
+      !readCalls("aux", G.getAuxFunctionCalls()))
+    return false;
+  skipSpace();
+  return Pos == Buf.size();
+}
+
+//===----------------------------------------------------------------------===//
+// DSGraphCache Implementation
+//===----------------------------------------------------------------------===//
+
+DSGraphCache::DSGraphCache(StringRef Dir, Module &M) : Dir(Dir), M(M) {
+  // Graphs refer to named structs by name, so their bodies are part of every
+  // key, along with the data layout which decides the offsets in the graphs.
+  std::vector<std::string> Bodies;
+  TypeFinder Types;
+  Types.run(M, true);
+  for (TypeFinder::iterator I = Types.begin(), E = Types.end(); I != E; ++I) {
+    StructType *ST = *I;
+    std::string Body;
+    raw_string_ostream OS(Body);
+    OS << getNameToken(ST->getName());
+    if (ST->isOpaque())
+      OS << " opaque";
+    else {
+      OS << ' ' << (ST->isPacked() ? 'S' : 's') << ST->getNumElements();
+      for (unsigned i = 0, e = ST->getNumElements(); i != e; ++i)
+        if (!writeType(ST->getElementType(i), OS))
+          OS << '?';
+    }
+    Bodies.push_back(OS.str());
+  }
+  std::sort(Bodies.begin(), Bodies.end());
+
+  std::string Data = "dsa-graph " + utostr(FormatVersion) + "\n" +
+    M.getDataLayoutStr() + "\n";
+  for (unsigned i = 0, e = Bodies.size(); i != e; ++i)
+    Data += Bodies[i] + "\n";
+  ModuleKey = hashString(Data);
+}
+
+DSGraphCache *DSGraphCache::create(Module &M) {
+  if (CacheDir.empty())
+    return 0;
+  if (std::error_code EC = sys::fs::create_directories(CacheDir)) {
+    errs() << "warning: cannot create DSA cache directory '" << CacheDir
+           << "': " << EC.message() << "\n";
+    return 0;
+  }
+  return new DSGraphCache(CacheDir, M);
+}
+
+std::string DSGraphCache::getPath(StringRef Key) const {
+  SmallString<128> Path(Dir);
+  sys::path::append(Path, Key + ".dsg");
+  return Path.str();
+}
+
+void DSGraphCache::setGlobalState(
+                      const EquivalenceClasses<const GlobalValue*> &ECs) {
+  std::vector<std::string> Members;
+  for (Module::iterator I = M.begin(), E = M.end(); I != E; ++I)
+    if (!I->isDeclaration())
+      Members.push_back(getNameToken(I->getName()));
+  for (EquivalenceClasses<const GlobalValue*>::iterator I = ECs.begin(),
+       E = ECs.end(); I != E; ++I) {
+    if (!I->isLeader())
+      continue;
+    const GlobalValue *Leader = I->getData();
+    for (EquivalenceClasses<const GlobalValue*>::member_iterator
+         MI = ECs.member_begin(I), ME = ECs.member_end(); MI != ME; ++MI)
+      if (*MI != Leader)
+        Members.push_back(getNameToken((*MI)->getName()) + " " +
+                          getNameToken(Leader->getName()));
+  }
+  std::sort(Members.begin(), Members.end());
+
+  std::string Data;
+  for (unsigned i = 0, e = Members.size(); i != e; ++i)
+    Data += Members[i] + "\n";
+  GlobalKey = hashString(Data);
+}
+
+std::string DSGraphCache::getKey(StringRef Pass, StringRef Data) const {
+  MD5 Hash;
+  Hash.update(ModuleKey);
+  Hash.update(GlobalKey);
+  Hash.update(getNameToken(Pass));
+  Hash.update(Data);
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  SmallString<32> Str;
+  MD5::stringifyResult(Result, Str);
+  return Str.str();
+}
+
+bool DSGraphCache::writeGraph(const DSGraph &G, std::string &Out) {
+  Out.clear();
+  raw_string_ostream OS(Out);
+  bool Written = GraphWriter(G, OS).write();
+  OS.flush();
+  return Written;
+}
+
+bool DSGraphCache::load(StringRef Key, DSGraph &G,
+                        std::vector<const Function*> *Deps) {
+  sys::ScopedLock Guard(Lock);
+  ErrorOr<std::unique_ptr<MemoryBuffer> > Buffer =
+    MemoryBuffer::getFile(getPath(Key));
+  if (!Buffer) {
+    ++NumMisses;
+    return false;
+  }
+
+  GraphReader Reader((*Buffer)->getBuffer(), M, G);
+  std::vector<std::pair<StringRef, StringRef> > Saved;
+  bool Valid = Reader.readDependences(Saved);
+  for (unsigned i = 0, e = Saved.size(); Valid && i != e; ++i) {
+    const Function *F = M.getFunction(Saved[i].first);
+    std::map<const Function*, std::string>::iterator I = Summaries.find(F);
+    Valid = I != Summaries.end() && I->second == Saved[i].second;
+    if (Valid && Deps)
+      Deps->push_back(F);
+  }
+  if (!Valid)
+    ++NumStale;
+  if (!Valid || !Reader.read()) {
+    ++NumMisses;
+    return false;
+  }
+  ++NumHits;
+  return true;
+}
+
+void DSGraphCache::store(StringRef Key, const DSGraph &G,
+                         const std::vector<const Function*> &Deps) {
+  std::string Graph;
+  if (!writeGraph(G, Graph))
+    return;
+
+  std::vector<const Function*> Callees(Deps);
+  std::sort(Callees.begin(), Callees.end());
+  Callees.erase(std::unique(Callees.begin(), Callees.end()), Callees.end());
+
+  sys::ScopedLock Guard(Lock);
+  std::string Data = "dsa-graph " + utostr(FormatVersion) + "\ndeps " +
+    utostr(Callees.size()) + "\n";
+  for (unsigned i = 0, e = Callees.size(); i != e; ++i) {
+    std::map<const Function*, std::string>::iterator I =
+      Summaries.find(Callees[i]);
+    if (I == Summaries.end() || !Callees[i]->hasName())
+      return;
+    Data += getNameToken(Callees[i]->getName()) + " " +
+      getNameToken(I->second) + "\n";
+  }
+  Data += Graph;
+
+  // Write the file under a temporary name and rename it into place, so that
+  // another run never reads part of a graph.
+  SmallString<128> TmpPath;
+  int FD;
+  if (sys::fs::createUniqueFile(Dir + "/dsa-%%%%%%%%.tmp", FD, TmpPath))
+    return;
+  raw_fd_ostream File(FD, true);
+  File << Data;
+  File.close();
+  if (File.has_error()) {
+    File.clear_error();
+    sys::fs::remove(TmpPath);
+    return;
+  }
+  if (sys::fs::rename(TmpPath, getPath(Key))) {
+    sys::fs::remove(TmpPath);
+    return;
+  }
+  ++NumStored;
+}
+
+void DSGraphCache::setSummary(const DSGraph &G) {
+  std::string Graph;
+  bool Written = writeGraph(G, Graph);
+  std::string Summary = Written ? hashString(Graph) : std::string();
+
+  sys::ScopedLock Guard(Lock);
+  for (DSGraph::retnodes_iterator I = G.retnodes_begin(),
+       E = G.retnodes_end(); I != E; ++I)
+    if (Written)
+      Summaries[I->first] = Summary;
+    else
+      Summaries.erase(I->first);
+}
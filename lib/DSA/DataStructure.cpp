@@ -29,6 +29,7 @@
 #include "llvm/ADT/DepthFirstIterator.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/Statistic.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
@@ -42,6 +43,10 @@ namespace {
   STATISTIC (NumFolds, "Number of nodes completely folded");
   STATISTIC (NumFoldsOOBOffset, "Number of OOB offsets that caused node folding");
   STATISTIC (NumNodeAllocated  , "Number of nodes allocated");
+  STATISTIC (NumGlobalsDeferred, "Number of graphs whose merge of the globals "
+                                 "graph was deferred");
+  STATISTIC (NumGlobalsFinished, "Number of deferred globals graph merges "
+                                 "which were done");
 }
 
 /// isForwarding - Return true if this NodeHandle is forwarding to another
@@ -63,21 +68,37 @@ DSNode *DSNodeHandle::HandleForwarding() const {
     }
     }
     );
-  // Handle node forwarding here!
-  DSNode *Next = N->ForwardNH.getNode();  // Cause recursive shrinkage
-  Offset += N->ForwardNH.getOffset();
-
-  if (--N->NumReferrers == 0) {
-    // Removing the last referrer to the node, sever the forwarding link
-    N->stopForwarding();
+  // Handle node forwarding here!  Find the node at the end of the chain of
+  // forwarding nodes.  The chain is walked without recursion, as merging the
+  // nodes of a large SCC can leave long ones.
+  SmallVector<const DSNodeHandle*, 8> Chain;
+  Chain.push_back(this);
+  DSNode *Root = N;
+  while (Root->isForwarding()) {
+    Chain.push_back(&Root->ForwardNH);
+    Root = Root->ForwardNH.N;
   }
 
-  N = Next;
-  N->NumReferrers++;
+  // The last handle in the chain already points to Root.  Working back from
+  // it, point every other handle in the chain straight at Root, adding in the
+  // offset of the handle after it, so that no handle walks this chain again.
+  for (unsigned i = Chain.size() - 1; i-- != 0; ) {
+    const DSNodeHandle *H = Chain[i];
+    DSNode *Next = H->N;
+    H->Offset += Next->ForwardNH.Offset;
+    H->N = Root;
+    Root->NumReferrers++;
+
+    if (--Next->NumReferrers == 0) {
+      // Removing the last referrer to the node, sever the forwarding link
+      Next->stopForwarding();
+    }
 
-  if (N->getSize() <= Offset) {
-    assert(N->getSize() <= 1 && "Forwarded to shrunk but not collapsed node?");
-    Offset = 0;
+    if (Root->getSize() <= H->Offset) {
+      assert(Root->getSize() <= 1 &&
+             "Forwarded to shrunk but not collapsed node?");
+      H->Offset = 0;
+    }
   }
   return N;
 }
@@ -92,15 +113,12 @@ DSNodeHandle &DSScalarMap::AddGlobal(const GlobalValue *GV) {
 
   // If the node doesn't exist, check to see if it's a global that is
   // equated to another global in the program.
-  EquivalenceClasses<const GlobalValue*>::iterator ECI = GlobalECs.findValue(GV);
-  if (ECI != GlobalECs.end()) {
-    const GlobalValue *Leader = *GlobalECs.findLeader(ECI);
-    if (Leader != GV) {
-      GV = Leader;
-      iterator I = ValueMap.find(GV);
-      if (I != ValueMap.end())
-        return I->second;
-    }
+  const GlobalValue *Leader = getLeaderForGlobal(GV);
+  if (Leader != GV) {
+    GV = Leader;
+    iterator I = ValueMap.find(GV);
+    if (I != ValueMap.end())
+      return I->second;
   }
 
   // Okay, this is either not an equivalenced global or it is the leader, it
@@ -130,6 +148,52 @@ void DSScalarMap::spliceFrom(DSScalarMap &RHS) {
 // DSNode Implementation
 //===----------------------------------------------------------------------===//
 
+void *DSNodeArena::allocate(size_t Size) {
+  ++NumLive;
+  if (void *P = FreeList) {
+    FreeList = *static_cast<void**>(P);
+    return P;
+  }
+  return Allocator.Allocate(Size, alignOf<DSNode>());
+}
+
+void DSNodeArena::deallocate(void *P) {
+  *static_cast<void**>(P) = FreeList;
+  FreeList = P;
+  if (--NumLive == 0 && Released)
+    delete this;
+}
+
+void DSNodeArena::release() {
+  Released = true;
+  if (NumLive == 0)
+    delete this;
+}
+
+// Each node is preceded by the arena it was allocated in, or null if it came
+// from the heap, so that operator delete can give its memory back.  Every node
+// has the same size, so the arena can reuse the memory of any deleted node.
+static const size_t NodeHeaderSize =
+  (sizeof(DSNodeArena*) + alignOf<DSNode>() - 1) & ~(alignOf<DSNode>() - 1);
+
+void *DSNode::operator new(size_t Size, DSGraph *G) {
+  assert(Size == sizeof(DSNode) && "Nodes must all have the same size!");
+  DSNodeArena *A = G ? G->getNodeArena() : 0;
+  void *P = A ? A->allocate(NodeHeaderSize + Size)
+              : ::operator new(NodeHeaderSize + Size);
+  *static_cast<DSNodeArena**>(P) = A;
+  return static_cast<char*>(P) + NodeHeaderSize;
+}
+
+void DSNode::operator delete(void *P) {
+  if (!P) return;
+  void *Block = static_cast<char*>(P) - NodeHeaderSize;
+  if (DSNodeArena *A = *static_cast<DSNodeArena**>(Block))
+    A->deallocate(Block);
+  else
+    ::operator delete(Block);
+}
+
 DSNode::DSNode(DSGraph *G)
   : NumReferrers(0), Size(0), ParentGraph(G), NodeType(0) {
     // Add the type entry if it is specified...
@@ -253,7 +317,7 @@ void DSNode::foldNodeCompletely() {
     // Create the node we are going to forward to.  This is required because
     // some referrers may have an offset that is > 0.  By forcing them to
     // forward, the forwarder has the opportunity to correct the offset.
-    DSNode *DestNode = new DSNode(ParentGraph);
+    DSNode *DestNode = new (ParentGraph) DSNode(ParentGraph);
     DestNode->NodeType = NodeType;
     DestNode->setCollapsedMarker();
     DestNode->Size = 1;
@@ -470,7 +534,8 @@ void DSNode::mergeTypeInfo(const TyMapTy::mapped_type TyIt, unsigned Offset) {
       if (Offset + TD.getTypeAllocSize(*ni) >= getSize())
         growSize(Offset + TD.getTypeAllocSize(*ni));
     }
-  } else if (TyIt) {
+  } else if (TyIt && TyIt != TyMap[Offset]) {
+    // Type sets are uniqued, so a set merged with itself is unchanged.
     svset<Type*> S(*TyMap[Offset]);
     S.insert(TyIt->begin(), TyIt->end());
     TyMap[Offset] = getParentGraph()->getTypeSS().getOrCreate(S);
@@ -689,6 +754,12 @@ void DSNode::mergeWith(const DSNodeHandle &NH, unsigned Offset) {
     // If the offsets are the same, merge the smaller node into the bigger node
     N->mergeWith(DSNodeHandle(this, Offset), NH.getOffset());
     return;
+  } else if (Offset == NH.getOffset() && getSize() == N->getSize() &&
+             NumReferrers < N->NumReferrers) {
+    // Otherwise forward the node with fewer referrers, so that fewer handles
+    // have to go through the forwarding node.
+    N->mergeWith(DSNodeHandle(this, Offset), NH.getOffset());
+    return;
   }
 
   // Ok, now we can merge the two nodes.  Use a static helper that works with
@@ -706,21 +777,14 @@ void DSNode::cleanEdges() {
   for (type_iterator ii = type_begin(); ii != type_end(); ) {
     if (ii->second)
       ++ii;
-    else {
-      type_iterator backup = ii;
-      ++backup;
-      TyMap.erase(ii);
-      ii = backup;
-    }
+    else
+      ii = TyMap.erase(ii);
   }
   //get rid of any node edge pointing to nothing
   for (edge_iterator ii = edge_begin(); ii != edge_end(); ) {
-    if (ii->second.isNull()) {
-      edge_iterator backup = ii;
-      ++backup;
-      Links.erase(ii);
-      ii = backup;
-    } else
+    if (ii->second.isNull())
+      ii = Links.erase(ii);
+    else
       ++ii;
   }
 }
@@ -788,7 +852,7 @@ DSNodeHandle ReachabilityCloner::getClonedNH(const DSNodeHandle &SrcNH) {
 
   if (!createDest) return DSNodeHandle(0,0);
 
-  DSNode *DN = new DSNode(*SN, Dest, true /* Null out all links */);
+  DSNode *DN = new (Dest) DSNode(*SN, Dest, true /* Null out all links */);
   DN->maskNodeTypes(BitsToKeep);
   NH = DN;
 
@@ -959,7 +1023,7 @@ void ReachabilityCloner::merge(const DSNodeHandle &NH,
   } else {
     // We cannot handle this case without allocating a temporary node.  Fall
     // back on being simple.
-    DSNode *NewDN = new DSNode(*SN, Dest, true /* Null out all links */);
+    DSNode *NewDN = new (Dest) DSNode(*SN, Dest, true /* Null out all links */);
     NewDN->maskNodeTypes(BitsToKeep);
 
 #ifndef NDEBUG
@@ -1293,20 +1357,31 @@ void DataStructures::copyValue(Value *From, Value *To) {
 DSGraph* DataStructures::getOrCreateGraph(const Function* F) {
   assert(F && "No function");
   DSGraph *&G = DSInfo[F];
+  if (G && !GlobalsPending.empty() && GlobalsPending.count(G))
+    finishGlobalsInto(G, GlobalsGraph);
   if (!G) {
     assert (F->isDeclaration() || GraphSource->hasDSGraph(*F));
-    //Clone or Steal the Source Graph
-    DSGraph* BaseGraph = GraphSource->getDSGraph(*F);
+    //Clone or Steal the Source Graph.  If the source pass deferred merging
+    //its globals graph into the graph, merge it into our copy instead, so
+    //that the source graph never holds the globals graph's nodes.
+    DSInfoTy::iterator SI = GraphSource->DSInfo.find(F);
+    assert(SI != GraphSource->DSInfo.end() && "Function not in module!");
+    DSGraph* BaseGraph = SI->second;
+    bool Pending = GraphSource->GlobalsPending.count(BaseGraph);
     if (Clone) {
       G = new DSGraph(BaseGraph, GlobalECs, *TypeSS);
-      if (resetAuxCalls)
-        G->getAuxFunctionCalls() = G->getFunctionCalls();
     } else {
       G = new DSGraph(GlobalECs, GraphSource->getDataLayout(), *TypeSS);
       G->spliceFrom(BaseGraph);
-      if (resetAuxCalls)
-        G->getAuxFunctionCalls() = G->getFunctionCalls();
+      GraphSource->GlobalsPending.erase(BaseGraph);
+    }
+    if (Pending) {
+      if (BaseGraph->shouldUseAuxCalls())
+        G->setUseAuxCalls();
+      finishGlobalsInto(G, GraphSource->getGlobalsGraph());
     }
+    if (resetAuxCalls)
+      G->getAuxFunctionCalls() = G->getFunctionCalls();
     G->setUseAuxCalls();
     G->setGlobalsGraph(GlobalsGraph);
 
@@ -1445,19 +1520,49 @@ void DataStructures::eliminateUsesOfECGlobals(DSGraph &G,
   DEBUG(if(MadeChange) G.AssertGraphOK());
 }
 
+/// cloneGlobalsFrom - Merge what GG knows about the globals of Graph into it.
+static void cloneGlobalsFrom(DSGraph* Graph, const DSGraph* GG,
+                             unsigned cloneFlags) {
+  ReachabilityCloner RC(Graph, GG, cloneFlags);
+
+  // Clone the global nodes into this graph.
+  for (DSScalarMap::global_iterator I = Graph->getScalarMap().global_begin(),
+       E = Graph->getScalarMap().global_end(); I != E; ++I)
+    RC.getClonedNH(GG->getNodeForValue(*I));
+}
+
 //For Entry Points
 void DataStructures::cloneGlobalsInto(DSGraph* Graph, unsigned cloneFlags) {
   // If this graph contains main, copy the contents of the globals graph over.
   // Note that this is *required* for correctness.  If a callee contains a use
   // of a global, we have to make sure to link up nodes due to global-argument
   // bindings.
-  const DSGraph* GG = Graph->getGlobalsGraph();
-  ReachabilityCloner RC(Graph, GG, cloneFlags);
+  cloneGlobalsFrom(Graph, Graph->getGlobalsGraph(), cloneFlags);
+}
 
-  // Clone the global nodes into this graph.
-  for (DSScalarMap::global_iterator I = Graph->getScalarMap().global_begin(),
-       E = Graph->getScalarMap().global_end(); I != E; ++I)
-    RC.getClonedNH(GG->getNodeForValue(*I));
+/// deferGlobalsInto - At the end of a pass, merge the globals graph into G
+/// only once G is asked for, through getDSGraph or getOrCreateGraph, or into
+/// the copy another pass makes of G.  This is what the final loops of the
+/// local and standard library passes did for every graph; a copy of the
+/// globals graph in each of their graphs would otherwise be kept for as long
+/// as the pass is, while the later passes only need it in their own copies.
+/// The globals graph must not change after this is called, and the graph
+/// must not be asked for on several threads at once.
+void DataStructures::deferGlobalsInto(DSGraph* G) {
+  if (GlobalsPending.insert(G).second)
+    ++NumGlobalsDeferred;
+}
+
+/// finishGlobalsInto - Do the merge of GG into G which deferGlobalsInto put
+/// off.  G is either a graph of this pass or a fresh copy of one of the graphs
+/// of the pass GG belongs to.
+void DataStructures::finishGlobalsInto(DSGraph* G, const DSGraph* GG) const {
+  GlobalsPending.erase(G);
+  ++NumGlobalsFinished;
+  G->maskIncompleteMarkers();
+  cloneGlobalsFrom(G, GG, DSGraph::DontCloneCallNodes |
+                   DSGraph::DontCloneAuxCallNodes);
+  G->markIncompleteNodes(DSGraph::MarkFormalArgs | DSGraph::IgnoreGlobals);
 }
 
 //For all graphs
@@ -1515,6 +1620,8 @@ void DataStructures::restoreCorrectCallGraph(){
 }
 
 void DataStructures::releaseMemory() {
+  GlobalsPending.clear();
+
   //
   // If the DSGraphs were stolen by another pass, free nothing.
   //
@@ -16,6 +16,7 @@
 
 #include "dsa/DataStructure.h"
 #include "dsa/DSGraph.h"
+#include "dsa/DSGraphCache.h"
 
 #include "llvm/ADT/Statistic.h"
 #include "llvm/ADT/DenseSet.h"
@@ -33,9 +34,13 @@
 #include "llvm/Support/FormattedStream.h"
 #include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/InstVisitor.h"
+#include "llvm/IR/TypeFinder.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
 
+#include <algorithm>
 #include <fstream>
+#include <thread>
 
 // FIXME: This should eventually be a FunctionPass that is automatically
 // aggregated into a Pass.
@@ -58,6 +63,10 @@ X("dsa-local", "Local Data Structure Analysis");
 
 cl::opt<std::string> hasMagicSections("dsa-magic-sections",
         cl::desc("File with section to global mapping")); //, cl::ReallyHidden);
+
+cl::opt<unsigned> LocalThreads("dsa-local-threads",
+        cl::desc("Number of threads building local graphs (0 = one per core)"),
+        cl::init(0));
 }
 cl::opt<bool> TypeInferenceOptimize("enable-type-inference-opts",
                                     cl::desc("Enable Type Inference Optimizations added to DSA."),
@@ -89,7 +98,7 @@ namespace {
     ///
     DSNode *createNode() 
     {   
-      DSNode* ret = new DSNode(&G);
+      DSNode* ret = new (&G) DSNode(&G);
       assert(ret->getParentGraph() && "No parent?");
       return ret;
     }
@@ -145,7 +154,11 @@ namespace {
     void visitVAStartNode(DSNode* N);
 
   public:
-    GraphBuilder(Function &f, DSGraph &g, LocalDataStructures& DSi)
+    /// GraphBuilder - Build the local graph of f.  If Finish is false, only the
+    /// function itself is visited, and finish must be called on the graph
+    /// before it is used; the visit does not touch the globals graph.
+    GraphBuilder(Function &f, DSGraph &g, LocalDataStructures& DSi,
+                 bool Finish = true)
       : G(g), FB(&f), DS(&DSi), TD(g.getDataLayout()), VAArrayNH(0) {
       // Create scalar nodes for all pointer arguments...
       for (Function::arg_iterator I = f.arg_begin(), E = f.arg_end();
@@ -176,6 +189,12 @@ namespace {
 
       visit(f);  // Single pass over the function
 
+      if (Finish)
+        finish(g);
+    }
+
+    /// finish - Complete a local graph once its function has been visited.
+    static void finish(DSGraph &g) {
       // If there are any constant globals referenced in this function, merge
       // their initializers into the local graph from the globals graph.
       // This resolves indirect calls in some common cases
@@ -1439,6 +1458,128 @@ void handleMagicSections(DSGraph* GlobalsGraph, Module& M) {
   }
 }
 
+namespace {
+  /// PendingGraph - The local graph of a function, visited ahead of its turn
+  /// on a worker thread.  A graph only depends on the rest of the module
+  /// through the leaders of the global equivalence classes, which grow as
+  /// earlier graphs are merged into the globals graph, so the leader of each
+  /// global the function refers to is recorded with it.  The same inputs
+  /// make up the key of the graph in the cache.
+  struct PendingGraph {
+    Function *F;
+    DSGraph *G;
+    std::vector<std::pair<const GlobalValue*, const GlobalValue*> > Leaders;
+    std::string Key;
+    bool Loaded;
+  };
+}
+
+/// addGlobalLeaders - Record the leaders of the globals V refers to.
+static void addGlobalLeaders(Value *V, PendingGraph &P,
+                             SmallPtrSet<Value*, 32> &Visited) {
+  if (!isa<Constant>(V) || !Visited.insert(V).second)
+    return;
+  if (GlobalValue *GV = dyn_cast<GlobalValue>(V)) {
+    P.Leaders.push_back(std::make_pair(GV,
+                          P.G->getScalarMap().getLeaderForGlobal(GV)));
+    if (GlobalAlias *GA = dyn_cast<GlobalAlias>(GV))
+      addGlobalLeaders(GA->getAliasee(), P, Visited);
+    return;
+  }
+  for (User::op_iterator I = cast<Constant>(V)->op_begin(),
+       E = cast<Constant>(V)->op_end(); I != E; ++I)
+    addGlobalLeaders(*I, P, Visited);
+}
+
+/// collectLeaders - Record the leaders of the globals the function of P
+/// refers to, as they are now.
+static void collectLeaders(PendingGraph &P) {
+  P.Leaders.clear();
+  SmallPtrSet<Value*, 32> Visited;
+  for (Function::iterator BB = P.F->begin(), BE = P.F->end(); BB != BE; ++BB)
+    for (BasicBlock::iterator I = BB->begin(), E = BB->end(); I != E; ++I)
+      for (User::op_iterator OI = I->op_begin(), OE = I->op_end();
+           OI != OE; ++OI)
+        addGlobalLeaders(*OI, P, Visited);
+}
+
+/// buildPendingGraph - Visit the function of P.  This runs on a worker
+/// thread, while the global equivalence classes are not being changed, and
+/// the graph of P looks up the leaders of globals in the table filled in by
+/// prepareForThreads.
+static void buildPendingGraph(PendingGraph *P, LocalDataStructures *DS) {
+  GraphBuilder GGB(*P->F, *P->G, *DS, false);
+}
+
+/// getLocalKey - Return the cache key of the graph of P, before it is
+/// finished: a hash of the function, the options the visit depends on, and
+/// the leaders of the globals it refers to, which must have been collected.
+/// Return an empty key if the graph cannot be cached.
+static std::string getLocalKey(DSGraphCache &Cache, const PendingGraph &P) {
+  std::string Data;
+  raw_string_ostream OS(Data);
+  OS << "type-inference-opts " << (unsigned)TypeInferenceOptimize << "\n";
+  for (unsigned i = 0, e = P.Leaders.size(); i != e; ++i) {
+    const GlobalValue *GV = P.Leaders[i].first;
+    const GlobalValue *Leader = P.Leaders[i].second;
+    if (!GV->hasName() || !Leader->hasName())
+      return std::string();
+    OS << GV->getName().size() << ':' << GV->getName() << ' '
+       << (unsigned)GV->isDeclaration() << ' '
+       << Leader->getName().size() << ':' << Leader->getName() << "\n";
+  }
+  P.F->print(OS);
+  return Cache.getKey("dsa-local", OS.str());
+}
+
+/// loadPendingGraph - Collect the leaders of P and compute its key, and read
+/// its graph from the cache if an earlier run saved it.  On a miss, P is left
+/// without a graph.
+static bool loadPendingGraph(DSGraphCache &Cache, PendingGraph &P,
+                             LocalDataStructures &DS) {
+  P.G = new DSGraph(DS.getGlobalECs(), DS.getDataLayout(), DS.getTypeSS(),
+                    DS.getGlobalsGraph());
+  collectLeaders(P);
+  P.Key = getLocalKey(Cache, P);
+  if (!P.Key.empty() && Cache.load(P.Key, *P.G))
+    return P.Loaded = true;
+  delete P.G;
+  P.G = 0;
+  return false;
+}
+
+/// leadersChanged - Return true if the leader of any global P refers to has
+/// changed since P was built, so that building it now would give another
+/// graph.
+static bool leadersChanged(const PendingGraph &P) {
+  const DSScalarMap &SM = P.G->getScalarMap();
+  for (unsigned i = 0, e = P.Leaders.size(); i != e; ++i)
+    if (SM.getLeaderForGlobal(P.Leaders[i].first) != P.Leaders[i].second)
+      return true;
+  return false;
+}
+
+/// prepareForThreads - Fill in the state LLVM computes lazily and which the
+/// local graph builders would otherwise create on several threads at once:
+/// the struct layouts, the sized flags of struct types and the arguments of
+/// functions.  Likewise fill in Leaders with the leader of each global in
+/// ECs, as finding a leader in ECs compresses its path.
+static void prepareForThreads(Module &M, const DataLayout &TD,
+                              EquivalenceClasses<const GlobalValue*> &ECs,
+                              DSScalarMap::LeaderTableTy &Leaders) {
+  for (EquivalenceClasses<const GlobalValue*>::iterator I = ECs.begin(),
+       E = ECs.end(); I != E; ++I)
+    Leaders[I->getData()] = *ECs.findLeader(I);
+  TypeFinder StructTypes;
+  StructTypes.run(M, false);
+  for (TypeFinder::iterator I = StructTypes.begin(), E = StructTypes.end();
+       I != E; ++I)
+    if (!(*I)->isOpaque() && (*I)->isSized())
+      TD.getStructLayout(*I);
+  for (Module::iterator I = M.begin(), E = M.end(); I != E; ++I)
+    I->arg_begin();
+}
+
 char LocalDataStructures::ID;
 
 bool LocalDataStructures::runOnModule(Module &M) {
@@ -1479,25 +1620,81 @@ bool LocalDataStructures::runOnModule(Module &M) {
   formGlobalFunctionList();
   GlobalsGraph->maskIncompleteMarkers();
 
-  // Calculate all of the graphs...
+  // Read the graphs of the functions which are unchanged since an earlier run
+  // from the cache, and visit the others on a thread pool.  Merging the graphs
+  // into the globals graph still happens below, one function at a time in
+  // module order, so that the result is the same as building each graph at
+  // its turn.
+  DSGraphCache *Cache = DSGraphCache::create(M);
+  std::vector<PendingGraph> Pending;
+  unsigned NumUnbuilt = 0;
   for (Module::iterator I = M.begin(), E = M.end(); I != E; ++I)
     if (!I->isDeclaration()) {
-      DSGraph* G = new DSGraph(GlobalECs, getDataLayout(), *TypeSS, GlobalsGraph);
-      GraphBuilder GGB(*I, *G, *this);
-      G->getAuxFunctionCalls() = G->getFunctionCalls();
-      setDSGraph(*I, G);
-      propagateUnknownFlag(G);
-      callgraph.insureEntry(&*I);
-      G->buildCallGraph(callgraph, GlobalFunctionList, true);
-      G->maskIncompleteMarkers();
-      G->markIncompleteNodes(DSGraph::MarkFormalArgs
-                             |DSGraph::IgnoreGlobals);
-      cloneIntoGlobals(G, DSGraph::DontCloneCallNodes |
-                       DSGraph::DontCloneAuxCallNodes |
-                       DSGraph::StripAllocaBit);
-      formGlobalECs();
-      DEBUG(G->AssertGraphOK());
+      PendingGraph P;
+      P.F = &*I;
+      P.G = 0;
+      P.Loaded = false;
+      if (!Cache || !loadPendingGraph(*Cache, P, *this))
+        ++NumUnbuilt;
+      Pending.push_back(P);
     }
+  unsigned Threads = LocalThreads;
+  if (!Threads)
+    Threads = std::max(1u, std::thread::hardware_concurrency());
+  if (Threads > 1 && NumUnbuilt > 1) {
+    DSScalarMap::LeaderTableTy Leaders;
+    prepareForThreads(M, getDataLayout(), GlobalECs, Leaders);
+    std::vector<DSGraph*> Built;
+    ThreadPool Pool(Threads);
+    for (unsigned i = 0, e = Pending.size(); i != e; ++i) {
+      if (Pending[i].G)
+        continue;
+      Pending[i].G = new DSGraph(GlobalECs, getDataLayout(), *TypeSS,
+                                 GlobalsGraph);
+      Pending[i].G->getScalarMap().setLeaderTable(&Leaders);
+      Built.push_back(Pending[i].G);
+      if (!Cache)
+        collectLeaders(Pending[i]);
+      Pool.async(buildPendingGraph, &Pending[i], this);
+    }
+    Pool.wait();
+    for (unsigned i = 0, e = Built.size(); i != e; ++i)
+      Built[i]->getScalarMap().setLeaderTable(0);
+  }
+
+  // Calculate all of the graphs...
+  for (unsigned i = 0, e = Pending.size(); i != e; ++i) {
+    Function *I = Pending[i].F;
+    DSGraph* G = Pending[i].G;
+    if (G && leadersChanged(Pending[i])) {
+      delete G;
+      G = Pending[i].G = 0;
+      Pending[i].Loaded = false;
+    }
+    if (!G && Cache && loadPendingGraph(*Cache, Pending[i], *this))
+      G = Pending[i].G;
+    if (!G) {
+      G = new DSGraph(GlobalECs, getDataLayout(), *TypeSS, GlobalsGraph);
+      GraphBuilder GGB(*I, *G, *this, false);
+    }
+    if (Cache && !Pending[i].Loaded && !Pending[i].Key.empty())
+      Cache->store(Pending[i].Key, *G);
+    GraphBuilder::finish(*G);
+    G->getAuxFunctionCalls() = G->getFunctionCalls();
+    setDSGraph(*I, G);
+    propagateUnknownFlag(G);
+    callgraph.insureEntry(I);
+    G->buildCallGraph(callgraph, GlobalFunctionList, true);
+    G->maskIncompleteMarkers();
+    G->markIncompleteNodes(DSGraph::MarkFormalArgs
+                           |DSGraph::IgnoreGlobals);
+    cloneIntoGlobals(G, DSGraph::DontCloneCallNodes |
+                     DSGraph::DontCloneAuxCallNodes |
+                     DSGraph::StripAllocaBit);
+    formGlobalECs();
+    DEBUG(G->AssertGraphOK());
+  }
+  delete Cache;
 
   //GlobalsGraph->removeTriviallyDeadNodes();
   GlobalsGraph->markIncompleteNodes(DSGraph::MarkFormalArgs
@@ -1511,15 +1708,12 @@ bool LocalDataStructures::runOnModule(Module &M) {
   formGlobalECs();
 
   propagateUnknownFlag(GlobalsGraph);
+
+  // Merge the globals graph into each graph once it is asked for, or into
+  // the copies the next pass makes of them.
   for (Module::iterator I = M.begin(), E = M.end(); I != E; ++I)
     if (!I->isDeclaration()) {
-      DSGraph *Graph = getOrCreateGraph(&*I);
-      Graph->maskIncompleteMarkers();
-      cloneGlobalsInto(Graph, DSGraph::DontCloneCallNodes |
-                       DSGraph::DontCloneAuxCallNodes);
-      Graph->markIncompleteNodes(DSGraph::MarkFormalArgs
-                                 |DSGraph::IgnoreGlobals);
-    }
+      deferGlobalsInto(getOrCreateGraph(&*I));
 
   return false;
 }
@@ -668,15 +668,12 @@ StdLibDataStructures::runOnModule (Module &M) {
                                     |DSGraph::IgnoreGlobals);
   GlobalsGraph->computeExternalFlags(DSGraph::ProcessCallSites);
   DEBUG(GlobalsGraph->AssertGraphOK());
+
+  // Merge the globals graph into each graph once it is asked for, or into
+  // the copies the next pass makes of them.
   for (Module::iterator I = M.begin(), E = M.end(); I != E; ++I)
     if (!I->isDeclaration()) {
-      DSGraph *Graph = getOrCreateGraph(&*I);
-      Graph->maskIncompleteMarkers();
-      cloneGlobalsInto(Graph, DSGraph::DontCloneCallNodes |
-                       DSGraph::DontCloneAuxCallNodes);
-      Graph->markIncompleteNodes(DSGraph::MarkFormalArgs
-                                 |DSGraph::IgnoreGlobals);
-    }
+      deferGlobalsInto(getOrCreateGraph(&*I));
 
   return false;
 }
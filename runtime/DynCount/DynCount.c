@@ -1,25 +1,212 @@
+/*===- DynCount.c - Runtime for the dyncount pass -------------------------===//
+//
+//                          The SAFECode Compiler
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// The dyncount pass gives every load and store an instrumentation id, and
+// counts how often each one executes in a thread-local array, so that threads
+// never write to the same cache lines.  Each thread registers its array here
+// the first time it runs instrumented code.  When a thread exits, its counts
+// are added to those of the threads which exited before it.
+//
+// The totals are written at exit to the file named by DYN_COUNT_FILE, or to
+// lsstats by default.  If DYN_COUNT_INTERVAL is set to a number of seconds,
+// the file is also rewritten that often while the program runs.  The first two
+// lines give the number of safe and of all memory accesses executed, and each
+// following line gives the id and count of one access executed at least once,
+// and 1 if it is type safe, or 0 otherwise.
+//
+//===----------------------------------------------------------------------===*/
+
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* The counters of one thread */
+struct ThreadCounts {
+  unsigned long * Counts;
+  struct ThreadCounts * Prev;
+  struct ThreadCounts * Next;
+};
+
+static pthread_once_t Once = PTHREAD_ONCE_INIT;
+static pthread_key_t ThreadKey;
+
+/* The registered threads and the counts of those which have exited */
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ThreadCounts * Threads = 0;
+static unsigned long * Retired = 0;
+static unsigned NumSites = 0;
+
+/* Which accesses are type safe; set up by DYN_COUNT_setup */
+static const unsigned char * SiteIsSafe = 0;
+static const char * DumpPath = "lsstats";
+
+/* Serializes the dumps of the interval thread and of exit */
+static pthread_mutex_t DumpLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+threadExit (void * Data) {
+  struct ThreadCounts * T = (struct ThreadCounts *) Data;
+  unsigned i;
 
-static unsigned long * Total = 0;
-static unsigned long * Safe = 0;
+  pthread_mutex_lock (&Lock);
+  for (i = 0; i < NumSites; ++i)
+    Retired[i] += T->Counts[i];
+  if (T->Prev)
+    T->Prev->Next = T->Next;
+  else
+    Threads = T->Next;
+  if (T->Next)
+    T->Next->Prev = T->Prev;
+  pthread_mutex_unlock (&Lock);
+  free (T);
+}
+
+static void
+createKey (void) {
+  pthread_key_create (&ThreadKey, threadExit);
+}
+
+/*
+ * Function: DYN_COUNT_register()
+ *
+ * Description:
+ *  Register the counters of the calling thread.  The instrumented code calls
+ *  this when the thread-local flag Ready is clear, and the flag is set here.
+ */
+void
+DYN_COUNT_register (unsigned long * counts, unsigned numSites,
+                    unsigned char * ready) {
+  struct ThreadCounts * T;
+
+  pthread_once (&Once, createKey);
+  T = (struct ThreadCounts *) malloc (sizeof (struct ThreadCounts));
+  T->Counts = counts;
+  T->Prev = 0;
+
+  pthread_mutex_lock (&Lock);
+  if (!Retired) {
+    NumSites = numSites;
+    Retired = (unsigned long *) calloc (numSites ? numSites : 1,
+                                        sizeof (unsigned long));
+  }
+  T->Next = Threads;
+  if (Threads)
+    Threads->Prev = T;
+  Threads = T;
+  pthread_mutex_unlock (&Lock);
+
+  pthread_setspecific (ThreadKey, T);
+  *ready = 1;
+}
+
+/*
+ * Function: dump()
+ *
+ * Description:
+ *  Write the counts of all threads to DumpPath.  The counts of running threads
+ *  are read while they change, so a dump taken while the program runs is only
+ *  a sample.  The file is written under another name and then renamed, so a
+ *  reader never sees a partial dump.  Dumps are serialized by DumpLock, as the
+ *  interval thread may still be dumping when the program exits, and both
+ *  would otherwise write the same temporary file.
+ */
+static void
+dump (void) {
+  unsigned long Safe = 0, Total = 0;
+  unsigned long * Counts;
+  struct ThreadCounts * T;
+  char * TmpPath;
+  FILE * fp;
+  unsigned i;
+
+  pthread_mutex_lock (&Lock);
+  Counts = (unsigned long *) malloc ((NumSites ? NumSites : 1) *
+                                     sizeof (unsigned long));
+  if (NumSites)
+    memcpy (Counts, Retired, NumSites * sizeof (unsigned long));
+  for (T = Threads; T; T = T->Next)
+    for (i = 0; i < NumSites; ++i)
+      Counts[i] += T->Counts[i];
+  pthread_mutex_unlock (&Lock);
+
+  for (i = 0; i < NumSites; ++i) {
+    Total += Counts[i];
+    if (SiteIsSafe && SiteIsSafe[i])
+      Safe += Counts[i];
+  }
+
+  pthread_mutex_lock (&DumpLock);
+  TmpPath = (char *) malloc (strlen (DumpPath) + 5);
+  strcpy (TmpPath, DumpPath);
+  strcat (TmpPath, ".tmp");
+  if ((fp = fopen (TmpPath, "w"))) {
+    fprintf (fp, "%lu Safe \n", Safe);
+    fprintf (fp, "%lu Total \n", Total);
+    for (i = 0; i < NumSites; ++i)
+      if (Counts[i])
+        fprintf (fp, "%u %lu %d\n", i, Counts[i],
+                 SiteIsSafe && SiteIsSafe[i] ? 1 : 0);
+    fclose (fp);
+    rename (TmpPath, DumpPath);
+  }
+  pthread_mutex_unlock (&DumpLock);
+  free (TmpPath);
+  free (Counts);
+}
 
 static void
 printItAll (void) {
-  FILE * fp = fopen ("lsstats", "w");
-  fprintf (fp, "%lu Safe \n", *Safe);
-  fprintf (fp, "%lu Total \n", *Total);
-  fflush (fp);
-  fclose (fp);
+  dump ();
   return;
 }
 
+static void *
+dumpThread (void * Arg) {
+  unsigned Interval = *(unsigned *) Arg;
+  for (;;) {
+    sleep (Interval);
+    dump ();
+  }
+  return 0;
+}
+
+/*
+ * Function: DYN_COUNT_setup()
+ *
+ * Description:
+ *  Called from main().  Records which of the numSites accesses are type safe,
+ *  and arranges for the counts to be written at exit and, if requested, every
+ *  DYN_COUNT_INTERVAL seconds.
+ */
 void
-DYN_COUNT_setup (unsigned long * total, unsigned long * safe) {
-  Total = total;
-  Safe = safe;
+DYN_COUNT_setup (const unsigned char * safe, unsigned numSites) {
+  static unsigned Interval;
+  const char * Env;
+  pthread_t Tid;
+
+  SiteIsSafe = safe;
+  pthread_mutex_lock (&Lock);
+  if (!Retired) {
+    NumSites = numSites;
+    Retired = (unsigned long *) calloc (numSites ? numSites : 1,
+                                        sizeof (unsigned long));
+  }
+  pthread_mutex_unlock (&Lock);
+
+  if ((Env = getenv ("DYN_COUNT_FILE")) && *Env)
+    DumpPath = Env;
   atexit (printItAll);
+
+  if ((Env = getenv ("DYN_COUNT_INTERVAL")) && (Interval = atoi (Env)) > 0)
+    if (pthread_create (&Tid, 0, dumpThread, &Interval) == 0)
+      pthread_detach (Tid);
   return;
 }
-
-
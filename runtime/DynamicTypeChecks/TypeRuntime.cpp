@@ -11,8 +11,14 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/mman.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HAVE_SSE2_KERNELS 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
 
-#include <map>
 
 using std::cerr;
 
@@ -22,26 +28,25 @@ using std::cerr;
 #define ARCH_64 1
 #endif
 
-/* Size of shadow memory.  We're hoping everything fits in 46bits. */
-#ifdef ARCH_64
-#define SIZE ((size_t)(1L << 46))
-#else
-#define SIZE ((size_t)(1L << 31))
-#endif
-
-/* Fixed start of memory.  Needs to be page-aligned,
- * and it needs to be large enough that program itself is loaded below it
- * and so are the libraries. 
- * FIXME: This address has been picked for maute. Might not work on other
- * machines. Need a more robust way of picking base address.
- * For now, run a version of the tool without the base fixed, and 
- * choose address.
+/*
+ * The shadow memory holds one type tag per byte of the program's memory.  It
+ * is a two level table: the address space is split into chunks of CHUNK_SIZE
+ * bytes, and a top level table, placed wherever mmap finds room for it, holds
+ * a pointer to the tags of each chunk.  A chunk's tags are only mapped the
+ * first time one of them is written; until then they all read as 0, which is
+ * what an untouched byte of the old flat shadow held.  Both levels are mapped
+ * with MAP_NORESERVE, so the memory used grows with the memory the program
+ * actually touches.
  */
 #ifdef ARCH_64
-#define BASE ((TypeTagTy *)(0x2aaaad01e000))
+#define ADDRESS_BITS 48
 #else
-#define BASE ((TypeTagTy *)(0))
+#define ADDRESS_BITS 32
 #endif
+#define CHUNK_BITS 22
+#define CHUNK_SIZE ((uintptr_t)1 << CHUNK_BITS)
+#define CHUNK_MASK (CHUNK_SIZE - 1)
+#define NUM_CHUNKS ((size_t)1 << (ADDRESS_BITS - CHUNK_BITS))
 
 /*
  * Do some macro magic to get mmap macros defined properly on all platforms.
@@ -58,11 +63,32 @@ struct va_info {
   TypeTagTy *metadata;
 };
 
-// Map to store info about va lists
-std::map<void *, struct va_info> VA_InfoMap;
+/*
+ * Info about va lists, keyed by the address of the va_list.  A va_list lives
+ * in the frame of the function which started it, so each thread keeps its
+ * own table and no locking is needed.  The table uses open addressing with
+ * linear probing and is only reallocated when it grows, so lookups and
+ * updates never allocate.  There is no hook for va_end, so entries are never
+ * removed; a va_list at an address seen before simply overwrites its entry.
+ */
+struct va_entry {
+  void *key;
+  struct va_info info;
+};
 
-// Pointer to the shadow_memory
-TypeTagTy * const shadow_begin = BASE;
+struct va_table {
+  unsigned capacity;      // Zero or a power of two.
+  unsigned count;
+  va_entry *entries;
+};
+
+static __thread va_table VA_Table;
+static __thread bool VA_TableRegistered;
+static pthread_once_t VA_TableOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t VA_TableKey;
+
+// The top level of the shadow memory: the tags of each chunk, or null.
+static TypeTagTy **shadow_table;
 
 // Map from type numbers to type names.
 extern char* typeNames[];
@@ -81,6 +107,7 @@ extern "C" {
   void checkVAArgType(void *va_list, TypeTagTy TypeAccessed, uint32_t tag) ;
   void getTypeTag(void *ptr, uint64_t size, TypeTagTy *dest, uint32_t tag) ;
   void checkType(TypeTagTy typeNumber, uint64_t size, TypeTagTy *metadata, void *ptr, uint32_t tag);
+  void checkTypeRange(TypeTagTy typeNumber, uint64_t size, void *ptr, uint64_t count, uint64_t stride, uint32_t tag);
   void trackInitInst(void *ptr, uint64_t size, uint32_t tag) ;
   void trackUnInitInst(void *ptr, uint64_t size, uint32_t tag) ;
   void copyTypeInfo(void *dstptr, void *srcptr, uint64_t size, uint32_t tag) ;
@@ -107,27 +134,291 @@ extern "C" {
 
 void trackInitInst(void *ptr, uint64_t size, uint32_t tag);
 
-inline uintptr_t maskAddress(void *ptr) {
+static void *mapShadow(size_t size) {
+  void *res = mmap(0, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (res == MAP_FAILED) {
+    fprintf(stderr, "Failed to map the shadow memory!\n");
+    fflush(stderr);
+    abort();
+  }
+  return res;
+}
+
+/**
+ * Return the tags of the chunk containing address p, or NULL if none of them
+ * has been written yet.
+ */
+inline TypeTagTy *shadowChunk(uintptr_t p) {
+  assert((p >> CHUNK_BITS) < NUM_CHUNKS && "Address outside the shadow memory");
+  return shadow_table[p >> CHUNK_BITS];
+}
+
+/**
+ * Return the tags of the chunk containing address p, mapping them if needed.
+ * Several threads may race to map the same chunk; the loser unmaps its copy.
+ */
+inline TypeTagTy *shadowChunkForWrite(uintptr_t p) {
+  TypeTagTy *chunk = shadowChunk(p);
+  if (chunk)
+    return chunk;
+  chunk = (TypeTagTy *)mapShadow(CHUNK_SIZE);
+  if (!__sync_bool_compare_and_swap(&shadow_table[p >> CHUNK_BITS], NULL, chunk)) {
+    munmap(chunk, CHUNK_SIZE);
+    chunk = shadow_table[p >> CHUNK_BITS];
+  }
+  return chunk;
+}
+
+/**
+ * Return the number of bytes from p, at most size, which lie in p's chunk.
+ */
+inline uint64_t chunkSpan(uintptr_t p, uint64_t size) {
+  uint64_t left = CHUNK_SIZE - (p & CHUNK_MASK);
+  return size < left ? size : left;
+}
+
+/**
+ * Set the tags of size bytes at ptr to value.
+ */
+static void shadowSet(void *ptr, int value, uint64_t size) {
+  uintptr_t p = (uintptr_t)ptr;
+  while (size) {
+    uint64_t n = chunkSpan(p, size);
+    TypeTagTy *chunk = value ? shadowChunkForWrite(p) : shadowChunk(p);
+    if (chunk)
+      memset(&chunk[p & CHUNK_MASK], value, n);
+    p += n;
+    size -= n;
+  }
+}
+
+/**
+ * Copy the tags of size bytes at ptr into dest.
+ */
+static void shadowRead(TypeTagTy *dest, void *ptr, uint64_t size) {
+  uintptr_t p = (uintptr_t)ptr;
+  while (size) {
+    uint64_t n = chunkSpan(p, size);
+    if (TypeTagTy *chunk = shadowChunk(p))
+      memcpy(dest, &chunk[p & CHUNK_MASK], n);
+    else
+      memset(dest, 0, n);
+    dest += n;
+    p += n;
+    size -= n;
+  }
+}
+
+/**
+ * Set the tags of size bytes at ptr from src.
+ */
+static void shadowWrite(void *ptr, const TypeTagTy *src, uint64_t size) {
+  uintptr_t p = (uintptr_t)ptr;
+  while (size) {
+    uint64_t n = chunkSpan(p, size);
+    memcpy(&shadowChunkForWrite(p)[p & CHUNK_MASK], src, n);
+    src += n;
+    p += n;
+    size -= n;
+  }
+}
+
+/**
+ * Copy the tags of size bytes at srcptr to dstptr.
+ */
+static void shadowCopy(void *dstptr, void *srcptr, uint64_t size) {
+  uintptr_t d = (uintptr_t)dstptr;
+  uintptr_t s = (uintptr_t)srcptr;
+  while (size) {
+    uint64_t n = chunkSpan(s, chunkSpan(d, size));
+    if (TypeTagTy *from = shadowChunk(s))
+      memmove(&shadowChunkForWrite(d)[d & CHUNK_MASK], &from[s & CHUNK_MASK], n);
+    else
+      shadowSet((void *)d, 0, n);
+    d += n;
+    s += n;
+    size -= n;
+  }
+}
+
+/**
+ * Record that an object of the given type and size starts at ptr.
+ */
+static void shadowStore(void *ptr, TypeTagTy typeNumber, uint64_t size) {
   uintptr_t p = (uintptr_t)ptr;
-  if(ptr < BASE)
-    return p;
-  else 
-    return (p - (uintptr_t)SIZE);
+  if (chunkSpan(p, size) == size) {
+    TypeTagTy *tags = &shadowChunkForWrite(p)[p & CHUNK_MASK];
+    tags[0] = typeNumber;
+    memset(&tags[1], 0xFE, size - 1);
+  } else {
+    shadowSet(ptr, 0xFE, size);
+    shadowSet(ptr, typeNumber, 1);
+  }
+}
+
+static void freeVATable(void *table) {
+  va_table *t = (va_table *)table;
+  free(t->entries);
+  t->entries = NULL;
+  t->capacity = t->count = 0;
+}
+
+static void createVATableKey() {
+  pthread_key_create(&VA_TableKey, freeVATable);
+}
+
+inline unsigned hashVAList(void *va_list, unsigned capacity) {
+  uint64_t h = ((uintptr_t)va_list >> 3) * 0x9E3779B97F4A7C15ULL;
+  return (unsigned)(h >> 32) & (capacity - 1);
+}
+
+/**
+ * Double the size of the calling thread's table, or create it.
+ */
+static void growVATable(va_table &t) {
+  unsigned capacity = t.capacity ? t.capacity * 2 : 64;
+  va_entry *entries = (va_entry *)calloc(capacity, sizeof(va_entry));
+  if (!entries) {
+    fprintf(stderr, "Failed to allocate the va_list table!\n");
+    abort();
+  }
+  for (unsigned i = 0; i < t.capacity; ++i) {
+    if (!t.entries[i].key)
+      continue;
+    unsigned j = hashVAList(t.entries[i].key, capacity);
+    while (entries[j].key)
+      j = (j + 1) & (capacity - 1);
+    entries[j] = t.entries[i];
+  }
+  free(t.entries);
+  t.entries = entries;
+  t.capacity = capacity;
+
+  if (!VA_TableRegistered) {
+    pthread_once(&VA_TableOnce, createVATableKey);
+    pthread_setspecific(VA_TableKey, &t);
+    VA_TableRegistered = true;
+  }
+}
+
+/**
+ * Return the info for va_list, adding a zeroed entry if there is none.
+ */
+static va_info *lookupVAInfo(void *va_list) {
+  va_table &t = VA_Table;
+  if (__builtin_expect(t.capacity != 0, 1)) {
+    unsigned i = hashVAList(va_list, t.capacity);
+    while (t.entries[i].key) {
+      if (t.entries[i].key == va_list)
+        return &t.entries[i].info;
+      i = (i + 1) & (t.capacity - 1);
+    }
+  }
+
+  // Keep the table at most three quarters full.
+  if (4 * (t.count + 1) > 3 * t.capacity)
+    growVATable(t);
+  unsigned i = hashVAList(va_list, t.capacity);
+  while (t.entries[i].key)
+    i = (i + 1) & (t.capacity - 1);
+  t.entries[i].key = va_list;
+  ++t.count;
+  return &t.entries[i].info;
+}
+
+/*
+ * Kernels which return the index of the first of n tags at p that is not x,
+ * or n if they all are.  checkType uses them to confirm that the bytes after
+ * the first of an access are all 0xFE (typed) or 0xFF (initialized).  The
+ * word kernel works everywhere; on x86 SSE2 is always available and AVX2 is
+ * used when shadowInit finds the processor supports it.
+ */
+static uint64_t findTagMismatchWords(const TypeTagTy *p, TypeTagTy x, uint64_t n) {
+  const uint64_t pattern = x * 0x0101010101010101ULL;
+  uint64_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t w;
+    memcpy(&w, &p[i], 8);
+    if (w != pattern)
+      break;
+  }
+  for (; i < n; ++i)
+    if (p[i] != x)
+      return i;
+  return n;
+}
+
+#ifdef HAVE_SSE2_KERNELS
+static uint64_t findTagMismatchSSE2(const TypeTagTy *p, TypeTagTy x, uint64_t n) {
+  const __m128i pattern = _mm_set1_epi8((char)x);
+  uint64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&p[i]);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern));
+    if (mask != 0xFFFF)
+      return i + __builtin_ctz(~mask);
+  }
+  return i + findTagMismatchWords(&p[i], x, n - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t findTagMismatchAVX2(const TypeTagTy *p, TypeTagTy x, uint64_t n) {
+  const __m256i pattern = _mm256_set1_epi8((char)x);
+  uint64_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)&p[i]);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pattern));
+    if (mask != 0xFFFFFFFFu)
+      return i + __builtin_ctz(~mask);
+  }
+  return i + findTagMismatchSSE2(&p[i], x, n - i);
+}
+
+static uint64_t (*findTagMismatchKernel)(const TypeTagTy *, TypeTagTy, uint64_t) =
+  findTagMismatchSSE2;
+#else
+static uint64_t (*findTagMismatchKernel)(const TypeTagTy *, TypeTagTy, uint64_t) =
+  findTagMismatchWords;
+#endif
 
+/**
+ * Return the index of the first tag in metadata[1, size) which is not x, or
+ * size if there is none.  Pointer-sized accesses, the most common, are
+ * checked with a single 8 byte compare.
+ */
+inline uint64_t findTailMismatch(const TypeTagTy *metadata, TypeTagTy x, uint64_t size) {
+  if (size == 8) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    const uint64_t tail = 0x00FFFFFFFFFFFFFFULL;
+#else
+    const uint64_t tail = 0xFFFFFFFFFFFFFF00ULL;
+#endif
+    uint64_t w;
+    memcpy(&w, metadata, 8);
+    if (((w ^ (x * 0x0101010101010101ULL)) & tail) == 0)
+      return size;
+  }
+  if (size <= 1)
+    return size;
+  return 1 + findTagMismatchKernel(&metadata[1], x, size - 1);
 }
 
 /**
  * Initialize the shadow memory which records the 1:1 mapping of addresses to types.
  */
 void shadowInit() {
-  void * res = mmap(BASE, SIZE, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
-
-  if (res == MAP_FAILED) {
-    fprintf(stderr, "Failed to map the shadow memory!\n");
-    fflush(stderr);
-    assert(0 && "MAP_FAILED");
+  if (!shadow_table)
+    shadow_table = (TypeTagTy **)mapShadow(NUM_CHUNKS * sizeof(TypeTagTy *));
+#ifdef HAVE_SSE2_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    findTagMismatchKernel = findTagMismatchAVX2;
+#endif
+  if (VA_Table.entries) {
+    memset(VA_Table.entries, 0, VA_Table.capacity * sizeof(va_entry));
+    VA_Table.count = 0;
   }
-  VA_InfoMap.clear();
 }
 
 /**
@@ -155,9 +446,7 @@ void trackEnvpType(char **envp) {
  * Record the global type and address in the shadow memory.
  */
 void trackGlobal(void *ptr, TypeTagTy typeNumber, uint64_t size, uint32_t tag) {
-  uintptr_t p = maskAddress(ptr);
-  shadow_begin[p] = typeNumber;
-  memset(&shadow_begin[p + 1], 0xFE, size - 1);
+  shadowStore(ptr, typeNumber, size);
 #if DEBUG
   cerr << "Global(" << tag << "): " << ptr << "= " << typeNumber << " " << size << "bytes\n";
 #endif
@@ -167,13 +456,12 @@ void trackGlobal(void *ptr, TypeTagTy typeNumber, uint64_t size, uint32_t tag) {
  * Record the type stored at ptr(of size size) and replicate it
  */
 void trackArray(void *ptr, uint64_t size, uint64_t count, uint32_t tag) {
-  uintptr_t p = maskAddress(ptr);
-  uintptr_t p1 = maskAddress(ptr);
+  char *p = (char *)ptr;
   uint64_t i;
 
   for (i = 1; i < count; ++i) {
     p += size;
-    memcpy(&shadow_begin[p], &shadow_begin[p1], size);
+    shadowCopy(p, ptr, size);
   }
 }
 
@@ -181,9 +469,7 @@ void trackArray(void *ptr, uint64_t size, uint64_t count, uint32_t tag) {
  * Record the stored type and address in the shadow memory.
  */
 void trackStoreInst(void *ptr, TypeTagTy typeNumber, uint64_t size, uint32_t tag) {
-  uintptr_t p = maskAddress(ptr);
-  shadow_begin[p] = typeNumber;
-  memset(&shadow_begin[p + 1], 0xFE, size - 1);
+  shadowStore(ptr, typeNumber, size);
 #if DEBUG
   cerr << "Store(" << tag << "): " << ptr << "= " << typeNumber << " " << size << "bytes\n";
 #endif
@@ -220,11 +506,10 @@ void compareNumber(uint64_t NumArgsPassed, uint64_t ArgAccessed, uint32_t tag){
  * Check that the type being accessed is correct
  */
 void checkVAArgType(void *va_list, TypeTagTy TypeAccessed, uint32_t tag) {
-  va_info v = VA_InfoMap[va_list];
-  compareNumber(v.numElements, v.counter, tag);
-  compareTypes(TypeAccessed, v.metadata[v.counter], tag);
-  v.counter++;
-  VA_InfoMap[va_list] = v;
+  va_info *v = lookupVAInfo(va_list);
+  compareNumber(v->numElements, v->counter, tag);
+  compareTypes(TypeAccessed, v->metadata[v->counter], tag);
+  v->counter++;
 }
 
 /**
@@ -232,10 +517,7 @@ void checkVAArgType(void *va_list, TypeTagTy TypeAccessed, uint32_t tag) {
  * Store it in dest
  */
 void getTypeTag(void *ptr, uint64_t size, TypeTagTy *dest, uint32_t tag) {
-  uintptr_t p = maskAddress(ptr);
-  assert(p + size < SIZE);
-
-  memcpy(dest, &shadow_begin[p], size);
+  shadowRead(dest, ptr, size);
 }
 
 /**
@@ -260,23 +542,32 @@ checkType(TypeTagTy typeNumber, uint64_t size, TypeTagTy *metadata, void *ptr, u
     } else {
       /* If so, set type to the type being read.
          Check that none of the bytes are typed.*/
-      for (unsigned i = 1; i < size; ++i) {
-        if (0xFF != metadata[i]) {
-          printf("Type alignment mismatch(%u): expecting %s, found %s!\n", tag, typeNames[typeNumber], typeNames[metadata[i]]);
-          break;
-        }
-      }
+      uint64_t i = findTailMismatch(metadata, 0xFF, size);
+      if (i < size)
+        printf("Type alignment mismatch(%u): expecting %s, found %s!\n", tag, typeNames[typeNumber], typeNames[metadata[i]]);
       trackStoreInst(ptr, typeNumber, size, tag);
       return ;
     }
   }
 
-  for (unsigned i = 1 ; i < size; ++i) {
-    if (0xFE != metadata[i]) {
-      printf("Type alignment mismatch(%u): expecting %s, found %s!\n", tag, typeNames[typeNumber], typeNames[metadata[0]]);
-      break;
-    }
+  if (findTailMismatch(metadata, 0xFE, size) < size)
+    printf("Type alignment mismatch(%u): expecting %s, found %s!\n", tag, typeNames[typeNumber], typeNames[metadata[0]]);
+}
+
+/**
+ * Check count objects of size bytes, stride bytes apart, starting at ptr.
+ * Replaces the checkType calls of a loop walking an array.
+ */
+void checkTypeRange(TypeTagTy typeNumber, uint64_t size, void *ptr, uint64_t count, uint64_t stride, uint32_t tag) {
+  TypeTagTy buf[64];
+  TypeTagTy *metadata = size <= sizeof(buf) ? buf : (TypeTagTy *)malloc(size);
+  char *p = (char *)ptr;
+  for (uint64_t i = 0; i < count; ++i, p += stride) {
+    shadowRead(metadata, p, size);
+    checkType(typeNumber, size, metadata, p, tag);
   }
+  if (metadata != buf)
+    free(metadata);
 }
 
 /**
@@ -286,8 +577,7 @@ checkType(TypeTagTy typeNumber, uint64_t size, TypeTagTy *metadata, void *ptr, u
 void trackInitInst(void *ptr, uint64_t size, uint32_t tag) {
   if(!ptr)
     return;
-  uintptr_t p = maskAddress(ptr);
-  memset(&shadow_begin[p], 0xFF, size);
+  shadowSet(ptr, 0xFF, size);
 #if DEBUG
   cerr << "Initialize(" << tag << "): " << ptr << " " << size << "bytes\n";
 #endif
@@ -297,8 +587,7 @@ void trackInitInst(void *ptr, uint64_t size, uint32_t tag) {
  * Clear the metadata for given pointer
  */
 void trackUnInitInst(void *ptr, uint64_t size, uint32_t tag) {
-  uintptr_t p = maskAddress(ptr);
-  memset(&shadow_begin[p], 0x00, size);
+  shadowSet(ptr, 0x00, size);
 #if DEBUG
   cerr << "Uninitialize(" << tag << "): " << ptr << " " << size << "bytes\n";
 #endif
@@ -308,9 +597,7 @@ void trackUnInitInst(void *ptr, uint64_t size, uint32_t tag) {
  * Copy size bytes of metadata from src ptr to dest ptr.
  */
 void copyTypeInfo(void *dstptr, void *srcptr, uint64_t size, uint32_t tag) {
-  uintptr_t d = maskAddress(dstptr);
-  uintptr_t s = maskAddress(srcptr);
-  memcpy(&shadow_begin[d], &shadow_begin[s], size);
+  shadowCopy(dstptr, srcptr, size);
 #if DEBUG
   cerr << "Copy(" << tag << "): Dest = " << dstptr << " Source = " << srcptr << " " << size << "bytes\n";
 #endif
@@ -324,8 +611,7 @@ void setTypeInfo(void *dstptr, TypeTagTy *metadata, uint64_t size, TypeTagTy typ
     trackStoreInst(dstptr, type, size, tag);
     return;
   }
-  uintptr_t d = maskAddress(dstptr);
-  memcpy(&shadow_begin[d], metadata, size);
+  shadowWrite(dstptr, metadata, size);
 #if DEBUG
   cerr << "Set(" << tag << "): Dest = " << dstptr << " Source = " << metadata << " " << size << "bytes\n";
 #endif
@@ -336,14 +622,15 @@ void setTypeInfo(void *dstptr, TypeTagTy *metadata, uint64_t size, TypeTagTy typ
  */
 void setVAInfo(void *va_list, uint64_t totalCount, TypeTagTy *metadata_ptr, uint32_t tag) {
   struct va_info v = {totalCount, 0, metadata_ptr};
-  VA_InfoMap[va_list] = v;
+  *lookupVAInfo(va_list) = v;
 }
 
 /**
  * Copy va list metadata from one list to the other.
  */
 void copyVAInfo(void *va_list_dst, void *va_list_src, uint32_t tag) {
-  VA_InfoMap[va_list_dst] = VA_InfoMap[va_list_src];
+  va_info v = *lookupVAInfo(va_list_src);
+  *lookupVAInfo(va_list_dst) = v;
 }
 
 /**
@@ -16,9 +16,12 @@
 
 #include "PoolAllocator.h"
 #include "poolalloc/MMAPSupport.h"
+#include <errno.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 typedef long intptr_t;
 typedef unsigned long uintptr_t;
@@ -45,6 +48,11 @@ typedef unsigned long uintptr_t;
 //#define ALWAYS_USE_MALLOC_FREE
 #endif
 
+// ENABLE_POOL_SNAPSHOT - Keep a registry of the live pools so that the heap can
+// be inspected while the program runs (see poolsnapshot).  Build with
+// ENABLE_POOL_SNAPSHOT=1 to turn it on.
+//#define ENABLE_POOL_SNAPSHOT
+
 //===----------------------------------------------------------------------===//
 // Pool Debugging stuff.
 //===----------------------------------------------------------------------===//
@@ -64,57 +72,167 @@ typedef unsigned long uintptr_t;
 #define PRINT_POOLDESTROY_STATS
 #endif
 
+#if defined(ENABLE_POOL_SNAPSHOT)
+#define ENABLE_POOL_IDS
+#endif
+
 #if defined(ENABLE_POOL_IDS)
+enum PoolKind { NormalPool, BumpPointerPool, CompressedPool };
+
+static PoolKind getPoolKind(PoolTy<NormalPoolTraits> *Pool) {
+  return NormalPool;
+}
+static PoolKind getPoolKind(PoolTy<CompressedPoolTraits> *Pool) {
+  return CompressedPool;
+}
+
 struct PoolID {
   void *PD;
   unsigned ID;
+  PoolKind Kind;
+  PoolID *Next;       // The next pool in the bucket, or on the free list.
+};
+
+// The registry of live pools is a hash table keyed by pool descriptor.  It is
+// split into shards, each with its own lock, so that threads creating and
+// destroying pools seldom wait for each other.  The entries of destroyed pools
+// are kept on a free list in their shard, to be reused by the next pool.
+// poolsnapshot holds every shard lock while it looks at the pools, so that
+// none of them can be destroyed under it.
+#define POOL_ID_SHARDS  16
+#define POOL_ID_BUCKETS 256
+
+struct PoolIDShard {
+  pthread_mutex_t Lock;
+  PoolID *Buckets[POOL_ID_BUCKETS];
+  PoolID *FreeList;
 };
 
-struct PoolID *PoolIDs = 0;
-static unsigned NumLivePools = 0;
-static unsigned NumPoolIDsAllocated = 0;
+static PoolIDShard PoolIDShards[POOL_ID_SHARDS];
+static pthread_once_t PoolIDsOnce = PTHREAD_ONCE_INIT;
 static unsigned CurPoolID = 0;
 
-static unsigned addPoolNumber(void *PD) {
-  if (NumLivePools == NumPoolIDsAllocated) {
-    NumPoolIDsAllocated = (10+NumPoolIDsAllocated)*2;
-    PoolIDs = (PoolID*)realloc(PoolIDs, sizeof(PoolID)*NumPoolIDsAllocated);
-  }
-  
-  PoolIDs[NumLivePools].PD = PD;
-  PoolIDs[NumLivePools].ID = ++CurPoolID;
-  NumLivePools++;
-  return CurPoolID;
+// Pools may be created by the constructors of other files, so the shard locks
+// are set up on first use rather than by a constructor of this one.
+static void InitPoolIDShards() {
+  for (unsigned i = 0; i != POOL_ID_SHARDS; ++i)
+    pthread_mutex_init(&PoolIDShards[i].Lock, NULL);
+}
+
+static unsigned hashPoolDescriptor(void *PD) {
+  uintptr_t V = (uintptr_t)PD >> 4;
+  return (unsigned)(V ^ (V >> 6) ^ (V >> 12));
+}
+
+static PoolIDShard &getPoolIDShard(void *PD) {
+  return PoolIDShards[hashPoolDescriptor(PD) % POOL_ID_SHARDS];
+}
+
+static PoolID *&getPoolIDBucket(PoolIDShard &S, void *PD) {
+  return S.Buckets[(hashPoolDescriptor(PD) / POOL_ID_SHARDS) % POOL_ID_BUCKETS];
+}
+
+static void lockAllPoolIDs() {
+  pthread_once(&PoolIDsOnce, InitPoolIDShards);
+  for (unsigned i = 0; i != POOL_ID_SHARDS; ++i)
+    pthread_mutex_lock(&PoolIDShards[i].Lock);
+}
+
+static void unlockAllPoolIDs() {
+  for (unsigned i = POOL_ID_SHARDS; i != 0; --i)
+    pthread_mutex_unlock(&PoolIDShards[i-1].Lock);
+}
+
+static unsigned addPoolNumber(void *PD, PoolKind Kind) {
+  pthread_once(&PoolIDsOnce, InitPoolIDShards);
+  PoolIDShard &S = getPoolIDShard(PD);
+  pthread_mutex_lock(&S.Lock);
+  PoolID *P = S.FreeList;
+  if (P)
+    S.FreeList = P->Next;
+  else
+    P = (PoolID*)malloc(sizeof(PoolID));
+
+  unsigned PN = __sync_add_and_fetch(&CurPoolID, 1);
+  PoolID *&Bucket = getPoolIDBucket(S, PD);
+  P->PD = PD;
+  P->ID = PN;
+  P->Kind = Kind;
+  P->Next = Bucket;
+  Bucket = P;
+  pthread_mutex_unlock(&S.Lock);
+  return PN;
 }
 
+// getPoolNumber - This is only used for tracing, where it is called with the
+// pool lock held.  It does not take the shard lock, which poolsnapshot
+// acquires before the pool locks.
 static unsigned getPoolNumber(void *PD) {
   if (PD == 0) return ~0;
-  for (unsigned i = 0; i != NumLivePools; ++i)
-    if (PoolIDs[i].PD == PD)
-      return PoolIDs[i].ID;
+  pthread_once(&PoolIDsOnce, InitPoolIDShards);
+  for (PoolID *P = getPoolIDBucket(getPoolIDShard(PD), PD); P; P = P->Next)
+    if (P->PD == PD)
+      return P->ID;
   fprintf(stderr, "INVALID/UNKNOWN POOL DESCRIPTOR: 0x%lX\n",(unsigned long)PD);
   return 0;
 }
 
 static unsigned removePoolNumber(void *PD) {
-  for (unsigned i = 0; i != NumLivePools; ++i)
-    if (PoolIDs[i].PD == PD) {
-      unsigned PN = PoolIDs[i].ID;
-      memmove(&PoolIDs[i], &PoolIDs[i+1], sizeof(PoolID)*(NumLivePools-i-1));
-      --NumLivePools;
+  pthread_once(&PoolIDsOnce, InitPoolIDShards);
+  PoolIDShard &S = getPoolIDShard(PD);
+  pthread_mutex_lock(&S.Lock);
+  for (PoolID **PP = &getPoolIDBucket(S, PD); *PP; PP = &(*PP)->Next)
+    if ((*PP)->PD == PD) {
+      PoolID *P = *PP;
+      unsigned PN = P->ID;
+      *PP = P->Next;
+      P->Next = S.FreeList;
+      S.FreeList = P;
+      pthread_mutex_unlock(&S.Lock);
       return PN;
     }
+  pthread_mutex_unlock(&S.Lock);
   fprintf(stderr, "INVALID/UNKNOWN POOL DESCRIPTOR: 0x%lX\n",(unsigned long)PD);
   return 0;
 }
 
-static void PrintPoolStats(void *Pool);
+static int comparePoolIDs(const void *L, const void *R) {
+  unsigned LID = (*(PoolID*const*)L)->ID, RID = (*(PoolID*const*)R)->ID;
+  return LID < RID ? -1 : LID > RID;
+}
+
+// getLivePools - Return the entries of the live pools, oldest first, in an
+// array which the caller must free.  The caller holds every shard lock.
+static PoolID **getLivePools(unsigned &NumLivePools) {
+  NumLivePools = 0;
+  unsigned Capacity = 0;
+  PoolID **Pools = 0;
+  for (unsigned i = 0; i != POOL_ID_SHARDS; ++i)
+    for (unsigned b = 0; b != POOL_ID_BUCKETS; ++b)
+      for (PoolID *P = PoolIDShards[i].Buckets[b]; P; P = P->Next) {
+        if (NumLivePools == Capacity) {
+          Capacity = (10+Capacity)*2;
+          Pools = (PoolID**)realloc(Pools, sizeof(PoolID*)*Capacity);
+        }
+        Pools[NumLivePools++] = P;
+      }
+  qsort(Pools, NumLivePools, sizeof(PoolID*), comparePoolIDs);
+  return Pools;
+}
+
+template<typename PoolTraits>
+static void PrintPoolStats(PoolTy<PoolTraits> *Pool);
 template<typename PoolTraits>
 static void PrintLivePoolInfo() {
+  lockAllPoolIDs();
+  unsigned NumLivePools;
+  PoolID **Pools = getLivePools(NumLivePools);
   for (unsigned i = 0; i != NumLivePools; ++i) {
-    fprintf(stderr, "[%d] pool at exit ", PoolIDs[i].ID);
-    PrintPoolStats((PoolTy<PoolTraits>*)PoolIDs[i].PD);
+    fprintf(stderr, "[%d] pool at exit ", Pools[i]->ID);
+    PrintPoolStats((PoolTy<PoolTraits>*)Pools[i]->PD);
   }
+  free(Pools);
+  unlockAllPoolIDs();
 }
 #endif
 
@@ -376,8 +494,8 @@ void poolinit_bp(PoolTy<NormalPoolTraits> *Pool, unsigned ObjAlignment) {
   Pool->OtherFreeList = 0;   // This is our end pointer.
 
 #ifdef ENABLE_POOL_IDS
-  unsigned PID;
-  PID = addPoolNumber(Pool);
+  unsigned PID = addPoolNumber(Pool, BumpPointerPool);
+  (void)PID;
 
   DO_IF_TRACE(fprintf(stderr, "[%d] poolinit_bp(0x%X, %d)\n",
                       PID, Pool, ObjAlignment));
@@ -443,8 +561,8 @@ void pooldestroy_bp(PoolTy<NormalPoolTraits> *Pool) {
   assert(Pool && "Null pool pointer passed in to pooldestroy!\n");
 
 #ifdef ENABLE_POOL_IDS
-  unsigned PID;
-  PID = removePoolNumber(Pool);
+  unsigned PID = removePoolNumber(Pool);
+  (void)PID;
   DO_IF_TRACE(fprintf(stderr, "[%d] pooldestroy_bp", PID));
 #endif
   DO_IF_POOLDESTROY_STATS(PrintPoolStats(Pool));
@@ -506,8 +624,8 @@ static void poolinit_internal(PoolTy<PoolTraits> *Pool,
   Pool->DeclaredSize = DeclaredSize;
 
 #ifdef ENABLE_POOL_IDS
-  unsigned PID;
-  PID = addPoolNumber(Pool);
+  unsigned PID = addPoolNumber(Pool, getPoolKind(Pool));
+  (void)PID;
   DO_IF_TRACE(fprintf(stderr, "[%d] poolinit%s(0x%X, %d, %d)\n",
                       PID, PoolTraits::getSuffix(),
                       Pool, DeclaredSize, ObjAlignment));
@@ -534,13 +652,15 @@ void pooldestroy(PoolTy<NormalPoolTraits> *Pool) {
   if(Pool->thread_refcount)
 	  return;
 
-  pthread_mutex_destroy(&Pool->pool_lock);
-
+  // Unregister the pool before its lock goes away; poolsnapshot may be using
+  // it until then.
 #ifdef ENABLE_POOL_IDS
-  unsigned PID;
-  PID = removePoolNumber(Pool);
+  unsigned PID = removePoolNumber(Pool);
+  (void)PID;
   DO_IF_TRACE(fprintf(stderr, "[%d] pooldestroy", PID));
 #endif
+
+  pthread_mutex_destroy(&Pool->pool_lock);
   DO_IF_POOLDESTROY_STATS(PrintPoolStats(Pool));
 
   // Free all allocated slabs.
@@ -919,6 +1039,209 @@ void *poolrealloc(PoolTy<NormalPoolTraits> *Pool, void *Node,
   return to_return;
 }
 
+//===----------------------------------------------------------------------===//
+// Heap snapshots
+//===----------------------------------------------------------------------===//
+
+#ifdef ENABLE_POOL_SNAPSHOT
+
+// Free chunks are counted in power of two size classes: class 0 holds chunks
+// smaller than 32 bytes, class N those from 16<<N bytes up, and the last class
+// everything from 64KB up.
+#define NUM_SIZE_CLASSES 13
+
+static unsigned getSizeClass(unsigned long Size) {
+  unsigned Class = 0;
+  for (Size >>= 5; Size && Class != NUM_SIZE_CLASSES-1; Size >>= 1)
+    ++Class;
+  return Class;
+}
+
+// SlabSnapshot - What poolsnapshot found in the slabs of one pool.
+struct SlabSnapshot {
+  unsigned NumSlabs;
+  unsigned long SlabBytes;      // All nodes in the slabs, headers included.
+  unsigned long BytesInUse;     // The bodies of allocated nodes.
+  unsigned long BytesFree;      // The bodies of free nodes.
+  unsigned long LargestFree;
+  unsigned NumFree;
+  unsigned FreeSizeClasses[NUM_SIZE_CLASSES];
+};
+
+// scanSlabs - Walk every node in the slabs of a normal pool, whose lock the
+// caller holds.
+static void scanSlabs(PoolTy<NormalPoolTraits> *Pool, SlabSnapshot &S) {
+  typedef FreedNodeHeader<NormalPoolTraits> FNHTy;
+  memset(&S, 0, sizeof(S));
+
+  for (PoolSlab<NormalPoolTraits> *PS = Pool->Slabs; PS; PS = PS->getNext()) {
+    ++S.NumSlabs;
+
+    // Find the first node the same way PoolSlab::create placed it.
+    char *Body = (char*)(PS+1);
+    if (Pool->Alignment > sizeof(FNHTy))
+      Body += Pool->Alignment-sizeof(FNHTy);
+
+    // The end of the slab is marked with a node of size ~0.
+    FNHTy *N = (FNHTy*)Body;
+    while (N->Header.Size != (NormalPoolTraits::NodeHeaderType)~0UL) {
+      unsigned long Size = N->Header.Size & ~1UL;
+      S.SlabBytes += Size + sizeof(NodeHeader<NormalPoolTraits>);
+      if (N->Header.Size & 1) {
+        S.BytesInUse += Size;
+      } else {
+        S.BytesFree += Size;
+        ++S.NumFree;
+        ++S.FreeSizeClasses[getSizeClass(Size)];
+        if (Size > S.LargestFree) S.LargestFree = Size;
+      }
+      N = (FNHTy*)((char*)N + sizeof(NodeHeader<NormalPoolTraits>) + Size);
+    }
+  }
+}
+
+static void writePoolSnapshot(FILE *F, const PoolID &P) {
+  static const char *const KindNames[] = { "normal", "bump_pointer",
+                                           "compressed" };
+  PoolTy<NormalPoolTraits> *Pool = (PoolTy<NormalPoolTraits>*)P.PD;
+
+  fprintf(F, "    {\"id\": %u, \"kind\": \"%s\", \"descriptor\": \"%p\"",
+          P.ID, KindNames[P.Kind], P.PD);
+
+  // The layout of pointer compressed pools is different; only the common
+  // fields are reported for them.
+  if (P.Kind == CompressedPool) {
+    fprintf(F, "}");
+    return;
+  }
+
+  pthread_mutex_lock(&Pool->pool_lock);
+  fprintf(F, ", \"declared_size\": %u, \"alignment\": %u",
+          Pool->DeclaredSize, Pool->Alignment);
+
+  unsigned long LargeBytes = 0;
+  fprintf(F, ",\n     \"large_arrays\": [");
+  for (LargeArrayHeader *LAH = Pool->LargeArrays; LAH; LAH = LAH->Next) {
+    fprintf(F, "%s%lu", LAH == Pool->LargeArrays ? "" : ", ", LAH->Size);
+    LargeBytes += LAH->Size;
+  }
+  fprintf(F, "]");
+
+  if (P.Kind == BumpPointerPool) {
+    // Bump pointer slabs have no node headers to walk.
+    unsigned NumSlabs = 0;
+    for (PoolSlab<NormalPoolTraits> *PS = Pool->Slabs; PS; PS = PS->getNext())
+      ++NumSlabs;
+    pthread_mutex_unlock(&Pool->pool_lock);
+    fprintf(F, ", \"slabs\": %u}", NumSlabs);
+    return;
+  }
+
+  SlabSnapshot S;
+  scanSlabs(Pool, S);
+  pthread_mutex_unlock(&Pool->pool_lock);
+
+  // Fragmentation is the fraction of the memory held by the pool which is not
+  // holding live objects: free nodes, node headers and slab padding.
+  unsigned long Total = S.SlabBytes + LargeBytes;
+  double Fragmentation =
+    Total ? 1.0 - (double)(S.BytesInUse + LargeBytes) / Total : 0.0;
+
+  fprintf(F, ", \"slabs\": %u, \"slab_bytes\": %lu, \"bytes_in_use\": %lu,"
+          " \"bytes_free\": %lu, \"free_chunks\": %u, \"largest_free\": %lu,"
+          " \"large_array_bytes\": %lu, \"fragmentation\": %.4f",
+          S.NumSlabs, S.SlabBytes, S.BytesInUse, S.BytesFree, S.NumFree,
+          S.LargestFree, LargeBytes, Fragmentation);
+
+  // The histogram lists [smallest size, count] for each non-empty size class.
+  fprintf(F, ",\n     \"free_histogram\": [");
+  bool First = true;
+  for (unsigned i = 0; i != NUM_SIZE_CLASSES; ++i)
+    if (S.FreeSizeClasses[i]) {
+      fprintf(F, "%s[%u, %u]", First ? "" : ", ", i ? 16U << i : 0,
+              S.FreeSizeClasses[i]);
+      First = false;
+    }
+  fprintf(F, "]}");
+}
+
+int poolsnapshot(const char *FileName) {
+  FILE *F = fopen(FileName, "w");
+  if (!F) return -1;
+
+  lockAllPoolIDs();
+  unsigned NumLivePools;
+  PoolID **Pools = getLivePools(NumLivePools);
+  fprintf(F, "{\"pid\": %d, \"pools\": [\n", (int)getpid());
+  for (unsigned i = 0; i != NumLivePools; ++i) {
+    writePoolSnapshot(F, *Pools[i]);
+    fprintf(F, i+1 != NumLivePools ? ",\n" : "\n");
+  }
+  fprintf(F, "]}\n");
+  unlockAllPoolIDs();
+  free(Pools);
+
+  return fclose(F) == 0 ? 0 : -1;
+}
+
+// When POOLALLOC_SNAPSHOT is set, SIGUSR2 writes a snapshot to a file named
+// after it.  The signal handler only writes to a pipe; the snapshot is taken
+// by a helper thread, which can safely wait for the pool locks.
+static int SnapshotPipe[2] = { -1, -1 };
+
+static void SnapshotSignalHandler(int Sig) {
+  int SavedErrno = errno;
+  char C = 0;
+  (void)write(SnapshotPipe[1], &C, 1);
+  errno = SavedErrno;
+}
+
+static void *SnapshotThread(void *Prefix) {
+  unsigned Seq = 0;
+  char Name[4096];
+  for (;;) {
+    char C;
+    ssize_t N = read(SnapshotPipe[0], &C, 1);
+    if (N < 0 && errno == EINTR) continue;
+    if (N != 1) return 0;
+
+    snprintf(Name, sizeof(Name), "%s.%d.%u", (const char*)Prefix,
+             (int)getpid(), Seq++);
+    if (poolsnapshot(Name))
+      fprintf(stderr, "POOLALLOC_SNAPSHOT: cannot write '%s'\n", Name);
+  }
+}
+
+static void __attribute__((constructor)) InitPoolSnapshot() {
+  const char *Prefix = getenv("POOLALLOC_SNAPSHOT");
+  if (!Prefix || pipe(SnapshotPipe))
+    return;
+
+  pthread_t Thread;
+  pthread_attr_t Attr;
+  pthread_attr_init(&Attr);
+  pthread_attr_setdetachstate(&Attr, PTHREAD_CREATE_DETACHED);
+  int Err = pthread_create(&Thread, &Attr, SnapshotThread, (void*)Prefix);
+  pthread_attr_destroy(&Attr);
+  if (Err) return;
+
+  struct sigaction SA;
+  memset(&SA, 0, sizeof(SA));
+  SA.sa_handler = SnapshotSignalHandler;
+  SA.sa_flags = SA_RESTART;
+  sigemptyset(&SA.sa_mask);
+  sigaction(SIGUSR2, &SA, 0);
+}
+
+#else
+
+int poolsnapshot(const char *FileName) {
+  // The registry of live pools is not kept in this build.
+  return -1;
+}
+
+#endif
+
 #ifdef USE_DYNCALL
 #include <dyncall.h>
 #include <pthread.h>
@@ -1047,15 +1370,15 @@ void *poolinit_pc(PoolTy<CompressedPoolTraits> *Pool,
 
 void pooldestroy_pc(PoolTy<CompressedPoolTraits> *Pool) {
   assert(Pool && "Null pool pointer passed in to pooldestroy!\n");
-  pthread_mutex_destroy(&Pool->pool_lock);
-  if (Pool->Slabs == 0)
-    return;   // no memory allocated from this pool.
-
 #ifdef ENABLE_POOL_IDS
-  unsigned PID;
-  PID = removePoolNumber(Pool);
+  unsigned PID = removePoolNumber(Pool);
+  (void)PID;
   DO_IF_TRACE(fprintf(stderr, "[%d] pooldestroy_pc", PID));
 #endif
+
+  pthread_mutex_destroy(&Pool->pool_lock);
+  if (Pool->Slabs == 0)
+    return;   // no memory allocated from this pool.
   DO_IF_POOLDESTROY_STATS(PrintPoolStats(Pool));
 
   // If there is space to remember this pool, do so.
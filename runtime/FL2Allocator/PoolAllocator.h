@@ -203,6 +203,14 @@ extern "C" {
   ///
   unsigned poolobjsize(PoolTy<NormalPoolTraits> *Pool, void *Node);
 
+  /// poolsnapshot - Write a description of every live pool (its slabs, the
+  /// bytes in use, a histogram of free chunk sizes, its large arrays and its
+  /// fragmentation) to FileName as JSON.  This may be called at any time from
+  /// any thread.  Return 0 on success and -1 if the file cannot be written,
+  /// or if the runtime was built without ENABLE_POOL_SNAPSHOT.
+  ///
+  int poolsnapshot(const char *FileName);
+
   // Bump pointer pool library.  This is a pool implementation that does not
   // support frees or reallocs to the pool.  As such, it can be much more
   // efficient and simpler than a general pool implementation.
@@ -34,6 +34,13 @@ void *AllocatePage();
 /// future allocation.
 void FreePage(void *Page);
 
+/// AllocateNPages - Return Num contiguous pages, aligned to PageSize.
+void *AllocateNPages(unsigned Num);
+
+/// FreeNPages - Return Num contiguous pages obtained from AllocateNPages to
+/// the page manager.
+void FreeNPages(void *Page, unsigned Num);
+
 /// GetPages - Just allocate the specified pages on a page boundary.  This is
 ///            a hack for large arrays.
 void * GetPages (unsigned NumPages);
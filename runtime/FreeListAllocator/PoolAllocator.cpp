@@ -66,8 +66,11 @@ createSlab (PoolTy * Pool, unsigned int NodesPerSlab = 0)
   //
   if (NodesPerSlab > MaxNodesPerPage)
   {
+    //
+    // Large arrays never use the block list, so the data starts right after
+    // the header.  This keeps it in the first page, where DataOwner() looks.
+    //
     unsigned NumBytes = sizeof(SlabHeader) + NodeSize * NodesPerSlab;
-    NumBytes += NodesPerSlab * sizeof (NodePointer);
     NewSlab = (struct SlabHeader *)GetPages((NumBytes+PageSize-1)/PageSize);
     if (NewSlab == NULL)
     {
@@ -101,7 +104,9 @@ createSlab (PoolTy * Pool, unsigned int NodesPerSlab = 0)
   NewSlab->NodesPerSlab = NodesPerSlab;
   NewSlab->NextFreeData = NewSlab->LiveNodes = 0;
   NewSlab->Next = NULL;
-  NewSlab->Data = (unsigned char *)NewSlab + sizeof (struct SlabHeader) + ((NodesPerSlab) * sizeof (NodePointer));
+  NewSlab->Data = (unsigned char *)NewSlab + sizeof (struct SlabHeader);
+  if (NewSlab->IsManaged)
+    NewSlab->Data += NodesPerSlab * sizeof (NodePointer);
   return NewSlab;
 }
 
@@ -117,7 +122,7 @@ BlockOwner (unsigned int PageSize, NodePointer p)
   //
   // Convert the node pointer into a slab pointer.
   //
-  return reinterpret_cast<struct SlabHeader *>(reinterpret_cast<intptr_t>(p.Next) & ~(PageSize - 1));
+  return reinterpret_cast<struct SlabHeader *>(reinterpret_cast<intptr_t>(p.Next) & ~(intptr_t)(PageSize - 1));
 }
 
 //
@@ -129,7 +134,7 @@ BlockOwner (unsigned int PageSize, NodePointer p)
 inline struct SlabHeader *
 DataOwner (unsigned int PageSize, void * p)
 {
-  return reinterpret_cast<struct SlabHeader *>(reinterpret_cast<intptr_t>(p) & ~(PageSize - 1));
+  return reinterpret_cast<struct SlabHeader *>(reinterpret_cast<intptr_t>(p) & ~(intptr_t)(PageSize - 1));
 }
 
 //===----------------------------------------------------------------------===//
@@ -213,6 +218,20 @@ pooldestroy(PoolTy *Pool)
     Slabp = Nextp;
   }
 
+  //
+  // Deallocate the free arrays.  Large arrays span several pages.
+  //
+  for (Slabp = Pool->ArraySlabs; Slabp != NULL; Slabp = Nextp)
+  {
+    Nextp = Slabp->Next;
+    if (Slabp->IsManaged)
+      FreePage (Slabp);
+    else
+      FreeNPages (Slabp, (sizeof (struct SlabHeader) +
+                          Pool->NodeSize * Slabp->NodesPerSlab +
+                          PageSize - 1) / PageSize);
+  }
+
   return;
 }
 
@@ -279,7 +298,7 @@ poolallocarray(PoolTy* Pool, unsigned ArraySize)
       //
       // Make the previous node point to the next node.
       //
-      (*Prevp)->Next = Slabp->Next;
+      *Prevp = Slabp->Next;
 
       //
       // Increase the reference count of the slab.
@@ -439,6 +458,14 @@ poolfree (PoolTy * Pool, void * Block)
   {
     if ((--slabp->LiveNodes) == 0)
     {
+      //
+      // The fast array slab is still being carved up; just rewind it.
+      //
+      if (slabp == Pool->FastArray)
+      {
+        slabp->NextFreeData = 0;
+        return;
+      }
       slabp->Next = Pool->ArraySlabs;
       Pool->ArraySlabs = slabp;
     }
@@ -460,3 +487,26 @@ poolfree (PoolTy * Pool, void * Block)
   return;
 }
 
+//
+// Function: poolobjsize ()
+//
+// Description:
+//  Return the number of bytes usable at the specified block.  Array slabs do
+//  not record the length of each array, so for arrays this is the space
+//  remaining in the slab, which is an upper bound on the array size.
+//
+unsigned
+poolobjsize (PoolTy * Pool, void * Block)
+{
+  assert(Pool && "Null pool pointer passed in to poolobjsize!\n");
+  if (Block == NULL)
+    return 0;
+
+  struct SlabHeader * slabp = DataOwner (PageSize, Block);
+  if (!slabp->IsArray)
+    return Pool->NodeSize;
+
+  unsigned NumNodes = slabp->IsManaged ? Pool->MaxNodesPerPage
+                                       : slabp->NodesPerSlab;
+  return (slabp->Data + NumNodes * Pool->NodeSize) - (unsigned char *)Block;
+}
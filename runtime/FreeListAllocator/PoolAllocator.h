@@ -55,6 +55,7 @@ extern "C" {
   void pooldestroy(PoolTy *Pool);
   void *poolalloc(PoolTy *Pool, unsigned NodeSize);
   void poolfree(PoolTy *Pool, void *Node);
+  unsigned poolobjsize(PoolTy *Pool, void *Node);
 }
 
 #endif
@@ -30,11 +30,15 @@ extern unsigned PageSize;
 /// alignment specified by getPageSize().
 void *AllocatePage();
 
-/// AllocateNPages - 
+/// AllocateNPages - Return Num contiguous pages, aligned to PageSize.
 void *AllocateNPages(unsigned Num);
 
 /// FreePage - This function returns the specified page to the pagemanager for
 /// future allocation.
 void FreePage(void *Page);
 
+/// FreeNPages - Return Num contiguous pages obtained from AllocateNPages to
+/// the page manager.
+void FreeNPages(void *Page, unsigned Num);
+
 #endif
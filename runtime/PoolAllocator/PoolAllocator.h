@@ -35,6 +35,7 @@ extern "C" {
   void *poolalloc(PoolTy *Pool, unsigned NumBytes);
   void poolfree(PoolTy *Pool, void *Node);
   void poolcheck(PoolTy *Pool, void *Node);
+  unsigned poolobjsize(PoolTy *Pool, void *Node);
 }
 
 #endif
@@ -15,6 +15,11 @@
 // used to track a linked list of slabs which are full, ie, all elements have
 // been allocated from them.
 //
+// Every slab starts on a page boundary, so the slab holding a node allocated
+// with poolalloc can be found by masking its address.  poolcheck has to cope
+// with any pointer, including ones into the later pages of a large array, so
+// it uses a table mapping each page of each slab to the slab that owns it.
+//
 //===----------------------------------------------------------------------===//
 
 #include "PoolAllocator.h"
@@ -22,6 +27,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 //===----------------------------------------------------------------------===//
 //
@@ -35,6 +41,7 @@
 //
 struct PoolSlab {
   PoolSlab **PrevPtr, *Next;
+  PoolTy *Pool;         // The pool this slab belongs to
   bool isSingleArray;   // If this slab is used for exactly one array
 
 private:
@@ -85,6 +92,47 @@ private:
     NodeFlagsVector[NodeNum/16] &= ~(1 << ((NodeNum & 15)+16));
   }
 
+  // markNodesAllocated - Mark the nodes [Begin, End) allocated, a word of
+  // flags at a time.
+  void markNodesAllocated(unsigned Begin, unsigned End) {
+    while (Begin != End) {
+      unsigned Word = Begin/16;
+      unsigned Last = (Word+1)*16 < End ? (Word+1)*16 : End;
+      NodeFlagsVector[Word] |= (0xFFFFU >> (16-(Last-Begin))) << (Begin & 15);
+      Begin = Last;
+    }
+  }
+
+  // findUnusedNode - Return the first node at or after Idx which is not
+  // allocated, or the slab size if there is none.  This scans the flags a word
+  // at a time.
+  unsigned findUnusedNode(unsigned Idx) {
+    unsigned SlabSize = getSlabSize();
+    if (Idx >= SlabSize) return SlabSize;
+    unsigned Word = Idx/16;
+    unsigned Free = ~NodeFlagsVector[Word] & (0xFFFFU << (Idx & 15)) & 0xFFFF;
+    while (!Free) {
+      if (++Word*16 >= SlabSize) return SlabSize;
+      Free = ~NodeFlagsVector[Word] & 0xFFFF;
+    }
+    Idx = Word*16 + __builtin_ctz(Free);
+    return Idx < SlabSize ? Idx : SlabSize;
+  }
+
+  // findAllocatedNode - Return the first node in [Idx, End) which is
+  // allocated, or End if there is none.
+  unsigned findAllocatedNode(unsigned Idx, unsigned End) {
+    if (Idx >= End) return End;
+    unsigned Word = Idx/16;
+    unsigned Used = NodeFlagsVector[Word] & (0xFFFFU << (Idx & 15)) & 0xFFFF;
+    while (!Used) {
+      if (++Word*16 >= End) return End;
+      Used = NodeFlagsVector[Word] & 0xFFFF;
+    }
+    Idx = Word*16 + __builtin_ctz(Used);
+    return Idx < End ? Idx : End;
+  }
+
 public:
   // create - Create a new (empty) slab and add it to the end of the Pools list.
   static PoolSlab *create(PoolTy *Pool);
@@ -157,6 +205,15 @@ public:
   // this slab.  If the address is not in slab, return -1.
   int containsElement(void *Ptr, unsigned ElementSize) const;
 
+  // isInLiveObject - Return true if Ptr points into an object in this slab
+  // which is currently allocated.  Ptr need not point to the start of it.
+  bool isInLiveObject(void *Ptr, unsigned ElementSize);
+
+  // getNumPages - Return the number of pages this slab spans.
+  unsigned getNumPages() const {
+    return isSingleArray ? *(const unsigned*)&FirstUnused : 1;
+  }
+
   // freeElement - Free the single node, small array, or entire array indicated.
   void freeElement(unsigned short ElementIdx);
   
@@ -164,8 +221,109 @@ public:
   // before ScanIdx, that is allocated.  If there are no allocated nodes in this
   // slab before ScanIdx, return 0.
   unsigned lastNodeAllocated(unsigned ScanIdx);
+
+  // getObjectSize - Return the number of bytes in the allocation starting at
+  // Ptr, which must be the start of a live node, small array or single array.
+  unsigned getObjectSize(void *Ptr, unsigned ElementSize);
+};
+
+//===----------------------------------------------------------------------===//
+//
+//  Slab lookup table
+//
+//===----------------------------------------------------------------------===//
+
+// SlabTable - An open addressing hash table from page numbers to the slab
+// which owns the page, shared by all pools.  Deleted entries are filled by
+// moving later entries of their probe sequence back, so lookups never have to
+// step over tombstones.  The table lives in the system heap; like the rest of
+// this runtime it is not thread safe.
+struct SlabTableEntry {
+  unsigned long Page;     // The page number, or 0 if the entry is empty
+  PoolSlab *Slab;
 };
 
+static SlabTableEntry *SlabTable;
+static unsigned SlabTableSize;      // Zero or a power of two
+static unsigned SlabTableEntries;
+
+static inline unsigned getSlabTableBucket(unsigned long Page) {
+  return (unsigned)(Page * 2654435761UL) & (SlabTableSize-1);
+}
+
+static void insertSlabPage(unsigned long Page, PoolSlab *PS);
+
+static void growSlabTable() {
+  SlabTableEntry *Old = SlabTable;
+  unsigned OldSize = SlabTableSize;
+  SlabTableSize = OldSize ? OldSize*2 : 1024;
+  SlabTable = (SlabTableEntry*)calloc(SlabTableSize, sizeof(SlabTableEntry));
+  assert(SlabTable && "poolalloc: Could not allocate the slab table!");
+  SlabTableEntries = 0;
+  for (unsigned i = 0; i != OldSize; ++i)
+    if (Old[i].Page)
+      insertSlabPage(Old[i].Page, Old[i].Slab);
+  free(Old);
+}
+
+static void insertSlabPage(unsigned long Page, PoolSlab *PS) {
+  if (2*(SlabTableEntries+1) > SlabTableSize)
+    growSlabTable();
+  unsigned B = getSlabTableBucket(Page);
+  while (SlabTable[B].Page && SlabTable[B].Page != Page)
+    B = (B+1) & (SlabTableSize-1);
+  if (!SlabTable[B].Page) ++SlabTableEntries;
+  SlabTable[B].Page = Page;
+  SlabTable[B].Slab = PS;
+}
+
+static void eraseSlabPage(unsigned long Page) {
+  if (!SlabTableSize) return;
+  unsigned Mask = SlabTableSize-1;
+  unsigned B = getSlabTableBucket(Page);
+  while (SlabTable[B].Page != Page) {
+    if (!SlabTable[B].Page) return;
+    B = (B+1) & Mask;
+  }
+
+  // Move back any later entry whose home bucket is not between the hole and
+  // the entry itself, so that its probe sequence stays unbroken.
+  unsigned Hole = B;
+  for (unsigned i = (B+1) & Mask; SlabTable[i].Page; i = (i+1) & Mask) {
+    unsigned Home = getSlabTableBucket(SlabTable[i].Page);
+    if (((i - Home) & Mask) >= ((i - Hole) & Mask)) {
+      SlabTable[Hole] = SlabTable[i];
+      Hole = i;
+    }
+  }
+  SlabTable[Hole].Page = 0;
+  --SlabTableEntries;
+}
+
+// findSlab - Return the slab owning the page Ptr is in, or null if that page
+// is not part of any slab.
+static inline PoolSlab *findSlab(void *Ptr) {
+  if (!SlabTableSize) return 0;
+  unsigned long Page = (unsigned long)Ptr / PageSize;
+  for (unsigned B = getSlabTableBucket(Page); SlabTable[B].Page;
+       B = (B+1) & (SlabTableSize-1))
+    if (SlabTable[B].Page == Page)
+      return SlabTable[B].Slab;
+  return 0;
+}
+
+static void registerSlab(PoolSlab *PS) {
+  unsigned long Page = (unsigned long)PS / PageSize;
+  for (unsigned i = 0, e = PS->getNumPages(); i != e; ++i)
+    insertSlabPage(Page+i, PS);
+}
+
+static void unregisterSlab(PoolSlab *PS) {
+  unsigned long Page = (unsigned long)PS / PageSize;
+  for (unsigned i = 0, e = PS->getNumPages(); i != e; ++i)
+    eraseSlabPage(Page+i);
+}
+
 // create - Create a new (empty) slab and add it to the end of the Pools list.
 PoolSlab *PoolSlab::create(PoolTy *Pool) {
   unsigned NodesPerSlab = getSlabSize(Pool);
@@ -175,7 +333,13 @@ PoolSlab *PoolSlab::create(PoolTy *Pool) {
   assert(Size <= PageSize && "Trying to allocate a slab larger than a page!");
   PoolSlab *PS = (PoolSlab*)AllocatePage();
 
+  // The page may have held a single array, so clear the flags.  The bits past
+  // the last node must stay clear for the scans in findUnusedNode and
+  // findAllocatedNode.
+  memset(PS->NodeFlagsVector, 0, 4*((NodesPerSlab+15)/16));
+
   PS->NumNodesInSlab = NodesPerSlab;
+  PS->Pool = Pool;
   PS->isSingleArray = 0;  // Not a single array!
   PS->FirstUnused = 0;    // Nothing allocated.
   PS->UsedBegin   = 0;    // Nothing allocated.
@@ -183,6 +347,7 @@ PoolSlab *PoolSlab::create(PoolTy *Pool) {
 
   // Add the slab to the list...
   PS->addToList((PoolSlab**)&Pool->Ptr1);
+  registerSlab(PS);
   return PS;
 }
 
@@ -197,17 +362,20 @@ void *PoolSlab::createSingleArray(PoolTy *Pool, unsigned NumNodes) {
 
   PS->addToList((PoolSlab**)&Pool->Ptr2);
 
+  PS->Pool = Pool;
+  PS->NumNodesInSlab = 0; // No node flags; the array starts after the header.
   PS->isSingleArray = 1;  // Not a single array!
   *(unsigned*)&PS->FirstUnused = NumPages;
+  registerSlab(PS);
   return PS->getElementAddress(0, 0);
 }
 
 void PoolSlab::destroy() {
+  unregisterSlab(this);
   if (isSingleArray)
-    for (unsigned NumPages = *(unsigned*)&FirstUnused; NumPages != 1;--NumPages)
-      FreePage((char*)this + (NumPages-1)*PageSize);
-
-  FreePage(this);
+    FreeNPages(this, getNumPages());
+  else
+    FreePage(this);
 }
 
 // allocateSingle - Allocate a single element from this pool, returning -1 if
@@ -225,6 +393,7 @@ int PoolSlab::allocateSingle() {
     unsigned short UE = UsedEnd;
     markNodeAllocated(UE);
     setStartBit(UE);
+    if (UE < UsedBegin) UsedBegin = UE;
     
     // If we are allocating out the first unused field, bump its index also
     if (FirstUnused == UE)
@@ -242,14 +411,10 @@ int PoolSlab::allocateSingle() {
     unsigned Idx = FirstUnused;
     markNodeAllocated(Idx);
     setStartBit(Idx);
+    if (Idx < UsedBegin) UsedBegin = Idx;
     
     // Increment FirstUnused to point to the new first unused value...
-    // FIXME: this should be optimized
-    unsigned short FU = FirstUnused;
-    do {
-      ++FU;
-    } while (FU != SlabSize && isNodeAllocated(FU));
-    FirstUnused = FU;
+    FirstUnused = findUnusedNode(Idx+1);
     
     return Idx;
   }
@@ -269,8 +434,8 @@ int PoolSlab::allocateMultiple(unsigned Size) {
     // Mark the returned entry used and set the start bit
     unsigned UE = UsedEnd;
     setStartBit(UE);
-    for (unsigned i = UE; i != UE+Size; ++i)
-      markNodeAllocated(i);
+    markNodesAllocated(UE, UE+Size);
+    if (UE < UsedBegin) UsedBegin = UE;
     
     // If we are allocating out the first unused field, bump its index also
     if (FirstUnused == UE)
@@ -291,33 +456,29 @@ int PoolSlab::allocateMultiple(unsigned Size) {
     assert(!isNodeAllocated(Idx) && "FirstUsed is not accurate!");
 
     // Check if there is a continuous array of Size nodes starting FirstUnused
-    unsigned LastUnused = Idx+1;
-    for (; LastUnused != Idx+Size && !isNodeAllocated(LastUnused); ++LastUnused)
-      /*empty*/;
+    unsigned LastUnused = findAllocatedNode(Idx+1, Idx+Size);
 
     // If we found an unused section of this pool which is large enough, USE IT!
     if (LastUnused == Idx+Size) {
       setStartBit(Idx);
-      // FIXME: this loop can be made more efficient!
-      for (unsigned i = Idx; i != Idx + Size; ++i)
-        markNodeAllocated(i);
+      markNodesAllocated(Idx, Idx+Size);
 
       // This should not be allocating on the end of the pool, so we don't need
       // to bump the UsedEnd pointer.
       assert(Idx != UsedEnd && "Shouldn't allocate at end of pool!");
+      if (Idx < UsedBegin) UsedBegin = Idx;
 
-      // If we are allocating out the first unused field, bump its index also.
+      // If we are allocating out the first unused field, bump its index past
+      // this allocation and any allocated nodes that follow it.
       if (Idx == FirstUnused)
-        FirstUnused += Size;
+        FirstUnused = findUnusedNode(FirstUnused + Size);
       
       // Return the entry
       return Idx;
     }
 
     // Otherwise, try later in the pool.  Find the next unused entry.
-    Idx = LastUnused;
-    while (Idx+Size <= getSlabSize() && isNodeAllocated(Idx))
-      ++Idx;
+    Idx = findUnusedNode(LastUnused);
   }
 
   return -1;
@@ -340,6 +501,19 @@ int PoolSlab::containsElement(void *Ptr, unsigned ElementSize) const {
   return -1;
 }
 
+// isInLiveObject - Return true if Ptr points into an object in this slab which
+// is currently allocated.  Ptr need not point to the start of it.
+bool PoolSlab::isInLiveObject(void *Ptr, unsigned ElementSize) {
+  char *FirstElement = (char*)getElementAddress(0, 0);
+  if ((char*)Ptr < FirstElement) return false;   // Points into the header
+
+  // A single array owns everything up to the end of its last page.
+  if (isSingleArray)
+    return (char*)Ptr < (char*)this + getNumPages()*PageSize;
+
+  unsigned Index = ((char*)Ptr-FirstElement)/ElementSize;
+  return Index < UsedEnd && isNodeAllocated(Index);
+}
 
 // freeElement - Free the single node, small array, or entire array indicated.
 void PoolSlab::freeElement(unsigned short ElementIdx) {
@@ -436,26 +610,34 @@ unsigned PoolSlab::lastNodeAllocated(unsigned ScanIdx) {
 ContainsAllocatedNode:
   // Figure out exactly which node is allocated in this word now.  The node
   // allocated is the one with the highest bit set in 'Flags'.
-  //
-  // This should use __builtin_clz to get the value, but this builtin is only
-  // available with GCC 3.4 and above.  :(
   assert(Flags && "Should have allocated node!");
   
-  unsigned short MSB;
-#if GCC3_4_EVENTUALLY
-  MSB = 16 - ::__builtin_clz(Flags);
-#else
-  for (MSB = 15; (Flags & (1U << MSB)) == 0; --MSB)
-    /*empty*/;
-#endif
+  unsigned short MSB = 31 - __builtin_clz((unsigned)Flags);
 
   assert((1U << MSB) & Flags);   // The bit should be set
   assert((~(1U << MSB) & Flags) < Flags);// Removing it should make flag smaller
   ScanIdx = CurWord*16 + MSB;
   assert(isNodeAllocated(ScanIdx));
-  return ScanIdx;
+  return ScanIdx+1;
 }
 
+// getObjectSize - Return the number of bytes in the allocation starting at Ptr,
+// which must be the start of a live node, small array or single array.
+unsigned PoolSlab::getObjectSize(void *Ptr, unsigned ElementSize) {
+  if (isSingleArray) {
+    unsigned NumPages = *(unsigned*)&FirstUnused;
+    return (char*)this + NumPages*PageSize - (char*)Ptr;
+  }
+
+  int Idx = containsElement(Ptr, ElementSize);
+  assert(Idx != -1 && isStartOfAllocation(Idx) && "Not a live allocation!");
+
+  // Small arrays extend until the next start bit or the first free node.
+  unsigned End = Idx+1;
+  while (End < UsedEnd && isNodeAllocated(End) && !isStartOfAllocation(End))
+    ++End;
+  return (End-Idx)*ElementSize;
+}
 
 //===----------------------------------------------------------------------===//
 //
@@ -584,73 +766,32 @@ void *poolalloc(PoolTy *Pool, unsigned NumBytes) {
 
 
 
-// SearchForContainingSlab - Do a brute force search through the list of
-// allocated slabs for the node in question.
+// SearchForContainingSlab - Find the slab in Pool which holds the node in
+// question using the slab table.
 //
 static PoolSlab *SearchForContainingSlab(PoolTy *Pool, void *Node,
                                          unsigned &TheIndex) {
-  PoolSlab *PS = (PoolSlab*)Pool->Ptr1;
-  unsigned NodeSize = Pool->NodeSize;
-
-  // Search the partially allocated slab list for the slab that contains this
-  // node.
-  int Idx = -1;
-  if (PS) {               // Pool->Ptr1 could be null if Ptr2 isn't
-    for (; PS; PS = PS->Next) {
-      Idx = PS->containsElement(Node, NodeSize);
-      if (Idx != -1) break;
-    }
-  }
-
-  // If the partially allocated slab list doesn't contain it, maybe the
-  // completely allocated list does.
-  if (PS == 0) {
-    PS = (PoolSlab*)Pool->Ptr2;
-    assert(Idx == -1 && "Found node but don't have PS?");
-    
-    while (1) {
-      assert(PS && "poolfree: node being free'd not found in allocation "
-             " pool specified!\n");
-      Idx = PS->containsElement(Node, NodeSize);
-      if (Idx != -1) break;
-      PS = PS->Next;
-    }
-  }
+  PoolSlab *PS = findSlab(Node);
+  assert(PS && PS->Pool == Pool && "poolfree: node being free'd not found in "
+         "allocation pool specified!\n");
+  int Idx = PS->isSingleArray ? 0 : PS->containsElement(Node, Pool->NodeSize);
+  assert(Idx != -1 && "poolfree: node being free'd is in a slab header!\n");
   TheIndex = Idx;
   return PS;
 }
 
-// same as above, but this is the actual run time check called from the
-// code to check if the node belongs to the pool or not, so will be 
-// like crazy, (use a hash table ?)
-// FIXME cannot call this for pointers in the middle of the node yet,
-// asserts out if we do
+// poolcheck - The run time check called from the code to check that Node
+// points into a live object of Pool.  Node may point into the middle of the
+// object.  The check takes constant time: the slab table gives the slab, and
+// the slab's bitmap tells whether the node is allocated.
 void poolcheck(PoolTy *Pool, void *Node) {
-   PoolSlab *PS = (PoolSlab*)Pool->Ptr1;
-  unsigned NodeSize = Pool->NodeSize;
+  PoolSlab *PS = findSlab(Node);
+  if (PS && PS->Pool == Pool && PS->isInLiveObject(Node, Pool->NodeSize))
+    return;
 
-  // Search the partially allocated slab list for the slab that contains this
-  // node.
-  int Idx = -1;
-  if (PS) {               // Pool->Ptr1 could be null if Ptr2 isn't
-    for (; PS; PS = PS->Next) {
-      Idx = PS->containsElement(Node, NodeSize);
-      if (Idx != -1) break;
-    }
-  }
-
-  // If the partially allocated slab list doesn't contain it, maybe the
-  // completely allocated list does.
-  if (PS == 0) {
-    PS = (PoolSlab*)Pool->Ptr2;
-    while (1) {
-      assert(PS && "poolfree: node being free'd not found in allocation "
-             " pool specified!\n");
-      Idx = PS->containsElement(Node, NodeSize);
-      if (Idx != -1) break;
-      PS = PS->Next;
-    }
-  }
+  fprintf(stderr, "poolcheck: %p is not in a live object of pool %p\n",
+          Node, (void*)Pool);
+  abort();
 }
 
 void poolfree(PoolTy *Pool, void *Node) {
@@ -667,18 +808,17 @@ void poolfree(PoolTy *Pool, void *Node) {
     // pointer in the pool.  Mask off some bits of the address to find the base
     // of the pool.
     assert((PageSize & PageSize-1) == 0 && "Page size is not a power of 2??");
-    PS = (PoolSlab*)((long)Node & ~(PageSize-1));
-
-    if (PS->isSingleArray) {
-      PS->unlinkFromList();
-      PS->destroy();
-      return;
-    }
-
-    Idx = PS->containsElement(Node, Pool->NodeSize);
+    PS = (PoolSlab*)((long)Node & ~(long)(PageSize-1));
+    Idx = PS->isSingleArray ? 0 : PS->containsElement(Node, Pool->NodeSize);
     assert((int)Idx != -1 && "Node not contained in slab??");
   }
 
+  if (PS->isSingleArray) {
+    PS->unlinkFromList();
+    PS->destroy();
+    return;
+  }
+
   // If PS was full, it must have been in list #2.  Unlink it and move it to
   // list #1.
   if (PS->isFull()) {
@@ -691,7 +831,7 @@ void poolfree(PoolTy *Pool, void *Node) {
 
     // If the partially full list has an empty node sitting at the front of the
     // list, insert right after it.
-    if ((*InsertPosPtr)->isEmpty())
+    if (*InsertPosPtr && (*InsertPosPtr)->isEmpty())
       InsertPosPtr = &(*InsertPosPtr)->Next;
 
     PS->addToList(InsertPosPtr);     // Insert it now in the Ptr1 list.
@@ -723,3 +863,11 @@ void poolfree(PoolTy *Pool, void *Node) {
     PS->addToList((PoolSlab**)&Pool->Ptr1);
   }
 }
+
+// poolobjsize - Return the number of bytes allocated to the object at Node.
+unsigned poolobjsize(PoolTy *Pool, void *Node) {
+  assert(Pool && "Null pool pointer passed in to poolobjsize!\n");
+  if (Node == 0) return 0;
+  PoolSlab *PS = (PoolSlab*)((long)Node & ~(long)(PageSize-1));
+  return PS->getObjectSize(Node, Pool->NodeSize);
+}
@@ -0,0 +1,391 @@
+//===- PoolBench.cpp - Microbenchmarks for the pool allocator runtimes ----===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This program runs a fixed set of allocation workloads against every backend
+// of the dispatching runtime (see runtime/PoolDispatch) and prints one CSV
+// record per workload and backend, so that results can be collected and
+// compared between revisions.
+//
+// Usage: poolbench [-n ops] [-t threads] [-b backend] [-w workload] [-o file]
+//
+//===----------------------------------------------------------------------===//
+
+#include "../PoolDispatch/PoolDispatch.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+  // The bump pointer entry points are only provided by FL2.
+  void poolinit_bp(void *Pool, unsigned ObjAlignment);
+  void *poolalloc_bp(void *Pool, unsigned NumBytes);
+  void pooldestroy_bp(void *Pool);
+}
+
+// PoolDesc - Storage for one pool descriptor, as the compiler would reserve it.
+union PoolDesc {
+  void *Words[POOL_DESCRIPTOR_SIZE/sizeof(void*)];
+  long double Align;
+};
+
+// Number of live slots used by the churn workloads.
+static const unsigned NumSlots = 4096;
+
+static unsigned NumOps = 1000000;
+static unsigned NumThreads = 4;
+
+//===----------------------------------------------------------------------===//
+// Utilities
+//===----------------------------------------------------------------------===//
+
+static double now() {
+  struct timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  return TS.tv_sec + TS.tv_nsec * 1e-9;
+}
+
+// Random - A small deterministic generator so that every backend sees exactly
+// the same sequence of requests.
+struct Random {
+  unsigned long State;
+  explicit Random(unsigned long Seed) : State(Seed * 2654435761UL + 1) {}
+  unsigned next() {
+    State ^= State << 13;
+    State ^= State >> 7;
+    State ^= State << 17;
+    return (unsigned)State;
+  }
+};
+
+// getVariableSize - Return a request size skewed towards small objects, in the
+// range [8, 1024).
+static unsigned getVariableSize(Random &R) {
+  unsigned Bits = R.next();
+  unsigned Limit = (Bits & 7) == 0 ? 1024 : ((Bits & 7) < 3 ? 256 : 64);
+  unsigned Size = (Bits >> 3) % Limit;
+  return Size < 8 ? 8 : Size;
+}
+
+// Touch - Write to an object so that its memory is really used.
+static inline void Touch(void *Ptr) {
+  *(volatile char*)Ptr = 1;
+}
+
+//===----------------------------------------------------------------------===//
+// Workloads
+//===----------------------------------------------------------------------===//
+
+// Each workload runs against one backend and returns the number of operations
+// it timed; Seconds is set to the time spent on them.
+typedef unsigned long (*WorkloadFn)(const PoolBackend *B, double &Seconds);
+
+// Churn - Randomly allocate into empty slots and free full ones.
+static unsigned long Churn(const PoolBackend *B, void *PD, void **Slots,
+                           unsigned long Ops, bool Variable,
+                           unsigned long Seed) {
+  Random R(Seed);
+  for (unsigned long i = 0; i != Ops; ++i) {
+    unsigned Bits = R.next();
+    void *&Slot = Slots[Bits % NumSlots];
+    if (Slot) {
+      B->Free(PD, Slot);
+      Slot = 0;
+    } else {
+      Slot = B->Alloc(PD, Variable ? getVariableSize(R) : 32);
+      Touch(Slot);
+    }
+  }
+  return Ops;
+}
+
+static unsigned long FixedChurn(const PoolBackend *B, double &Seconds) {
+  PoolDesc PD;
+  void **Slots = (void**)calloc(NumSlots, sizeof(void*));
+  B->Init(&PD, 32, 8);
+  double Start = now();
+  unsigned long Ops = Churn(B, &PD, Slots, NumOps, false, 1);
+  Seconds = now() - Start;
+  B->Destroy(&PD);
+  free(Slots);
+  return Ops;
+}
+
+static unsigned long VariableChurn(const PoolBackend *B, double &Seconds) {
+  PoolDesc PD;
+  void **Slots = (void**)calloc(NumSlots, sizeof(void*));
+  B->Init(&PD, 0, 8);
+  double Start = now();
+  unsigned long Ops = Churn(B, &PD, Slots, NumOps, true, 2);
+  Seconds = now() - Start;
+  B->Destroy(&PD);
+  free(Slots);
+  return Ops;
+}
+
+// ReallocGrowth - Grow many buffers a little at a time, like a vector or a
+// string builder would.
+static unsigned long ReallocGrowth(const PoolBackend *B, double &Seconds) {
+  PoolDesc PD;
+  const unsigned NumBuffers = 64;
+  void *Buffers[NumBuffers];
+  unsigned Sizes[NumBuffers];
+  memset(Buffers, 0, sizeof(Buffers));
+  B->Init(&PD, 0, 8);
+
+  double Start = now();
+  unsigned long Ops = 0;
+  Random R(3);
+  while (Ops < NumOps / 16) {
+    for (unsigned i = 0; i != NumBuffers; ++i) {
+      if (Buffers[i] == 0 || Sizes[i] >= 64*1024) {
+        B->Free(&PD, Buffers[i]);
+        Sizes[i] = 16;
+        Buffers[i] = B->Alloc(&PD, Sizes[i]);
+      } else {
+        Sizes[i] += Sizes[i]/2 + R.next() % 16;
+        Buffers[i] = B->Realloc(&PD, Buffers[i], Sizes[i]);
+      }
+      ((volatile char*)Buffers[i])[Sizes[i]-1] = 1;
+      ++Ops;
+    }
+  }
+  Seconds = now() - Start;
+  B->Destroy(&PD);
+  return Ops;
+}
+
+// BumpPointer - Allocate without ever freeing, then release the pool.  This is
+// the pattern the bump pointer optimization targets.
+static unsigned long BumpPointer(const PoolBackend *B, double &Seconds) {
+  PoolDesc PD;
+  bool UseBP = strcmp(B->Name, "fl2-bp") == 0;
+  void **Objs = UseBP ? 0 : (void**)malloc(NumOps * sizeof(void*));
+  if (UseBP)
+    poolinit_bp(&PD, 8);
+  else
+    B->Init(&PD, 24, 8);
+
+  double Start = now();
+  for (unsigned long i = 0; i != NumOps; ++i) {
+    void *Obj = UseBP ? poolalloc_bp(&PD, 24) : B->Alloc(&PD, 24);
+    Touch(Obj);
+    if (!UseBP) Objs[i] = Obj;
+  }
+
+  // The malloc backend does not release memory in pooldestroy; a program using
+  // malloc has to free every object itself.
+  if (strcmp(B->Name, "malloc") == 0)
+    for (unsigned long i = 0; i != NumOps; ++i)
+      B->Free(&PD, Objs[i]);
+  if (UseBP)
+    pooldestroy_bp(&PD);
+  else
+    B->Destroy(&PD);
+  Seconds = now() - Start;
+  free(Objs);
+  return NumOps;
+}
+
+// PoolDestroy - Measure only the cost of tearing down a populated pool.
+static unsigned long PoolDestroy(const PoolBackend *B, double &Seconds) {
+  PoolDesc PD;
+  unsigned long NumObjs = NumOps / 4;
+  void **Objs = (void**)malloc(NumObjs * sizeof(void*));
+  B->Init(&PD, 0, 8);
+  Random R(4);
+  for (unsigned long i = 0; i != NumObjs; ++i)
+    Touch(Objs[i] = B->Alloc(&PD, getVariableSize(R)));
+
+  double Start = now();
+  if (strcmp(B->Name, "malloc") == 0)
+    for (unsigned long i = 0; i != NumObjs; ++i)
+      B->Free(&PD, Objs[i]);
+  B->Destroy(&PD);
+  Seconds = now() - Start;
+  free(Objs);
+  return NumObjs;
+}
+
+// HighOccupancy - Fill a pool with fixed size nodes, then repeatedly free a
+// random node and allocate a replacement.  Every allocation has to find the one
+// free node in an otherwise full slab, which is the worst case for the free
+// node searches of the bitmask runtimes.
+static unsigned long HighOccupancy(const PoolBackend *B, double &Seconds) {
+  PoolDesc PD;
+  const unsigned long NumObjs = 16*NumSlots;
+  void **Objs = (void**)malloc(NumObjs * sizeof(void*));
+  B->Init(&PD, 32, 8);
+  for (unsigned long i = 0; i != NumObjs; ++i)
+    Touch(Objs[i] = B->Alloc(&PD, 32));
+
+  Random R(6);
+  double Start = now();
+  for (unsigned long i = 0; i != NumOps; ++i) {
+    void *&Obj = Objs[R.next() % NumObjs];
+    B->Free(&PD, Obj);
+    Touch(Obj = B->Alloc(&PD, 32));
+  }
+  Seconds = now() - Start;
+
+  if (strcmp(B->Name, "malloc") == 0)
+    for (unsigned long i = 0; i != NumObjs; ++i)
+      B->Free(&PD, Objs[i]);
+  B->Destroy(&PD);
+  free(Objs);
+  return NumOps;
+}
+
+// ThreadArgs - The state shared by the threads of the contention workload.
+struct ThreadArgs {
+  const PoolBackend *B;
+  void *PD;
+  pthread_mutex_t *Lock;     // Serializes backends which are not thread safe.
+  unsigned long Ops;
+  unsigned long Seed;
+};
+
+static void *ContentionThread(void *Arg) {
+  ThreadArgs *A = (ThreadArgs*)Arg;
+  void **Slots = (void**)calloc(NumSlots, sizeof(void*));
+  Random R(A->Seed);
+  for (unsigned long i = 0; i != A->Ops; ++i) {
+    unsigned Bits = R.next();
+    void *&Slot = Slots[Bits % NumSlots];
+    if (A->Lock) pthread_mutex_lock(A->Lock);
+    if (Slot) {
+      A->B->Free(A->PD, Slot);
+      Slot = 0;
+    } else {
+      Slot = A->B->Alloc(A->PD, 32);
+    }
+    if (A->Lock) pthread_mutex_unlock(A->Lock);
+    if (Slot) Touch(Slot);
+  }
+
+  if (A->Lock) pthread_mutex_lock(A->Lock);
+  for (unsigned i = 0; i != NumSlots; ++i)
+    A->B->Free(A->PD, Slots[i]);
+  if (A->Lock) pthread_mutex_unlock(A->Lock);
+  free(Slots);
+  return 0;
+}
+
+// Contention - Several threads churning one shared pool.
+static unsigned long Contention(const PoolBackend *B, double &Seconds) {
+  PoolDesc PD;
+  pthread_mutex_t Lock;
+  pthread_mutex_init(&Lock, 0);
+  B->Init(&PD, 32, 8);
+
+  ThreadArgs *Args = new ThreadArgs[NumThreads];
+  pthread_t *Threads = new pthread_t[NumThreads];
+  for (unsigned i = 0; i != NumThreads; ++i) {
+    Args[i].B = B;
+    Args[i].PD = &PD;
+    Args[i].Lock = B->ThreadSafe ? 0 : &Lock;
+    Args[i].Ops = NumOps / NumThreads;
+    Args[i].Seed = 5 + i;
+  }
+
+  double Start = now();
+  for (unsigned i = 0; i != NumThreads; ++i)
+    pthread_create(&Threads[i], 0, ContentionThread, &Args[i]);
+  for (unsigned i = 0; i != NumThreads; ++i)
+    pthread_join(Threads[i], 0);
+  Seconds = now() - Start;
+
+  B->Destroy(&PD);
+  pthread_mutex_destroy(&Lock);
+  delete [] Args;
+  delete [] Threads;
+  return (NumOps / NumThreads) * NumThreads;
+}
+
+struct Workload {
+  const char *Name;
+  WorkloadFn Run;
+};
+
+static const Workload Workloads[] = {
+  { "fixed-churn",    FixedChurn },
+  { "variable-churn", VariableChurn },
+  { "realloc-growth", ReallocGrowth },
+  { "bump-pointer",   BumpPointer },
+  { "contention",     Contention },
+  { "pooldestroy",    PoolDestroy },
+  { "high-occupancy", HighOccupancy },
+};
+
+// The FL2 bump pointer pools are not a backend of the dispatching runtime, but
+// are interesting to compare against in the bump-pointer workload.
+static const PoolBackend FL2BumpPointer = {
+  "fl2-bp", false, 0, 0, 0, 0, 0, 0, 0
+};
+
+static const char *const BackendNames[] = {
+  "fl2", "bitmask", "freelist", "malloc", "fl2-bp"
+};
+
+static void usage(const char *Argv0) {
+  fprintf(stderr, "Usage: %s [-n ops] [-t threads] [-b backend] [-w workload]"
+                  " [-o file]\n", Argv0);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *OnlyBackend = 0, *OnlyWorkload = 0, *OutputFile = 0;
+  int Opt;
+  while ((Opt = getopt(argc, argv, "n:t:b:w:o:")) != -1) {
+    switch (Opt) {
+    case 'n': NumOps = strtoul(optarg, 0, 0); break;
+    case 't': NumThreads = strtoul(optarg, 0, 0); break;
+    case 'b': OnlyBackend = optarg; break;
+    case 'w': OnlyWorkload = optarg; break;
+    case 'o': OutputFile = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (NumOps == 0 || NumThreads == 0)
+    usage(argv[0]);
+
+  FILE *Out = stdout;
+  if (OutputFile && !(Out = fopen(OutputFile, "w"))) {
+    perror(OutputFile);
+    return 1;
+  }
+
+  fprintf(Out, "workload,backend,threads,operations,seconds,ns_per_op\n");
+  for (unsigned w = 0; w != sizeof(Workloads)/sizeof(Workloads[0]); ++w) {
+    const Workload &W = Workloads[w];
+    if (OnlyWorkload && strcmp(OnlyWorkload, W.Name)) continue;
+
+    for (unsigned b = 0; b != sizeof(BackendNames)/sizeof(BackendNames[0]); ++b){
+      if (OnlyBackend && strcmp(OnlyBackend, BackendNames[b])) continue;
+      const PoolBackend *B = getPoolBackend(BackendNames[b]);
+      if (!B) {
+        if (W.Run != BumpPointer) continue;
+        B = &FL2BumpPointer;
+      }
+
+      double Seconds = 0;
+      unsigned long Ops = W.Run(B, Seconds);
+      fprintf(Out, "%s,%s,%u,%lu,%.6f,%.2f\n", W.Name, B->Name,
+              W.Run == Contention ? NumThreads : 1, Ops, Seconds,
+              Ops ? Seconds * 1e9 / Ops : 0.0);
+      fflush(Out);
+    }
+  }
+
+  if (Out != stdout)
+    fclose(Out);
+  return 0;
+}
@@ -0,0 +1,109 @@
+//===- BitMaskBackend.cpp - Bitmask runtime as a dispatch backend ---------===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file builds the bitmask runtime (runtime/PoolAllocator) into the
+// dispatching runtime.  The bitmask runtime only manages fixed size nodes and
+// has no notion of the system heap, so the adaptors below round the declared
+// size up to the requested alignment, send null pools to malloc, and build
+// realloc out of alloc, copy and free.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolDispatch.h"
+
+// System headers must be included before the backend is pulled into its
+// namespace.
+#include "poolalloc/MMAPSupport.h"
+#include "poolalloc/Support/MallocAllocator.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <vector>
+
+namespace bitmask {
+#define poolinit           bitmask_poolinit
+#define poolmakeunfreeable bitmask_poolmakeunfreeable
+#define pooldestroy        bitmask_pooldestroy
+#define poolalloc          bitmask_poolalloc
+#define poolfree           bitmask_poolfree
+#define poolcheck          bitmask_poolcheck
+#define poolobjsize        bitmask_poolobjsize
+#include "../PoolAllocator/PoolAllocatorBitMask.cpp"
+#include "../PoolAllocator/PageManager.cpp"
+#undef poolinit
+#undef poolmakeunfreeable
+#undef pooldestroy
+#undef poolalloc
+#undef poolfree
+#undef poolcheck
+#undef poolobjsize
+}
+
+POOL_DESCRIPTOR_FITS(BitMask, bitmask::PoolTy);
+
+static void BitMaskInit(void *Pool, unsigned DeclaredSize,
+                        unsigned ObjAlignment) {
+  // Variable sized pools still need a node size; use two words.
+  if (DeclaredSize == 0) DeclaredSize = 2*sizeof(void*);
+  if (ObjAlignment < 4) ObjAlignment = __alignof(double);
+  DeclaredSize = (DeclaredSize + ObjAlignment-1) & ~(ObjAlignment-1);
+  bitmask::bitmask_poolinit((bitmask::PoolTy*)Pool, DeclaredSize);
+}
+
+static void BitMaskDestroy(void *Pool) {
+  bitmask::bitmask_pooldestroy((bitmask::PoolTy*)Pool);
+}
+
+static void BitMaskMakeUnfreeable(void *Pool) {
+  bitmask::bitmask_poolmakeunfreeable((bitmask::PoolTy*)Pool);
+}
+
+static void *BitMaskAlloc(void *Pool, unsigned NumBytes) {
+  if (Pool == 0) return malloc(NumBytes);
+  return bitmask::bitmask_poolalloc((bitmask::PoolTy*)Pool, NumBytes);
+}
+
+static void BitMaskFree(void *Pool, void *Node) {
+  if (Node == 0) return;
+  if (Pool == 0) {
+    free(Node);
+    return;
+  }
+  bitmask::bitmask_poolfree((bitmask::PoolTy*)Pool, Node);
+}
+
+static void *BitMaskRealloc(void *Pool, void *Node, unsigned NumBytes) {
+  if (Pool == 0) return realloc(Node, NumBytes);
+  if (Node == 0) return BitMaskAlloc(Pool, NumBytes);
+  if (NumBytes == 0) {
+    BitMaskFree(Pool, Node);
+    return 0;
+  }
+
+  unsigned Size = bitmask::bitmask_poolobjsize((bitmask::PoolTy*)Pool, Node);
+  void *New = BitMaskAlloc(Pool, NumBytes);
+  memcpy(New, Node, Size < NumBytes ? Size : NumBytes);
+  BitMaskFree(Pool, Node);
+  return New;
+}
+
+static unsigned BitMaskObjSize(void *Pool, void *Node) {
+  return bitmask::bitmask_poolobjsize((bitmask::PoolTy*)Pool, Node);
+}
+
+const PoolBackend BitMaskBackend = {
+  "bitmask", false,
+  BitMaskInit, BitMaskDestroy, BitMaskMakeUnfreeable, BitMaskAlloc,
+  BitMaskFree, BitMaskRealloc, BitMaskObjSize
+};
@@ -0,0 +1,89 @@
+//===- FL2Backend.cpp - FL2 runtime as a dispatch backend -----------------===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file builds the FL2 runtime into the dispatching runtime.  The FL2
+// sources are included in their own namespace with the generic entry points
+// renamed, so that they can coexist with the other backends in one library.
+// The bump pointer, pointer compression and access tracing entry points are
+// specific to FL2 and are exported unchanged.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolDispatch.h"
+
+// System headers must be included before the backend is pulled into its
+// namespace.
+#include "poolalloc/MMAPSupport.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace fl2 {
+#define poolinit           fl2_poolinit
+#define poolmakeunfreeable fl2_poolmakeunfreeable
+#define pooldestroy        fl2_pooldestroy
+#define poolalloc          fl2_poolalloc
+#define poolcalloc         fl2_poolcalloc
+#define poolrealloc        fl2_poolrealloc
+#define poolmemalign       fl2_poolmemalign
+#define poolfree           fl2_poolfree
+#define poolobjsize        fl2_poolobjsize
+#include "../FL2Allocator/PoolAllocator.cpp"
+#undef poolinit
+#undef poolmakeunfreeable
+#undef pooldestroy
+#undef poolalloc
+#undef poolcalloc
+#undef poolrealloc
+#undef poolmemalign
+#undef poolfree
+#undef poolobjsize
+}
+
+typedef fl2::PoolTy<fl2::NormalPoolTraits> FL2PoolTy;
+POOL_DESCRIPTOR_FITS(FL2, FL2PoolTy);
+
+static void FL2Init(void *Pool, unsigned DeclaredSize, unsigned ObjAlignment) {
+  fl2::fl2_poolinit((FL2PoolTy*)Pool, DeclaredSize, ObjAlignment);
+}
+
+static void FL2Destroy(void *Pool) {
+  fl2::fl2_pooldestroy((FL2PoolTy*)Pool);
+}
+
+static void FL2MakeUnfreeable(void *Pool) {
+  // FL2 pools are always freeable.
+}
+
+static void *FL2Alloc(void *Pool, unsigned NumBytes) {
+  return fl2::fl2_poolalloc((FL2PoolTy*)Pool, NumBytes);
+}
+
+static void FL2Free(void *Pool, void *Node) {
+  fl2::fl2_poolfree((FL2PoolTy*)Pool, Node);
+}
+
+static void *FL2Realloc(void *Pool, void *Node, unsigned NumBytes) {
+  return fl2::fl2_poolrealloc((FL2PoolTy*)Pool, Node, NumBytes);
+}
+
+static unsigned FL2ObjSize(void *Pool, void *Node) {
+  return fl2::fl2_poolobjsize((FL2PoolTy*)Pool, Node);
+}
+
+const PoolBackend FL2Backend = {
+  "fl2", true,
+  FL2Init, FL2Destroy, FL2MakeUnfreeable, FL2Alloc, FL2Free, FL2Realloc,
+  FL2ObjSize
+};
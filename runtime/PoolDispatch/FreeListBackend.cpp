@@ -0,0 +1,108 @@
+//===- FreeListBackend.cpp - Free list runtime as a dispatch backend ------===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file builds the free list runtime (runtime/FreeListAllocator) into the
+// dispatching runtime.  Like the bitmask runtime it only manages fixed size
+// nodes, so the adaptors below fill in the system heap and realloc cases.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolDispatch.h"
+
+// System headers must be included before the backend is pulled into its
+// namespace.
+#include "poolalloc/MMAPSupport.h"
+#include "poolalloc/Support/MallocAllocator.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <iostream>
+#include <vector>
+
+namespace freelist {
+#define poolinit           freelist_poolinit
+#define poolmakeunfreeable freelist_poolmakeunfreeable
+#define pooldestroy        freelist_pooldestroy
+#define poolalloc          freelist_poolalloc
+#define poolfree           freelist_poolfree
+#define poolobjsize        freelist_poolobjsize
+#include "../FreeListAllocator/PoolAllocator.cpp"
+#include "../FreeListAllocator/PageManager.cpp"
+#undef poolinit
+#undef poolmakeunfreeable
+#undef pooldestroy
+#undef poolalloc
+#undef poolfree
+#undef poolobjsize
+}
+
+POOL_DESCRIPTOR_FITS(FreeList, freelist::PoolTy);
+
+static void FreeListInit(void *Pool, unsigned DeclaredSize,
+                         unsigned ObjAlignment) {
+  // Variable sized pools still need a node size; use two words.
+  if (DeclaredSize == 0) DeclaredSize = 2*sizeof(void*);
+  if (ObjAlignment < 4) ObjAlignment = __alignof(double);
+  DeclaredSize = (DeclaredSize + ObjAlignment-1) & ~(ObjAlignment-1);
+  freelist::freelist_poolinit((freelist::PoolTy*)Pool, DeclaredSize);
+}
+
+static void FreeListDestroy(void *Pool) {
+  freelist::freelist_pooldestroy((freelist::PoolTy*)Pool);
+}
+
+static void FreeListMakeUnfreeable(void *Pool) {
+  freelist::freelist_poolmakeunfreeable((freelist::PoolTy*)Pool);
+}
+
+static void *FreeListAlloc(void *Pool, unsigned NumBytes) {
+  if (Pool == 0) return malloc(NumBytes);
+  return freelist::freelist_poolalloc((freelist::PoolTy*)Pool, NumBytes);
+}
+
+static void FreeListFree(void *Pool, void *Node) {
+  if (Node == 0) return;
+  if (Pool == 0) {
+    free(Node);
+    return;
+  }
+  freelist::freelist_poolfree((freelist::PoolTy*)Pool, Node);
+}
+
+static void *FreeListRealloc(void *Pool, void *Node, unsigned NumBytes) {
+  if (Pool == 0) return realloc(Node, NumBytes);
+  if (Node == 0) return FreeListAlloc(Pool, NumBytes);
+  if (NumBytes == 0) {
+    FreeListFree(Pool, Node);
+    return 0;
+  }
+
+  // The usable size of an array may be larger than the array itself, but it
+  // never extends past the end of its slab, so copying it is safe.  The excess
+  // may overlap the new block when both come from the same slab.
+  unsigned Size = freelist::freelist_poolobjsize((freelist::PoolTy*)Pool, Node);
+  void *New = FreeListAlloc(Pool, NumBytes);
+  memmove(New, Node, Size < NumBytes ? Size : NumBytes);
+  FreeListFree(Pool, Node);
+  return New;
+}
+
+static unsigned FreeListObjSize(void *Pool, void *Node) {
+  return freelist::freelist_poolobjsize((freelist::PoolTy*)Pool, Node);
+}
+
+const PoolBackend FreeListBackend = {
+  "freelist", false,
+  FreeListInit, FreeListDestroy, FreeListMakeUnfreeable, FreeListAlloc,
+  FreeListFree, FreeListRealloc, FreeListObjSize
+};
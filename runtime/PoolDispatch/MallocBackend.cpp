@@ -0,0 +1,59 @@
+//===- MallocBackend.cpp - System malloc as a dispatch backend ------------===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a backend which ignores pools entirely and sends every
+// request to the system heap.  This is the run-time equivalent of building FL2
+// with ALWAYS_USE_MALLOC_FREE, and has the same caveat: memory which the
+// program relies on pooldestroy to release is leaked.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolDispatch.h"
+#include <stdlib.h>
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#else
+#include <malloc.h>
+#endif
+
+static void MallocInit(void *Pool, unsigned DeclaredSize,
+                       unsigned ObjAlignment) {
+}
+
+static void MallocDestroy(void *Pool) {
+}
+
+static void MallocMakeUnfreeable(void *Pool) {
+}
+
+static void *MallocAlloc(void *Pool, unsigned NumBytes) {
+  return malloc(NumBytes);
+}
+
+static void MallocFree(void *Pool, void *Node) {
+  free(Node);
+}
+
+static void *MallocRealloc(void *Pool, void *Node, unsigned NumBytes) {
+  return realloc(Node, NumBytes);
+}
+
+static unsigned MallocObjSize(void *Pool, void *Node) {
+#if defined(__APPLE__)
+  return malloc_size(Node);
+#else
+  return malloc_usable_size(Node);
+#endif
+}
+
+const PoolBackend MallocBackend = {
+  "malloc", true,
+  MallocInit, MallocDestroy, MallocMakeUnfreeable, MallocAlloc, MallocFree,
+  MallocRealloc, MallocObjSize
+};
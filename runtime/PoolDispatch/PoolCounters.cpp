@@ -0,0 +1,202 @@
+//===- PoolCounters.cpp - Hardware event counts per pool lifetime ---------===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a backend which counts cycles, cache misses and data TLB
+// misses with the Linux perf_event_open interface, and attributes them to the
+// pools that were alive while they happened.  It is installed in front of the
+// selected backend when POOLALLOC_COUNTERS names a report file.
+//
+// Each pool is charged with the events of the whole process between its
+// poolinit and its pooldestroy, so the counts of nested pools overlap.  The
+// report starts with a line for the whole process.  Only poolinit and
+// pooldestroy are intercepted; allocation calls go straight to the backend.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolDispatch.h"
+#include "PoolIdMap.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+enum { CountCycles, CountCacheMisses, CountDTLBMisses, NumCounters };
+
+static const char *const CounterNames[NumCounters] = {
+  "cycles", "cache_misses", "dtlb_misses"
+};
+
+// CounterFDs - The perf event file descriptors, or -1 if the event is not
+// available on this machine.
+static int CounterFDs[NumCounters] = { -1, -1, -1 };
+
+static void openCounters() {
+#if defined(__linux__)
+  for (unsigned i = 0; i != NumCounters; ++i) {
+    struct perf_event_attr Attr;
+    memset(&Attr, 0, sizeof(Attr));
+    Attr.size = sizeof(Attr);
+    Attr.exclude_kernel = 1;
+    Attr.exclude_hv = 1;
+    // Count the threads the program creates later as well.
+    Attr.inherit = 1;
+    switch (i) {
+    case CountCycles:
+      Attr.type = PERF_TYPE_HARDWARE;
+      Attr.config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case CountCacheMisses:
+      Attr.type = PERF_TYPE_HARDWARE;
+      Attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+    case CountDTLBMisses:
+      Attr.type = PERF_TYPE_HW_CACHE;
+      Attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    }
+    CounterFDs[i] = syscall(__NR_perf_event_open, &Attr, 0, -1, -1, 0);
+  }
+#endif
+}
+
+// readCounters - Read the current value of every counter into Values.
+// Unavailable counters read as zero.
+static void readCounters(uint64_t *Values) {
+  for (unsigned i = 0; i != NumCounters; ++i) {
+    Values[i] = 0;
+    if (CounterFDs[i] >= 0 &&
+        read(CounterFDs[i], &Values[i], sizeof(uint64_t)) != sizeof(uint64_t))
+      Values[i] = 0;
+  }
+}
+
+// PoolRecord - What is reported for one pool.
+struct PoolRecord {
+  uint64_t Start[NumCounters];    // The counters at poolinit.
+  uint64_t Count[NumCounters];    // The events during the pool's lifetime.
+  unsigned DeclaredSize;
+  bool Live;
+};
+
+static pthread_mutex_t CounterLock = PTHREAD_MUTEX_INITIALIZER;
+static PoolBackend Real;
+static FILE *ReportFile;
+static uint64_t ProcessStart[NumCounters];
+static PoolIdMap PoolIds;
+static PoolRecord *Pools;
+static uint32_t NumPools, PoolsCapacity;
+
+static void CountInit(void *Pool, unsigned DeclaredSize,
+                      unsigned ObjAlignment) {
+  Real.Init(Pool, DeclaredSize, ObjAlignment);
+
+  pthread_mutex_lock(&CounterLock);
+  if (NumPools == PoolsCapacity) {
+    PoolsCapacity = PoolsCapacity ? PoolsCapacity*2 : 256;
+    Pools = (PoolRecord*)realloc(Pools, PoolsCapacity*sizeof(PoolRecord));
+  }
+  uint32_t Id = ++NumPools;
+  PoolRecord &R = Pools[Id-1];
+  memset(&R, 0, sizeof(R));
+  R.DeclaredSize = DeclaredSize;
+  R.Live = true;
+  PoolIds.insert(Pool, Id, 0, 0);
+  readCounters(R.Start);
+  pthread_mutex_unlock(&CounterLock);
+}
+
+static void CountDestroy(void *Pool) {
+  uint64_t Now[NumCounters];
+  readCounters(Now);
+
+  pthread_mutex_lock(&CounterLock);
+  if (uint32_t Id = PoolIds.erase(Pool)) {
+    PoolRecord &R = Pools[Id-1];
+    for (unsigned i = 0; i != NumCounters; ++i)
+      R.Count[i] = Now[i] - R.Start[i];
+    R.Live = false;
+  }
+  pthread_mutex_unlock(&CounterLock);
+
+  Real.Destroy(Pool);
+}
+
+static void printCounts(const uint64_t *Counts) {
+  for (unsigned i = 0; i != NumCounters; ++i)
+    if (CounterFDs[i] >= 0)
+      fprintf(ReportFile, ",%llu", (unsigned long long)Counts[i]);
+    else
+      fprintf(ReportFile, ",-");
+  fprintf(ReportFile, "\n");
+}
+
+// WriteReport - Write one line for the process and one for each pool.  Pools
+// which are still alive are charged up to now.
+static void WriteReport() {
+  uint64_t Now[NumCounters], Counts[NumCounters];
+  readCounters(Now);
+
+  pthread_mutex_lock(&CounterLock);
+  fprintf(ReportFile, "pool,declared_size");
+  for (unsigned i = 0; i != NumCounters; ++i)
+    fprintf(ReportFile, ",%s", CounterNames[i]);
+  fprintf(ReportFile, "\n");
+
+  for (unsigned i = 0; i != NumCounters; ++i)
+    Counts[i] = Now[i] - ProcessStart[i];
+  fprintf(ReportFile, "process,0");
+  printCounts(Counts);
+
+  for (uint32_t Id = 1; Id <= NumPools; ++Id) {
+    PoolRecord &R = Pools[Id-1];
+    for (unsigned i = 0; i != NumCounters; ++i)
+      Counts[i] = R.Live ? Now[i] - R.Start[i] : R.Count[i];
+    fprintf(ReportFile, "%u,%u", Id, R.DeclaredSize);
+    printCounts(Counts);
+  }
+
+  if (ReportFile != stderr)
+    fclose(ReportFile);
+  ReportFile = 0;
+  pthread_mutex_unlock(&CounterLock);
+}
+
+static PoolBackend CountBackend;
+
+const PoolBackend *getCountingBackend(const PoolBackend *B,
+                                      const char *FileName) {
+  if (strcmp(FileName, "-") == 0)
+    ReportFile = stderr;
+  else if (!(ReportFile = fopen(FileName, "w"))) {
+    fprintf(stderr, "POOLALLOC_COUNTERS: cannot create '%s', not counting\n",
+            FileName);
+    return B;
+  }
+
+  openCounters();
+  for (unsigned i = 0; i != NumCounters; ++i)
+    if (CounterFDs[i] < 0)
+      fprintf(stderr, "POOLALLOC_COUNTERS: %s cannot be counted here\n",
+              CounterNames[i]);
+  readCounters(ProcessStart);
+  atexit(WriteReport);
+
+  Real = *B;
+  CountBackend = *B;
+  CountBackend.Init = CountInit;
+  CountBackend.Destroy = CountDestroy;
+  return &CountBackend;
+}
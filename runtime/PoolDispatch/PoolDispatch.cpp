@@ -0,0 +1,189 @@
+//===- PoolDispatch.cpp - Run-time selection of the pool runtime ----------===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements the pool allocator entry points of the dispatching
+// runtime.  Each entry point costs exactly one indirect call through the
+// process-wide backend table.
+//
+// The table starts out pointing at a set of bootstrap functions which select
+// the real backend and then forward to it.  This allows pools to be created
+// from static constructors which run before our own constructor, without
+// adding a check for initialization to every allocation.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolDispatch.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void SelectBackend();
+
+//===----------------------------------------------------------------------===//
+// Bootstrap backend
+//===----------------------------------------------------------------------===//
+
+static void BootInit(void *Pool, unsigned DeclaredSize, unsigned ObjAlignment);
+static void BootDestroy(void *Pool);
+static void BootMakeUnfreeable(void *Pool);
+static void *BootAlloc(void *Pool, unsigned NumBytes);
+static void BootFree(void *Pool, void *Node);
+static void *BootRealloc(void *Pool, void *Node, unsigned NumBytes);
+static unsigned BootObjSize(void *Pool, void *Node);
+
+// Backend - The table every entry point dispatches through.  This is a copy of
+// the selected backend rather than a pointer to it, so that a call only needs
+// to load the function pointer.
+static PoolBackend Backend = {
+  "bootstrap", false,
+  BootInit, BootDestroy, BootMakeUnfreeable, BootAlloc, BootFree, BootRealloc,
+  BootObjSize
+};
+
+static void BootInit(void *Pool, unsigned DeclaredSize, unsigned ObjAlignment) {
+  SelectBackend();
+  Backend.Init(Pool, DeclaredSize, ObjAlignment);
+}
+
+static void BootDestroy(void *Pool) {
+  SelectBackend();
+  Backend.Destroy(Pool);
+}
+
+static void BootMakeUnfreeable(void *Pool) {
+  SelectBackend();
+  Backend.MakeUnfreeable(Pool);
+}
+
+static void *BootAlloc(void *Pool, unsigned NumBytes) {
+  SelectBackend();
+  return Backend.Alloc(Pool, NumBytes);
+}
+
+static void BootFree(void *Pool, void *Node) {
+  SelectBackend();
+  Backend.Free(Pool, Node);
+}
+
+static void *BootRealloc(void *Pool, void *Node, unsigned NumBytes) {
+  SelectBackend();
+  return Backend.Realloc(Pool, Node, NumBytes);
+}
+
+static unsigned BootObjSize(void *Pool, void *Node) {
+  SelectBackend();
+  return Backend.ObjSize(Pool, Node);
+}
+
+//===----------------------------------------------------------------------===//
+// Backend selection
+//===----------------------------------------------------------------------===//
+
+static const PoolBackend *const Backends[] = {
+  &FL2Backend, &BitMaskBackend, &FreeListBackend, &MallocBackend
+};
+
+const PoolBackend *getPoolBackend(const char *Name) {
+  for (unsigned i = 0; i != sizeof(Backends)/sizeof(Backends[0]); ++i)
+    if (strcmp(Backends[i]->Name, Name) == 0)
+      return Backends[i];
+  return 0;
+}
+
+static pthread_once_t SelectOnce = PTHREAD_ONCE_INIT;
+
+static void SelectBackendOnce() {
+  const PoolBackend *B = &FL2Backend;
+  if (const char *Name = getenv("POOLALLOC_BACKEND")) {
+    if (const PoolBackend *Named = getPoolBackend(Name))
+      B = Named;
+    else
+      fprintf(stderr, "POOLALLOC_BACKEND: unknown backend '%s', using %s\n",
+              Name, B->Name);
+  }
+  if (const char *ReportFile = getenv("POOLALLOC_COUNTERS"))
+    B = getCountingBackend(B, ReportFile);
+  if (const char *TraceFile = getenv("POOLALLOC_TRACE"))
+    B = getTracingBackend(B, TraceFile);
+  Backend = *B;
+}
+
+static void SelectBackend() {
+  pthread_once(&SelectOnce, SelectBackendOnce);
+}
+
+// Select the backend as early as possible so that threads started later do not
+// race through the bootstrap functions.
+static void __attribute__((constructor)) InitPoolDispatch() {
+  SelectBackend();
+}
+
+const char *poolgetbackend() {
+  SelectBackend();
+  return Backend.Name;
+}
+
+//===----------------------------------------------------------------------===//
+// Pool allocator library entry points
+//===----------------------------------------------------------------------===//
+
+extern "C" {
+  void poolinit(void *Pool, unsigned DeclaredSize, unsigned ObjAlignment);
+  void poolmakeunfreeable(void *Pool);
+  void pooldestroy(void *Pool);
+  void *poolalloc(void *Pool, unsigned NumBytes);
+  void *poolcalloc(void *Pool, unsigned NumBytes, unsigned NumElements);
+  void *poolrealloc(void *Pool, void *Node, unsigned NumBytes);
+  void *poolmemalign(void *Pool, unsigned Alignment, unsigned NumBytes);
+  void poolfree(void *Pool, void *Node);
+  unsigned poolobjsize(void *Pool, void *Node);
+}
+
+void poolinit(void *Pool, unsigned DeclaredSize, unsigned ObjAlignment) {
+  Backend.Init(Pool, DeclaredSize, ObjAlignment);
+}
+
+void poolmakeunfreeable(void *Pool) {
+  Backend.MakeUnfreeable(Pool);
+}
+
+void pooldestroy(void *Pool) {
+  Backend.Destroy(Pool);
+}
+
+void *poolalloc(void *Pool, unsigned NumBytes) {
+  return Backend.Alloc(Pool, NumBytes);
+}
+
+void *poolcalloc(void *Pool, unsigned NumBytes, unsigned NumElements) {
+  void *p = Backend.Alloc(Pool, NumBytes * NumElements);
+  if (p)
+    memset(p, 0, NumBytes * NumElements);
+  return p;
+}
+
+void *poolrealloc(void *Pool, void *Node, unsigned NumBytes) {
+  return Backend.Realloc(Pool, Node, NumBytes);
+}
+
+void *poolmemalign(void *Pool, unsigned Alignment, unsigned NumBytes) {
+  // Like the FL2 runtime, over-allocate and round the result up.
+  intptr_t base = (intptr_t)Backend.Alloc(Pool, NumBytes + Alignment - 1);
+  return (void*)((base + (Alignment - 1)) & ~((intptr_t)Alignment - 1));
+}
+
+void poolfree(void *Pool, void *Node) {
+  Backend.Free(Pool, Node);
+}
+
+unsigned poolobjsize(void *Pool, void *Node) {
+  return Backend.ObjSize(Pool, Node);
+}
@@ -0,0 +1,83 @@
+//===- PoolDispatch.h - Selectable pool allocator backends ------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines the backend table used by the dispatching pool allocator
+// runtime.  The dispatching runtime exports the normal poolinit/poolalloc/
+// poolfree entry points and forwards each of them through a table of function
+// pointers which is selected once per process, so that the same pool allocated
+// binary can be run on top of any of the runtime implementations.
+//
+// The backend is chosen with the POOLALLOC_BACKEND environment variable, which
+// may be one of "fl2" (the default), "bitmask", "freelist" or "malloc".
+// If POOLALLOC_TRACE is also set, every call is recorded in the file it names.
+// If POOLALLOC_COUNTERS is set, cache miss, TLB miss and cycle counts for each
+// pool are written to the file it names.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef POOLDISPATCH_H
+#define POOLDISPATCH_H
+
+// POOL_DESCRIPTOR_SIZE - The number of bytes the compiler reserves for each
+// pool descriptor (see PoolAllocate::getPoolType).  Every backend must keep its
+// pool state within this many bytes.
+#define POOL_DESCRIPTOR_SIZE (16*sizeof(void*))
+
+// POOL_DESCRIPTOR_FITS - Fail to compile if the pool descriptor type of a
+// backend does not fit in the space the compiler reserves for it.
+#define POOL_DESCRIPTOR_FITS(Name, Ty) \
+  typedef char Name##PoolDescriptorFits[sizeof(Ty) <= POOL_DESCRIPTOR_SIZE ? 1 : -1]
+
+// PoolBackend - The set of entry points implemented by a runtime backend.  All
+// pool descriptors are passed as untyped pointers to the storage the compiler
+// reserved; a null pool descriptor means the memory comes from the system heap.
+struct PoolBackend {
+  // Name - The name used to select this backend.
+  const char *Name;
+
+  // ThreadSafe - True if one pool may be used from several threads at once.
+  bool ThreadSafe;
+
+  void (*Init)(void *Pool, unsigned DeclaredSize, unsigned ObjAlignment);
+  void (*Destroy)(void *Pool);
+  void (*MakeUnfreeable)(void *Pool);
+  void *(*Alloc)(void *Pool, unsigned NumBytes);
+  void (*Free)(void *Pool, void *Node);
+  void *(*Realloc)(void *Pool, void *Node, unsigned NumBytes);
+  unsigned (*ObjSize)(void *Pool, void *Node);
+};
+
+extern const PoolBackend FL2Backend;
+extern const PoolBackend BitMaskBackend;
+extern const PoolBackend FreeListBackend;
+extern const PoolBackend MallocBackend;
+
+/// getPoolBackend - Return the backend with the specified name, or null if
+/// there is no such backend.
+const PoolBackend *getPoolBackend(const char *Name);
+
+/// getTracingBackend - Return a backend which forwards to B and records every
+/// call in the trace file FileName (see PoolTrace.h).  If the file cannot be
+/// created, B itself is returned.
+const PoolBackend *getTracingBackend(const PoolBackend *B,
+                                     const char *FileName);
+
+/// getCountingBackend - Return a backend which forwards to B and charges the
+/// hardware events counted during each pool's lifetime to that pool, writing a
+/// report to FileName ("-" for stderr) at exit.  If the file cannot be created,
+/// B itself is returned.
+const PoolBackend *getCountingBackend(const PoolBackend *B,
+                                      const char *FileName);
+
+extern "C" {
+  /// poolgetbackend - Return the name of the backend this process is using.
+  const char *poolgetbackend(void);
+}
+
+#endif
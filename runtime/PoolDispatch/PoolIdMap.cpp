@@ -0,0 +1,88 @@
+//===- PoolIdMap.cpp - Map pool and object addresses to numbers -----------===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolIdMap.h"
+#include <stdlib.h>
+
+void PoolIdMap::grow(const char *LivePools) {
+  Entry *OldTable = Table;
+  unsigned OldSize = Size;
+
+  // Count the entries that survive so that a table full of dead objects does
+  // not keep doubling.
+  unsigned Live = 0;
+  for (unsigned i = 0; i != OldSize; ++i)
+    if (OldTable[i].Key && (!LivePools || LivePools[OldTable[i].Pool]))
+      ++Live;
+
+  Size = OldSize ? OldSize : 1024;
+  while (Live*2 >= Size)
+    Size *= 2;
+  Table = (Entry*)calloc(Size, sizeof(Entry));
+  NumEntries = 0;
+
+  for (unsigned i = 0; i != OldSize; ++i) {
+    Entry &E = OldTable[i];
+    if (!E.Key || (LivePools && !LivePools[E.Pool])) continue;
+    unsigned B = getBucket(E.Key);
+    while (Table[B].Key)
+      B = (B+1) & (Size-1);
+    Table[B] = E;
+    ++NumEntries;
+  }
+  free(OldTable);
+}
+
+void PoolIdMap::insert(void *Key, uint32_t Id, uint32_t Pool,
+                   const char *LivePools) {
+  if ((NumEntries+1)*4 > Size*3)
+    grow(LivePools);
+
+  unsigned B = getBucket(Key);
+  while (Table[B].Key && Table[B].Key != Key)
+    B = (B+1) & (Size-1);
+  if (!Table[B].Key)
+    ++NumEntries;
+  Table[B].Key = Key;
+  Table[B].Id = Id;
+  Table[B].Pool = Pool;
+}
+
+uint32_t PoolIdMap::lookup(void *Key) const {
+  if (!Size) return 0;
+  for (unsigned B = getBucket(Key); Table[B].Key; B = (B+1) & (Size-1))
+    if (Table[B].Key == Key)
+      return Table[B].Id;
+  return 0;
+}
+
+uint32_t PoolIdMap::erase(void *Key) {
+  if (!Size) return 0;
+  unsigned B = getBucket(Key);
+  while (Table[B].Key != Key) {
+    if (!Table[B].Key) return 0;
+    B = (B+1) & (Size-1);
+  }
+  uint32_t Id = Table[B].Id;
+
+  // Shift the following entries of the probe sequence back into the hole, so
+  // that lookups never need tombstones.
+  unsigned Hole = B;
+  for (unsigned Next = (B+1) & (Size-1); Table[Next].Key;
+       Next = (Next+1) & (Size-1)) {
+    unsigned Home = getBucket(Table[Next].Key);
+    if (((Next - Home) & (Size-1)) >= ((Next - Hole) & (Size-1))) {
+      Table[Hole] = Table[Next];
+      Hole = Next;
+    }
+  }
+  Table[Hole].Key = 0;
+  --NumEntries;
+  return Id;
+}
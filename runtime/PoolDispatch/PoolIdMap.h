@@ -0,0 +1,57 @@
+//===- PoolIdMap.h - Map pool and object addresses to numbers ---*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines PoolIdMap, the map the tracing and counting backends use to
+// give pool descriptors and objects stable numbers.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef POOLIDMAP_H
+#define POOLIDMAP_H
+
+#include <stdint.h>
+
+// PoolIdMap - A map from pool descriptor or object addresses to numbers.  Each
+// entry also records the number of the pool that owns it, so that the objects
+// of destroyed pools can be dropped when the table is resized.  This uses
+// linear probing and the system heap.
+//
+// There is deliberately no constructor: the maps are only used as statics,
+// which are zero initialized before any static constructor can allocate.
+class PoolIdMap {
+  struct Entry {
+    void *Key;
+    uint32_t Id;
+    uint32_t Pool;
+  };
+
+  Entry *Table;
+  unsigned Size;        // Always zero or a power of two.
+  unsigned NumEntries;
+
+  unsigned getBucket(void *Key) const {
+    uintptr_t Bits = (uintptr_t)Key;
+    return (unsigned)((Bits >> 4) ^ (Bits >> 13)) * 2654435761U & (Size-1);
+  }
+
+  void grow(const char *LivePools);
+
+public:
+  // insert - Map Key to Id, replacing any previous entry for Key.
+  // LivePools, if not null, tells which pools are still alive.
+  void insert(void *Key, uint32_t Id, uint32_t Pool, const char *LivePools);
+
+  // lookup - Return the number of Key, or zero if it has none.
+  uint32_t lookup(void *Key) const;
+
+  // erase - Remove Key from the map, returning its number or zero.
+  uint32_t erase(void *Key);
+};
+
+#endif
@@ -0,0 +1,165 @@
+//===- PoolTrace.cpp - Record pool allocation traces ----------------------===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file implements a backend which forwards every call to another backend
+// and records it in a binary trace file (see PoolTrace.h).  It is installed in
+// place of the selected backend when POOLALLOC_TRACE is set, so a program which
+// is not being traced pays nothing for it.
+//
+// All calls are serialized with one lock so that the order of the events in
+// the trace is an order in which they could have happened.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PoolDispatch.h"
+#include "PoolIdMap.h"
+#include "PoolTrace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static pthread_mutex_t TraceLock = PTHREAD_MUTEX_INITIALIZER;
+static PoolBackend Real;
+static FILE *TraceFile;
+static PoolIdMap PoolIds, ObjectIds;
+static uint32_t NextPool = 1, NextObject = 1;
+
+// LivePools - One byte per pool number, set while the pool exists.
+static char *LivePools;
+static uint32_t LivePoolsSize;
+
+static void emit(PoolTraceEventKind Kind, uint32_t Pool, uint32_t Object,
+                 uint32_t Size) {
+  if (!TraceFile) return;
+  PoolTraceEvent E;
+  E.Kind = Kind;
+  E.Pool = Pool;
+  E.Object = Object;
+  E.Size = Size;
+  fwrite(&E, sizeof(E), 1, TraceFile);
+}
+
+static uint32_t getPoolId(void *Pool) {
+  return Pool ? PoolIds.lookup(Pool) : 0;
+}
+
+static void TraceInit(void *Pool, unsigned DeclaredSize,
+                      unsigned ObjAlignment) {
+  pthread_mutex_lock(&TraceLock);
+  Real.Init(Pool, DeclaredSize, ObjAlignment);
+  uint32_t Id = NextPool++;
+  if (Id >= LivePoolsSize) {
+    uint32_t NewSize = LivePoolsSize ? LivePoolsSize*2 : 1024;
+    LivePools = (char*)realloc(LivePools, NewSize);
+    memset(LivePools+LivePoolsSize, 0, NewSize-LivePoolsSize);
+    LivePoolsSize = NewSize;
+  }
+  LivePools[Id] = 1;
+  PoolIds.insert(Pool, Id, 0, 0);
+  emit(PTE_Init, Id, ObjAlignment, DeclaredSize);
+  pthread_mutex_unlock(&TraceLock);
+}
+
+static void TraceDestroy(void *Pool) {
+  pthread_mutex_lock(&TraceLock);
+  Real.Destroy(Pool);
+  uint32_t Id = PoolIds.erase(Pool);
+  if (Id) LivePools[Id] = 0;
+  emit(PTE_Destroy, Id, 0, 0);
+  pthread_mutex_unlock(&TraceLock);
+}
+
+static void TraceMakeUnfreeable(void *Pool) {
+  pthread_mutex_lock(&TraceLock);
+  Real.MakeUnfreeable(Pool);
+  emit(PTE_MakeUnfreeable, getPoolId(Pool), 0, 0);
+  pthread_mutex_unlock(&TraceLock);
+}
+
+static void *TraceAlloc(void *Pool, unsigned NumBytes) {
+  pthread_mutex_lock(&TraceLock);
+  void *Node = Real.Alloc(Pool, NumBytes);
+  uint32_t PoolId = getPoolId(Pool);
+  uint32_t Id = NextObject++;
+  ObjectIds.insert(Node, Id, PoolId, LivePools);
+  emit(PTE_Alloc, PoolId, Id, NumBytes);
+  pthread_mutex_unlock(&TraceLock);
+  return Node;
+}
+
+static void TraceFree(void *Pool, void *Node) {
+  pthread_mutex_lock(&TraceLock);
+  Real.Free(Pool, Node);
+  uint32_t Id = Node ? ObjectIds.erase(Node) : 0;
+  emit(PTE_Free, getPoolId(Pool), Id, 0);
+  pthread_mutex_unlock(&TraceLock);
+}
+
+static void *TraceRealloc(void *Pool, void *Node, unsigned NumBytes) {
+  if (Node == 0)
+    return TraceAlloc(Pool, NumBytes);
+
+  pthread_mutex_lock(&TraceLock);
+  void *New = Real.Realloc(Pool, Node, NumBytes);
+  uint32_t PoolId = getPoolId(Pool);
+  uint32_t Id = ObjectIds.erase(Node);
+  if (New)
+    ObjectIds.insert(New, Id, PoolId, LivePools);
+  emit(PTE_Realloc, PoolId, Id, NumBytes);
+  pthread_mutex_unlock(&TraceLock);
+  return New;
+}
+
+static unsigned TraceObjSize(void *Pool, void *Node) {
+  return Real.ObjSize(Pool, Node);
+}
+
+static void CloseTrace() {
+  pthread_mutex_lock(&TraceLock);
+  if (TraceFile)
+    fclose(TraceFile);
+  TraceFile = 0;
+  pthread_mutex_unlock(&TraceLock);
+}
+
+static PoolBackend TraceBackend = {
+  0, false,
+  TraceInit, TraceDestroy, TraceMakeUnfreeable, TraceAlloc, TraceFree,
+  TraceRealloc, TraceObjSize
+};
+
+const PoolBackend *getTracingBackend(const PoolBackend *B,
+                                     const char *FileName) {
+  TraceFile = fopen(FileName, "wb");
+  if (!TraceFile) {
+    fprintf(stderr, "POOLALLOC_TRACE: cannot create '%s', not tracing\n",
+            FileName);
+    return B;
+  }
+  setvbuf(TraceFile, 0, _IOFBF, 1 << 16);
+
+  PoolTraceHeader H;
+  memset(&H, 0, sizeof(H));
+  strcpy(H.Magic, POOL_TRACE_MAGIC);
+  H.Version = POOL_TRACE_VERSION;
+  H.EventSize = sizeof(PoolTraceEvent);
+  fwrite(&H, sizeof(H), 1, TraceFile);
+  atexit(CloseTrace);
+
+  // Pool number zero, the system heap, is always alive.
+  LivePoolsSize = 1024;
+  LivePools = (char*)calloc(LivePoolsSize, 1);
+  LivePools[0] = 1;
+
+  Real = *B;
+  TraceBackend.Name = B->Name;
+  TraceBackend.ThreadSafe = B->ThreadSafe;
+  return &TraceBackend;
+}
@@ -0,0 +1,53 @@
+//===- PoolTrace.h - Binary pool allocation trace format --------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This file defines the format of the allocation traces written by the
+// dispatching runtime when POOLALLOC_TRACE names an output file, and read back
+// by the pa-replay tool.
+//
+// A trace is a PoolTraceHeader followed by a sequence of fixed size
+// PoolTraceEvent records in the byte order of the machine that wrote it.  Pools
+// and objects are identified by small integers assigned in the order they were
+// created, so that a trace can be replayed without knowing the addresses the
+// original program saw.  Pool number zero is the system heap (a null pool
+// descriptor); object number zero is the null pointer.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef POOLTRACE_H
+#define POOLTRACE_H
+
+#include <stdint.h>
+
+#define POOL_TRACE_MAGIC   "PATRACE"
+#define POOL_TRACE_VERSION 1
+
+struct PoolTraceHeader {
+  char Magic[8];        // POOL_TRACE_MAGIC, null terminated.
+  uint32_t Version;     // POOL_TRACE_VERSION.
+  uint32_t EventSize;   // sizeof(PoolTraceEvent).
+};
+
+enum PoolTraceEventKind {
+  PTE_Init,             // Pool created: Size = declared size, Object = align.
+  PTE_Destroy,          // Pool destroyed.
+  PTE_MakeUnfreeable,   // Pool marked unfreeable.
+  PTE_Alloc,            // Object allocated with Size bytes.
+  PTE_Free,             // Object freed.
+  PTE_Realloc           // Object resized to Size bytes, keeping its number.
+};
+
+struct PoolTraceEvent {
+  uint32_t Kind;        // A PoolTraceEventKind.
+  uint32_t Pool;        // The pool number.
+  uint32_t Object;      // The object number, or the alignment for PTE_Init.
+  uint32_t Size;        // The size in bytes, if any.
+};
+
+#endif
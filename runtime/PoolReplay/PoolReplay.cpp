@@ -0,0 +1,260 @@
+//===- PoolReplay.cpp - Replay pool allocation traces ---------------------===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This program replays an allocation trace recorded with POOLALLOC_TRACE (see
+// runtime/PoolDispatch/PoolTrace.h) against the backends of the dispatching
+// runtime, and reports for each one the time taken, the peak resident set size
+// and the fragmentation: the fraction of that memory which was not holding live
+// objects at the peak.
+//
+// Each backend is replayed in its own process so that peak RSS is measured
+// independently.
+//
+// Usage: pa-replay [-b backend] trace
+//
+//===----------------------------------------------------------------------===//
+
+#include "../PoolDispatch/PoolDispatch.h"
+#include "../PoolDispatch/PoolTrace.h"
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+// PoolDesc - Storage for one pool descriptor, as the compiler would reserve it.
+union PoolDesc {
+  void *Words[POOL_DESCRIPTOR_SIZE/sizeof(void*)];
+  long double Align;
+};
+
+struct Trace {
+  std::vector<PoolTraceEvent> Events;
+  uint32_t NumPools;          // One more than the largest pool number.
+  uint32_t NumObjects;        // One more than the largest object number.
+  unsigned long PeakLive;     // The most bytes the program had live at once.
+};
+
+static double now() {
+  struct timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  return TS.tv_sec + TS.tv_nsec * 1e-9;
+}
+
+// getPeakRSS - Return the peak resident set size of this process in kilobytes.
+static unsigned long getPeakRSS() {
+  struct rusage RU;
+  getrusage(RUSAGE_SELF, &RU);
+#if defined(__APPLE__)
+  return RU.ru_maxrss / 1024;
+#else
+  return RU.ru_maxrss;
+#endif
+}
+
+// resetPeakRSS - Lower the peak resident set size to the current one, so that
+// memory which was used to read the trace and since released is not counted.
+// This is only possible on Linux; elsewhere the peak includes it.
+static void resetPeakRSS() {
+#if defined(__linux__)
+  if (FILE *F = fopen("/proc/self/clear_refs", "w")) {
+    fputs("5", F);
+    fclose(F);
+  }
+#endif
+}
+
+// readTrace - Read the trace in FileName into T, returning false and printing
+// an error if it is not a valid trace.
+static bool readTrace(const char *FileName, Trace &T) {
+  FILE *F = fopen(FileName, "rb");
+  if (!F) {
+    perror(FileName);
+    return false;
+  }
+
+  PoolTraceHeader H;
+  if (fread(&H, sizeof(H), 1, F) != 1 ||
+      strncmp(H.Magic, POOL_TRACE_MAGIC, sizeof(H.Magic)) ||
+      H.Version != POOL_TRACE_VERSION ||
+      H.EventSize != sizeof(PoolTraceEvent)) {
+    fprintf(stderr, "%s: not a pool allocation trace\n", FileName);
+    fclose(F);
+    return false;
+  }
+
+  PoolTraceEvent Buffer[4096];
+  size_t N;
+  while ((N = fread(Buffer, sizeof(PoolTraceEvent), 4096, F)) != 0)
+    T.Events.insert(T.Events.end(), Buffer, Buffer+N);
+  fclose(F);
+
+  // Find the table sizes and the live byte high water mark, which depend only
+  // on the trace and not on the backend.
+  T.NumPools = T.NumObjects = 1;
+  std::vector<uint32_t> ObjectSize, ObjectPool;
+  std::vector<long> PoolLive;
+  long Live = 0;
+  T.PeakLive = 0;
+  for (size_t i = 0, e = T.Events.size(); i != e; ++i) {
+    const PoolTraceEvent &E = T.Events[i];
+    if (E.Pool >= T.NumPools) T.NumPools = E.Pool+1;
+    if (E.Pool >= PoolLive.size()) PoolLive.resize(E.Pool+1);
+    if (E.Kind != PTE_Init && E.Object >= T.NumObjects)
+      T.NumObjects = E.Object+1;
+    if (E.Object >= ObjectSize.size() && E.Kind != PTE_Init) {
+      ObjectSize.resize(E.Object+1);
+      ObjectPool.resize(E.Object+1);
+    }
+
+    switch (E.Kind) {
+    case PTE_Alloc:
+      ObjectSize[E.Object] = E.Size;
+      ObjectPool[E.Object] = E.Pool;
+      Live += E.Size;
+      PoolLive[E.Pool] += E.Size;
+      break;
+    case PTE_Realloc:
+    case PTE_Free: {
+      uint32_t NewSize = E.Kind == PTE_Realloc ? E.Size : 0;
+      uint32_t OldSize = ObjectSize[E.Object];
+      Live += (long)NewSize - (long)OldSize;
+      PoolLive[ObjectPool[E.Object]] += (long)NewSize - (long)OldSize;
+      ObjectSize[E.Object] = NewSize;
+      break;
+    }
+    case PTE_Destroy:
+      // Objects still in the pool die with it.
+      if (!E.Pool) break;
+      Live -= PoolLive[E.Pool];
+      PoolLive[E.Pool] = 0;
+      break;
+    }
+    if (Live > (long)T.PeakLive) T.PeakLive = Live;
+  }
+  return true;
+}
+
+// Touch - Write to every page of an object, as the program would have, so that
+// the resident set reflects the memory handed out.
+static inline void Touch(void *Ptr, uint32_t Size) {
+  if (!Ptr) return;
+  for (uint32_t i = 0; i < Size; i += 4096)
+    ((volatile char*)Ptr)[i] = 0;
+}
+
+// replay - Replay the trace against backend B and print the results.
+static void replay(const Trace &T, const PoolBackend *B) {
+  std::vector<PoolDesc> Pools(T.NumPools);
+  std::vector<void*> Objects(T.NumObjects);
+  resetPeakRSS();
+  unsigned long BaseRSS = getPeakRSS();
+
+  double Start = now();
+  for (size_t i = 0, e = T.Events.size(); i != e; ++i) {
+    const PoolTraceEvent &E = T.Events[i];
+    void *Pool = E.Pool ? &Pools[E.Pool] : 0;
+    switch (E.Kind) {
+    case PTE_Init:
+      B->Init(Pool, E.Size, E.Object);
+      break;
+    case PTE_Destroy:
+      if (Pool) B->Destroy(Pool);
+      break;
+    case PTE_MakeUnfreeable:
+      if (Pool) B->MakeUnfreeable(Pool);
+      break;
+    case PTE_Alloc:
+      Objects[E.Object] = B->Alloc(Pool, E.Size);
+      Touch(Objects[E.Object], E.Size);
+      break;
+    case PTE_Free:
+      if (E.Object) B->Free(Pool, Objects[E.Object]);
+      Objects[E.Object] = 0;
+      break;
+    case PTE_Realloc:
+      Objects[E.Object] = B->Realloc(Pool, Objects[E.Object], E.Size);
+      Touch(Objects[E.Object], E.Size);
+      break;
+    }
+  }
+  double Seconds = now() - Start;
+
+  unsigned long RSS = getPeakRSS() - BaseRSS;
+  unsigned long LiveKB = (T.PeakLive + 1023) / 1024;
+  double Fragmentation = RSS > LiveKB ? 1.0 - (double)LiveKB / RSS : 0.0;
+  printf("%s,%lu,%.6f,%.2f,%lu,%lu,%.3f\n", B->Name,
+         (unsigned long)T.Events.size(), Seconds,
+         T.Events.empty() ? 0.0 : Seconds * 1e9 / T.Events.size(),
+         RSS, LiveKB, Fragmentation);
+  fflush(stdout);
+}
+
+static const char *const BackendNames[] = {
+  "fl2", "bitmask", "freelist", "malloc"
+};
+
+int main(int argc, char **argv) {
+  const char *OnlyBackend = 0;
+  int Opt;
+  while ((Opt = getopt(argc, argv, "b:")) != -1) {
+    switch (Opt) {
+    case 'b': OnlyBackend = optarg; break;
+    default:
+      fprintf(stderr, "Usage: %s [-b backend] trace\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind + 1 != argc) {
+    fprintf(stderr, "Usage: %s [-b backend] trace\n", argv[0]);
+    return 1;
+  }
+  const char *FileName = argv[optind];
+  if (OnlyBackend && !getPoolBackend(OnlyBackend)) {
+    fprintf(stderr, "%s: unknown backend '%s'\n", argv[0], OnlyBackend);
+    return 1;
+  }
+
+  printf("backend,events,seconds,ns_per_event,peak_rss_kb,peak_live_kb,"
+         "fragmentation\n");
+  fflush(stdout);
+
+  int Result = 0;
+  for (unsigned b = 0; b != sizeof(BackendNames)/sizeof(BackendNames[0]); ++b){
+    if (OnlyBackend && strcmp(OnlyBackend, BackendNames[b])) continue;
+
+    // Read the trace in the child, so that the parent's memory use does not
+    // count against any backend.
+    pid_t Child = fork();
+    if (Child == 0) {
+      Trace T;
+      if (!readTrace(FileName, T))
+        _exit(1);
+      replay(T, getPoolBackend(BackendNames[b]));
+      _exit(0);
+    }
+
+    int Status;
+    if (Child < 0 || waitpid(Child, &Status, 0) < 0) {
+      perror("pa-replay");
+      return 1;
+    }
+    if (WIFSIGNALED(Status)) {
+      fprintf(stderr, "%s: replay failed with signal %d\n", BackendNames[b],
+              WTERMSIG(Status));
+      Result = 1;
+    } else if (WEXITSTATUS(Status) != 0) {
+      return WEXITSTATUS(Status);
+    }
+  }
+  return Result;
+}
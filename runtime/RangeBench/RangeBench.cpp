@@ -0,0 +1,211 @@
+//===- RangeBench.cpp - Compare the object range indexes ------------------===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This program measures the two indexes MallocSlabManager can use to map
+// addresses to the objects containing them, RangeSplaySet and RangePageMap,
+// on the operations a bounds checking runtime performs: registering objects,
+// looking up interior pointers, and removing objects.  Lookups are also run
+// from several threads; the splay tree has to be locked for that, because
+// every lookup restructures it.
+//
+// It prints one CSV record per index, operation and thread count.
+//
+// Usage: rangebench [-n objects] [-l lookups] [-t threads] [-o file]
+//
+//===----------------------------------------------------------------------===//
+
+#include "poolalloc_runtime/Support/RangePageMap.h"
+#include "poolalloc_runtime/Support/SplayTree.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned NumObjects = 100000;
+static unsigned NumLookups = 4000000;
+static unsigned NumThreads = 4;
+
+static double now() {
+  struct timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  return TS.tv_sec + TS.tv_nsec * 1e-9;
+}
+
+// Random - A small deterministic generator so that both indexes see exactly
+// the same sequence of requests.
+struct Random {
+  unsigned long State;
+  explicit Random(unsigned long Seed) : State(Seed * 2654435761UL + 1) {}
+  unsigned next() {
+    State ^= State << 13;
+    State ^= State >> 7;
+    State ^= State << 17;
+    return (unsigned)State;
+  }
+};
+
+// Object - One registered object and its size.
+struct Object {
+  char *Start;
+  unsigned Size;
+};
+
+// makeObjects - Allocate the objects to register.  Most are small; one in 64
+// spans several pages and one in 1024 is large enough to land in the array of
+// large ranges of RangePageMap.
+static Object *makeObjects() {
+  Object *Objs = (Object*)malloc(NumObjects * sizeof(Object));
+  Random R(1);
+  for (unsigned i = 0; i != NumObjects; ++i) {
+    unsigned Bits = R.next();
+    unsigned Size;
+    if ((Bits & 1023) == 0)
+      Size = 256*1024;
+    else if ((Bits & 63) == 0)
+      Size = 4096 + (Bits >> 10) % 16384;
+    else
+      Size = 8 + (Bits >> 10) % 248;
+    Objs[i].Start = (char*)malloc(Size);
+    Objs[i].Size = Size;
+  }
+  return Objs;
+}
+
+// LookupArgs - The state of one lookup thread.
+template<class Index>
+struct LookupArgs {
+  Index *Idx;
+  const Object *Objs;
+  pthread_mutex_t *Lock;      // Serializes indexes which lookups modify.
+  unsigned Lookups;
+  unsigned long Seed;
+  unsigned Misses;
+};
+
+template<class Index>
+static void *lookupThread(void *Arg) {
+  LookupArgs<Index> *A = (LookupArgs<Index>*)Arg;
+  Random R(A->Seed);
+  for (unsigned i = 0; i != A->Lookups; ++i) {
+    const Object &O = A->Objs[R.next() % NumObjects];
+    void *Key = O.Start + R.next() % O.Size, *Start, *End;
+    if (A->Lock) pthread_mutex_lock(A->Lock);
+    bool Found = A->Idx->find(Key, Start, End);
+    if (A->Lock) pthread_mutex_unlock(A->Lock);
+    if (!Found || Start != O.Start) ++A->Misses;
+  }
+  return 0;
+}
+
+static void report(FILE *Out, const char *Index, const char *Op,
+                   unsigned Threads, unsigned long Ops, double Seconds) {
+  fprintf(Out, "%s,%s,%u,%lu,%.6f,%.2f\n", Index, Op, Threads, Ops, Seconds,
+          Ops ? Seconds * 1e9 / Ops : 0.0);
+  fflush(Out);
+}
+
+// lookups - Time NumLookups lookups spread over Threads threads.
+template<class Index>
+static double lookups(Index &Idx, const Object *Objs, unsigned Threads,
+                      bool NeedsLock) {
+  pthread_mutex_t Lock;
+  pthread_mutex_init(&Lock, 0);
+  LookupArgs<Index> *Args = new LookupArgs<Index>[Threads];
+  pthread_t *Tids = new pthread_t[Threads];
+  for (unsigned i = 0; i != Threads; ++i) {
+    Args[i].Idx = &Idx;
+    Args[i].Objs = Objs;
+    Args[i].Lock = NeedsLock ? &Lock : 0;
+    Args[i].Lookups = NumLookups / Threads;
+    Args[i].Seed = 7 + i;
+    Args[i].Misses = 0;
+  }
+
+  double Start = now();
+  for (unsigned i = 0; i != Threads; ++i)
+    pthread_create(&Tids[i], 0, lookupThread<Index>, &Args[i]);
+  for (unsigned i = 0; i != Threads; ++i)
+    pthread_join(Tids[i], 0);
+  double Seconds = now() - Start;
+
+  for (unsigned i = 0; i != Threads; ++i)
+    if (Args[i].Misses) {
+      fprintf(stderr, "rangebench: %u lookups failed\n", Args[i].Misses);
+      exit(1);
+    }
+  pthread_mutex_destroy(&Lock);
+  delete [] Args;
+  delete [] Tids;
+  return Seconds;
+}
+
+// run - Measure one index.
+template<class Index>
+static void run(FILE *Out, const char *Name, const Object *Objs,
+                bool NeedsLock) {
+  Index Idx;
+
+  double Start = now();
+  for (unsigned i = 0; i != NumObjects; ++i)
+    Idx.insert(Objs[i].Start, Objs[i].Start + Objs[i].Size - 1);
+  report(Out, Name, "insert", 1, NumObjects, now() - Start);
+
+  report(Out, Name, "lookup", 1, NumLookups, lookups(Idx, Objs, 1, NeedsLock));
+  if (NumThreads > 1)
+    report(Out, Name, "lookup", NumThreads, NumLookups / NumThreads * NumThreads,
+           lookups(Idx, Objs, NumThreads, NeedsLock));
+
+  Start = now();
+  for (unsigned i = 0; i != NumObjects; ++i)
+    Idx.remove(Objs[i].Start);
+  report(Out, Name, "remove", 1, NumObjects, now() - Start);
+}
+
+static void usage(const char *Argv0) {
+  fprintf(stderr, "Usage: %s [-n objects] [-l lookups] [-t threads] [-o file]\n",
+          Argv0);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *OutputFile = 0;
+  int Opt;
+  while ((Opt = getopt(argc, argv, "n:l:t:o:")) != -1) {
+    switch (Opt) {
+    case 'n': NumObjects = strtoul(optarg, 0, 0); break;
+    case 'l': NumLookups = strtoul(optarg, 0, 0); break;
+    case 't': NumThreads = strtoul(optarg, 0, 0); break;
+    case 'o': OutputFile = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (NumObjects == 0 || NumThreads == 0)
+    usage(argv[0]);
+
+  FILE *Out = stdout;
+  if (OutputFile && !(Out = fopen(OutputFile, "w"))) {
+    perror(OutputFile);
+    return 1;
+  }
+
+  Object *Objs = makeObjects();
+  fprintf(Out, "index,operation,threads,operations,seconds,ns_per_op\n");
+  run<RangeSplaySet<> >(Out, "splay", Objs, true);
+  // RangePageMap lookups only read the map, small and large ranges alike, so
+  // they run without the lock.
+  run<RangePageMap<> >(Out, "pagemap", Objs, false);
+
+  for (unsigned i = 0; i != NumObjects; ++i)
+    free(Objs[i].Start);
+  free(Objs);
+  if (Out != stdout)
+    fclose(Out);
+  return 0;
+}
@@ -0,0 +1,186 @@
+//===- VABench.cpp - Measure the va_list checks of the type-check runtime -===//
+//
+//                       The LLVM Compiler Infrastructure
+//
+// This file was developed by the LLVM research group and is distributed under
+// the University of Illinois Open Source License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// This program measures what type checking costs a printf-like function: the
+// calls the TypeChecks pass inserts around va_start, va_copy and va_arg.  Each
+// call of the variadic function registers its va_list with setVAInfo, forwards
+// a copy of it every few calls the way vprintf wrappers do, and checks every
+// argument it reads with checkVAArgType.  Calls are nested to a few levels so
+// that several va_lists are live at once.
+//
+// The runtime's per-thread table is compared with the std::map it replaced,
+// guarded by a lock as a multi-threaded program would need it.  One CSV record
+// is printed per table and thread count.
+//
+// Usage: vabench [-c calls] [-a args] [-t threads] [-o file]
+//
+//===----------------------------------------------------------------------===//
+
+#include "../DynamicTypeChecks/TypeRuntime.cpp"
+#include <map>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+// The instrumented program normally provides the type names.
+char *typeNames[] = { (char *)"int", (char *)"double", (char *)"pointer" };
+
+static unsigned NumCalls = 2000000;
+static unsigned NumArgs = 6;
+static unsigned NumThreads = 4;
+
+static double now() {
+  struct timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  return TS.tv_sec + TS.tv_nsec * 1e-9;
+}
+
+// MapTable - The old scheme: one std::map shared by all threads.
+struct MapTable {
+  static std::map<void *, va_info> Map;
+  static pthread_mutex_t Lock;
+
+  static void set(void *VA, uint64_t Count, TypeTagTy *MD) {
+    va_info V = {Count, 0, MD};
+    pthread_mutex_lock(&Lock);
+    Map[VA] = V;
+    pthread_mutex_unlock(&Lock);
+  }
+  static void copy(void *Dst, void *Src) {
+    pthread_mutex_lock(&Lock);
+    Map[Dst] = Map[Src];
+    pthread_mutex_unlock(&Lock);
+  }
+  static void check(void *VA, TypeTagTy Type) {
+    pthread_mutex_lock(&Lock);
+    va_info V = Map[VA];
+    compareNumber(V.numElements, V.counter, 0);
+    compareTypes(Type, V.metadata[V.counter], 0);
+    V.counter++;
+    Map[VA] = V;
+    pthread_mutex_unlock(&Lock);
+  }
+};
+std::map<void *, va_info> MapTable::Map;
+pthread_mutex_t MapTable::Lock = PTHREAD_MUTEX_INITIALIZER;
+
+// RuntimeTable - The calls the runtime provides.
+struct RuntimeTable {
+  static void set(void *VA, uint64_t Count, TypeTagTy *MD) {
+    setVAInfo(VA, Count, MD, 0);
+  }
+  static void copy(void *Dst, void *Src) { copyVAInfo(Dst, Src, 0); }
+  static void check(void *VA, TypeTagTy Type) { checkVAArgType(VA, Type, 0); }
+};
+
+// The argument types of every call: all ints, matching what is read.
+static TypeTagTy ArgTypes[64];
+
+// format - A printf-like function reading Count ints.  When Copy is set it
+// reads them from a copy of its va_list, as a printf which hands its arguments
+// to vprintf would.  Depth nested calls are made afterwards, so that their
+// va_lists live at different addresses.
+template<class Table>
+static long format(unsigned Depth, unsigned Copy, unsigned Count, ...) {
+  va_list AP, AQ;
+  va_start(AP, Count);
+  Table::set(&AP, Count, ArgTypes);
+
+  va_list *Args = &AP;
+  if (Copy) {
+    va_copy(AQ, AP);
+    Table::copy(&AQ, &AP);
+    Args = &AQ;
+  }
+
+  long Sum = 0;
+  for (unsigned i = 0; i != Count; ++i) {
+    Table::check(Args, 0);
+    Sum += va_arg(*Args, int);
+  }
+
+  if (Copy)
+    va_end(AQ);
+  va_end(AP);
+
+  if (Depth)
+    Sum += format<Table>(Depth - 1, Copy, Count, 1, 2, 3, 4, 5, 6, 7, 8);
+  return Sum;
+}
+
+template<class Table>
+static void *callThread(void *Arg) {
+  unsigned Calls = *(unsigned *)Arg;
+  long Sum = 0;
+  // Each call of format makes four nested calls in all.
+  for (unsigned i = 0; i < Calls; i += 4)
+    Sum += format<Table>(3, (i & 12) == 0, NumArgs, 1, 2, 3, 4, 5, 6, 7, 8);
+  return (void *)Sum;
+}
+
+template<class Table>
+static void run(FILE *Out, const char *Name, unsigned Threads) {
+  pthread_t *Tids = new pthread_t[Threads];
+  unsigned Calls = NumCalls / Threads;
+
+  double Start = now();
+  for (unsigned i = 0; i != Threads; ++i)
+    pthread_create(&Tids[i], 0, callThread<Table>, &Calls);
+  for (unsigned i = 0; i != Threads; ++i)
+    pthread_join(Tids[i], 0);
+  double Seconds = now() - Start;
+
+  unsigned long Total = (unsigned long)Calls / 4 * 4 * Threads;
+  fprintf(Out, "%s,%u,%u,%lu,%.6f,%.2f\n", Name, NumArgs, Threads, Total,
+          Seconds, Total ? Seconds * 1e9 / Total : 0.0);
+  fflush(Out);
+  delete [] Tids;
+}
+
+static void usage(const char *Argv0) {
+  fprintf(stderr, "Usage: %s [-c calls] [-a args] [-t threads] [-o file]\n",
+          Argv0);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  const char *OutputFile = 0;
+  int Opt;
+  while ((Opt = getopt(argc, argv, "c:a:t:o:")) != -1) {
+    switch (Opt) {
+    case 'c': NumCalls = strtoul(optarg, 0, 0); break;
+    case 'a': NumArgs = strtoul(optarg, 0, 0); break;
+    case 't': NumThreads = strtoul(optarg, 0, 0); break;
+    case 'o': OutputFile = optarg; break;
+    default: usage(argv[0]);
+    }
+  }
+  // format passes eight arguments.
+  if (NumThreads == 0 || NumArgs > 8)
+    usage(argv[0]);
+
+  FILE *Out = stdout;
+  if (OutputFile && !(Out = fopen(OutputFile, "w"))) {
+    perror(OutputFile);
+    return 1;
+  }
+
+  shadowInit();
+  fprintf(Out, "table,args,threads,calls,seconds,ns_per_call\n");
+  run<MapTable>(Out, "map", 1);
+  run<RuntimeTable>(Out, "runtime", 1);
+  if (NumThreads > 1) {
+    run<MapTable>(Out, "map", NumThreads);
+    run<RuntimeTable>(Out, "runtime", NumThreads);
+  }
+
+  if (Out != stdout)
+    fclose(Out);
+  return 0;
+}
@@ -0,0 +1,49 @@
+; The second run with an unchanged module must read every graph from the
+; cache.  Once @set changes, the bottom-up graph saved for @main, which @set
+; was inlined into, must be rejected.
+; REQUIRES: asserts
+
+;RUN: rm -rf %t.cache
+;RUN: dsaopt %s -dsa-bu -analyze -dsa-cache-dir=%t.cache -check-callees=main,set -stats -info-output-file=%t.first
+;RUN: FileCheck %s -check-prefix=FIRST < %t.first
+;RUN: dsaopt %s -dsa-bu -analyze -dsa-cache-dir=%t.cache -check-callees=main,set -stats -info-output-file=%t.second
+;RUN: FileCheck %s -check-prefix=HIT < %t.second
+;RUN: FileCheck %s -check-prefix=NOMISS < %t.second
+
+; Drop the store of %p into its own next field from @set.
+;RUN: sed -e '/pair\*\* %n$/d' %s > %t.changed.ll
+;RUN: dsaopt %t.changed.ll -dsa-bu -analyze -dsa-cache-dir=%t.cache -check-callees=main,set -stats -info-output-file=%t.changed
+;RUN: FileCheck %s -check-prefix=STALE < %t.changed
+
+;FIRST-NOT: Number of graphs read from the cache
+;HIT: {{^ *[1-9][0-9]*}} dsa-cache{{ +}}- Number of graphs read from the cache
+;NOMISS-NOT: Number of cache lookups which found no graph
+;STALE: {{^ *}}1 dsa-cache{{ +}}- Number of saved graphs whose callees changed
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.pair = type { i32*, %struct.pair* }
+
+@setter = internal constant void (%struct.pair*, i32*)* @set
+
+define internal void @set(%struct.pair* %p, i32* %v) nounwind {
+entry:
+  %f = getelementptr inbounds %struct.pair, %struct.pair* %p, i64 0, i32 0
+  store i32* %v, i32** %f
+  %n = getelementptr inbounds %struct.pair, %struct.pair* %p, i64 0, i32 1
+  store %struct.pair* %p, %struct.pair** %n
+  ret void
+}
+
+define i32 @main() nounwind {
+entry:
+  %s = alloca %struct.pair
+  %x = alloca i32
+  %fp = load void (%struct.pair*, i32*)*, void (%struct.pair*, i32*)** @setter
+  call void %fp(%struct.pair* %s, i32* %x) nounwind
+  %f = getelementptr inbounds %struct.pair, %struct.pair* %s, i64 0, i32 0
+  %y = load i32*, i32** %f
+  %r = load i32, i32* %y
+  ret i32 %r
+}
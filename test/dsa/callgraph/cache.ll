@@ -0,0 +1,48 @@
+; Graphs read from the cache must match those calculated.  The first run of
+; each pass fills the cache directory and the second reads its graphs back.
+; @main calls @set through a function pointer stored in a constant global, so
+; its callee is only known once the global's initializer is merged in.
+
+;RUN: rm -rf %t.cache
+;RUN: dsaopt %s -dsa-local -analyze -dsa-cache-dir=%t.cache -check-type=set:p,0:i32*::8:%\struct.pair*
+;RUN: dsaopt %s -dsa-local -analyze -dsa-cache-dir=%t.cache -check-type=set:p,0:i32*::8:%\struct.pair*
+;RUN: dsaopt %s -dsa-bu -analyze -dsa-cache-dir=%t.cache -check-same-node=main:x,main:y
+;RUN: dsaopt %s -dsa-bu -analyze -dsa-cache-dir=%t.cache -check-same-node=main:x,main:y
+;RUN: dsaopt %s -dsa-bu -analyze -dsa-cache-dir=%t.cache -check-callees=main,set
+
+; The graphs -analyze writes when the cache is filled and when it is read
+; must be the same, apart from the node addresses.
+;RUN: rm -rf %t.cache %t.first %t.second && mkdir %t.first %t.second
+;RUN: cd %t.first && dsaopt %s -dsa-bu -analyze -dsa-cache-dir=%t.cache > analyze.out
+;RUN: cd %t.second && dsaopt %s -dsa-bu -analyze -dsa-cache-dir=%t.cache > analyze.out
+;RUN: cat %t.first/* | sed -e 's/0x[0-9a-fA-F]*//g' > %t.first.out
+;RUN: cat %t.second/* | sed -e 's/0x[0-9a-fA-F]*//g' > %t.second.out
+;RUN: diff %t.first.out %t.second.out
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.pair = type { i32*, %struct.pair* }
+
+@setter = internal constant void (%struct.pair*, i32*)* @set
+
+define internal void @set(%struct.pair* %p, i32* %v) nounwind {
+entry:
+  %f = getelementptr inbounds %struct.pair, %struct.pair* %p, i64 0, i32 0
+  store i32* %v, i32** %f
+  %n = getelementptr inbounds %struct.pair, %struct.pair* %p, i64 0, i32 1
+  store %struct.pair* %p, %struct.pair** %n
+  ret void
+}
+
+define i32 @main() nounwind {
+entry:
+  %s = alloca %struct.pair
+  %x = alloca i32
+  %fp = load void (%struct.pair*, i32*)*, void (%struct.pair*, i32*)** @setter
+  call void %fp(%struct.pair* %s, i32* %x) nounwind
+  %f = getelementptr inbounds %struct.pair, %struct.pair* %s, i64 0, i32 0
+  %y = load i32*, i32** %f
+  %r = load i32, i32* %y
+  ret i32 %r
+}
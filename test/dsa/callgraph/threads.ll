@@ -0,0 +1,57 @@
+; Bottom-up graphs calculated on several threads must match those calculated
+; one SCC at a time.  @even and @odd form an SCC which can only be calculated
+; once @link is finished, and @main calls @even through a function pointer
+; which @pick returns, so its callees are only known after @pick is inlined.
+
+;RUN: dsaopt %s -dsa-bu -analyze -dsa-bu-threads=1 -check-same-node=main:x,main:y
+;RUN: dsaopt %s -dsa-bu -analyze -dsa-bu-threads=4 -check-same-node=main:x,main:y
+;RUN: dsaopt %s -dsa-bu -analyze -dsa-bu-threads=4 -check-callees=main,pick,even
+;RUN: dsaopt %s -dsa-cbu -analyze -dsa-bu-threads=4 -check-callees=even,odd,link
+;RUN: dsaopt %s -dsa-eq -analyze -dsa-bu-threads=4 -check-same-node=main:x,main:y
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+define internal void @link(i32** %pp, i32* %v) nounwind {
+entry:
+  store i32* %v, i32** %pp
+  ret void
+}
+
+define internal void @even(i32** %pp, i32* %v, i32 %n) nounwind {
+entry:
+  %done = icmp eq i32 %n, 0
+  br i1 %done, label %base, label %recurse
+
+base:
+  call void @link(i32** %pp, i32* %v) nounwind
+  ret void
+
+recurse:
+  %m = sub i32 %n, 1
+  call void @odd(i32** %pp, i32* %v, i32 %m) nounwind
+  ret void
+}
+
+define internal void @odd(i32** %pp, i32* %v, i32 %n) nounwind {
+entry:
+  %m = sub i32 %n, 1
+  call void @even(i32** %pp, i32* %v, i32 %m) nounwind
+  ret void
+}
+
+define internal void (i32**, i32*, i32)* @pick() nounwind {
+entry:
+  ret void (i32**, i32*, i32)* @even
+}
+
+define i32 @main() nounwind {
+entry:
+  %slot = alloca i32*
+  %x = alloca i32
+  %f = call void (i32**, i32*, i32)* ()* @pick() nounwind
+  call void %f(i32** %slot, i32* %x, i32 4) nounwind
+  %y = load i32*, i32** %slot
+  %r = load i32, i32* %y
+  ret i32 %r
+}
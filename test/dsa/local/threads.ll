@@ -0,0 +1,49 @@
+; Local graphs built on several threads must be the same as those built one
+; after another.  @b only joins the equivalence class of @a once the graph of
+; @merge has been merged into the globals graph, so the graph of @use, which
+; was built before that, has to be built again.
+
+;RUN: dsaopt %s -dsa-local -analyze -dsa-local-threads=1 -check-same-node=use:pa,use:pb
+;RUN: dsaopt %s -dsa-local -analyze -dsa-local-threads=4 -check-same-node=use:pa,use:pb
+;RUN: dsaopt %s -dsa-local -analyze -dsa-local-threads=4 -check-not-same-node=other:pc,other:pa
+
+; Compare all of the graphs, which -analyze writes to the current directory,
+; with the node addresses left out.
+;RUN: rm -rf %t.1 %t.4 && mkdir %t.1 %t.4
+;RUN: cd %t.1 && dsaopt %s -dsa-local -analyze -dsa-local-threads=1 > analyze.out
+;RUN: cd %t.4 && dsaopt %s -dsa-local -analyze -dsa-local-threads=4 > analyze.out
+;RUN: cat %t.1/* | sed -e 's/0x[0-9a-fA-F]*//g' > %t.1.out
+;RUN: cat %t.4/* | sed -e 's/0x[0-9a-fA-F]*//g' > %t.4.out
+;RUN: diff %t.1.out %t.4.out
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+@a = global i32 0
+@b = global i32 0
+@c = global i32 0
+
+define void @merge(i1 %cond) nounwind {
+entry:
+  %p = select i1 %cond, i32* @a, i32* @b
+  store i32 1, i32* %p
+  ret void
+}
+
+define void @use() nounwind {
+entry:
+  %pa = bitcast i32* @a to i8*
+  %pb = bitcast i32* @b to i8*
+  store i8 0, i8* %pa
+  store i8 0, i8* %pb
+  ret void
+}
+
+define void @other() nounwind {
+entry:
+  %pc = bitcast i32* @c to i8*
+  %pa = bitcast i32* @a to i8*
+  store i8 0, i8* %pc
+  store i8 0, i8* %pa
+  ret void
+}
@@ -0,0 +1,42 @@
+; What the globals graph knows about the nodes a function reaches through a
+; global must be merged into the function's graph.  @get loads two globals
+; which @set pointed at the same heap object, without calling @set.  The local
+; and standard library passes only do that merge once a graph is asked for,
+; or in the copies the next pass makes.
+
+;RUN: dsaopt %s -dsa-local -analyze -check-same-node=get:a,get:b
+;RUN: dsaopt %s -dsa-stdlib -analyze -check-same-node=get:a,get:b
+;RUN: dsaopt %s -dsa-bu -analyze -check-same-node=get:a,get:b
+;RUN: dsaopt %s -dsa-td -analyze -check-same-node=get:a,get:b
+;RUN: dsaopt %s -dsa-td -analyze -verify-flags=get:a+H
+
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+@G = internal global i8* null
+@H = internal global i8* null
+
+declare noalias i8* @malloc(i64) nounwind
+
+define internal void @set() nounwind {
+entry:
+  %p = call noalias i8* @malloc(i64 8) nounwind
+  store i8* %p, i8** @G
+  store i8* %p, i8** @H
+  ret void
+}
+
+define internal i8* @get() nounwind {
+entry:
+  %a = load i8*, i8** @G
+  %b = load i8*, i8** @H
+  store i8 0, i8* %b
+  ret i8* %a
+}
+
+define i32 @main() nounwind {
+entry:
+  call void @set() nounwind
+  %r = call i8* @get() nounwind
+  ret i32 0
+}
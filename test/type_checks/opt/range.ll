@@ -0,0 +1,39 @@
+; The check of each element of an array walked by a loop is replaced by one
+; checkTypeRange call in the preheader, covering every element the loop visits.
+
+;RUN: adsaopt %s -typechecks-opt -S | FileCheck %s
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+declare i32* @ext()
+declare void @getTypeTag(i8*, i64, i8*, i32)
+declare void @checkType(i8, i64, i8*, i8*, i32)
+declare void @checkTypeRange(i8, i64, i8*, i64, i64, i32)
+
+; CHECK-LABEL: @range(
+; CHECK: call void @checkTypeRange(i8 3, i64 4, i8* {{.*}}, i64 {{.*}}, i64 4, i32 1)
+; CHECK-NEXT: br label %loop
+; CHECK: loop:
+; CHECK-NOT: @getTypeTag(
+; CHECK-NOT: @checkType(
+; CHECK: exit:
+define void @range(i64 %n) {
+entry:
+  %md = alloca i8, i32 4
+  %p = call i32* @ext()
+  br label %loop
+
+loop:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %loop ]
+  %e = getelementptr i32, i32* %p, i64 %i
+  %c = bitcast i32* %e to i8*
+  call void @getTypeTag(i8* %c, i64 4, i8* %md, i32 1)
+  call void @checkType(i8 3, i64 4, i8* %md, i8* %c, i32 1)
+  %v = load i32, i32* %e
+  %i.next = add nuw nsw i64 %i, 1
+  %done = icmp eq i64 %i.next, %n
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret void
+}
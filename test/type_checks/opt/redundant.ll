@@ -0,0 +1,60 @@
+; A check of the same pointer, type and size as one made on every path to it
+; is removed, with the type tag it read, unless a call which may change type
+; tags comes in between.
+
+;RUN: adsaopt %s -typechecks-opt -S | FileCheck %s
+target datalayout = "e-p:64:64:64-i1:8:8-i8:8:8-i16:16:16-i32:32:32-i64:64:64-f32:32:32-f64:64:64-v64:64:64-v128:128:128-a0:0:64-s0:64:64-f80:128:128-n8:16:32:64"
+target triple = "x86_64-unknown-linux-gnu"
+
+declare i32* @ext()
+declare void @getTypeTag(i8*, i64, i8*, i32)
+declare void @checkType(i8, i64, i8*, i8*, i32)
+declare void @checkTypeRange(i8, i64, i8*, i64, i64, i32)
+
+define internal void @clobber(i32* %p) {
+entry:
+  store i32 0, i32* %p
+  ret void
+}
+
+; CHECK-LABEL: @redundant(
+; CHECK: call void @getTypeTag(i8* %c, i64 4, i8* %md1, i32 1)
+; CHECK-NEXT: call void @checkType(i8 3, i64 4, i8* %md1, i8* %c, i32 1)
+; CHECK-NOT: @getTypeTag(
+; CHECK-NOT: @checkType(
+; CHECK: ret void
+define void @redundant() {
+entry:
+  %md1 = alloca i8, i32 4
+  %md2 = alloca i8, i32 4
+  %p = call i32* @ext()
+  %c = bitcast i32* %p to i8*
+  call void @getTypeTag(i8* %c, i64 4, i8* %md1, i32 1)
+  call void @checkType(i8 3, i64 4, i8* %md1, i8* %c, i32 1)
+  %a = load i32, i32* %p
+  call void @getTypeTag(i8* %c, i64 4, i8* %md2, i32 2)
+  call void @checkType(i8 3, i64 4, i8* %md2, i8* %c, i32 2)
+  %b = load i32, i32* %p
+  ret void
+}
+
+; CHECK-LABEL: @clobbered(
+; CHECK: call void @checkType(i8 3, i64 4, i8* %md1, i8* %c, i32 1)
+; CHECK: call void @clobber(
+; CHECK: call void @getTypeTag(i8* %c, i64 4, i8* %md2, i32 2)
+; CHECK-NEXT: call void @checkType(i8 3, i64 4, i8* %md2, i8* %c, i32 2)
+define void @clobbered() {
+entry:
+  %md1 = alloca i8, i32 4
+  %md2 = alloca i8, i32 4
+  %p = call i32* @ext()
+  %c = bitcast i32* %p to i8*
+  call void @getTypeTag(i8* %c, i64 4, i8* %md1, i32 1)
+  call void @checkType(i8 3, i64 4, i8* %md1, i8* %c, i32 1)
+  %a = load i32, i32* %p
+  call void @clobber(i32* %p)
+  call void @getTypeTag(i8* %c, i64 4, i8* %md2, i32 2)
+  call void @checkType(i8 3, i64 4, i8* %md2, i8* %c, i32 2)
+  %b = load i32, i32* %p
+  ret void
+}
@@ -10,36 +10,198 @@
 // http://lists.apple.com/archives/unix-porting/2005/Jun/msg00115.html.
 //===----------------------------------------------------------------------===//
 //
-// This program executes another program and monitors its memory usage.  If the
-// executed program consumes too much memory, then this program will terminate
-// it.
+// This program executes another program and monitors its resource usage.  If
+// the executed program consumes too much memory, then this program will
+// terminate it.
 //
 // This program is needed on Mac OS X because memory limits set by setrlimit()
 // are ignored by the kernel.  Instead, we must have a program carefully watch
 // a program and terminate it if it uses too much memory.
 //
+// It also serves as a harness for comparing the memory behaviour of programs,
+// such as a pool allocated and a malloc based build of the same benchmark.
+// Each sample covers the child and all of its descendants, so that a command
+// run through a shell or a driver script is measured as a whole.  The total
+// resident set size, CPU time and page faults of the process tree can be
+// written to a file, followed by a summary of the run: the peak of the total
+// resident set size and the area under its curve, which measures how much
+// memory was held for how long.  The summary also gives the largest resident
+// set size reached by any single process, as the kernel accounts it; unlike
+// the sampled peak, this catches peaks between samples, but it is not a total.
+// On Linux the samples are read from /proc; elsewhere only the resident set
+// size is sampled, with ps.
+//
+// Usage: watchdog [-i interval-ms] [-m max-rss] [-o file] [-v]
+//                 <command> [args ...]
+//
+// The limit is in kilobytes, or in megabytes or gigabytes with an M or G
+// suffix; 0 disables it.  -v prints the summary to standard error.
+//
 //===----------------------------------------------------------------------===//
 
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <vector>
 
+#include <dirent.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
 using namespace std;
 
-// Process ID to watch.  This is global because it is needed by the signal
-// handler.
+// Process ID to watch.
 static int pid_to_watch = 0;
 
-// Number of seconds to wait before checking up on the child process
-static const unsigned check_interval = 10;
+// The process to watch and its descendants, as of the last sample.
+static std::vector<pid_t> watched_pids;
+
+// Written to by the SIGCHLD handler, so that the main loop wakes up as soon
+// as the child terminates rather than at the end of the current interval.
+static int sigchld_pipe[2] = { -1, -1 };
+
+// Number of milliseconds to wait before checking up on the child process
+static unsigned check_interval = 100;
 
 // Maximum amount for the resident set size in kilobytes (i.e., how much
-// physical memory is in use).
-static const int rss_max_allowable = 4 * 1024 * 1024;
+// physical memory is in use).  Zero means there is no limit.
+static unsigned long rss_max_allowable = 4 * 1024 * 1024;
+
+//
+// Structure: Sample
+//
+// Description:
+//  The resource usage of the child process and its descendants at one point
+//  in time.  The sizes, times and faults are totals over the processes alive
+//  at that point, except for process_peak_rss, which is the largest peak
+//  resident set size of any one of them.  Times are in seconds and sizes in
+//  kilobytes.
+//
+struct Sample {
+  double time;
+  unsigned long rss;
+  unsigned long process_peak_rss;
+  double user_time;
+  double system_time;
+  unsigned long minor_faults;
+  unsigned long major_faults;
+};
+
+//
+// Structure: Summary
+//
+// Description:
+//  The totals of a run, accumulated as the samples are taken.
+//
+struct Summary {
+  unsigned long peak_rss;
+  unsigned long process_peak_rss;
+  double rss_area;
+  double last_time;
+  unsigned long last_rss;
+  unsigned long samples;
+};
+
+static double
+now (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+sigchld_handler (int) {
+  int saved_errno = errno;
+  ssize_t written = write (sigchld_pipe[1], "", 1);
+  (void) written;
+  errno = saved_errno;
+}
+
+//
+// Function: watch_children()
+//
+// Description:
+//  Arrange for SIGCHLD to wake up wait_for_child().  The pipe is closed on
+//  exec, so the program we run never sees it.
+//
+static bool
+watch_children (void) {
+  if (pipe (sigchld_pipe) == -1)
+    return false;
+  for (int i = 0; i < 2; ++i) {
+    fcntl (sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+    fcntl (sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+  }
+
+  struct sigaction action;
+  memset (&action, 0, sizeof (action));
+  action.sa_handler = sigchld_handler;
+  sigemptyset (&action.sa_mask);
+  action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  return sigaction (SIGCHLD, &action, NULL) == 0;
+}
+
+//
+// Function: wait_for_child()
+//
+// Description:
+//  Sleep for up to the given number of milliseconds, returning early if a
+//  child has terminated.  A SIGCHLD which arrives before we start waiting
+//  leaves a byte in the pipe, so it is not missed.
+//
+static void
+wait_for_child (unsigned ms) {
+  fd_set fds;
+  FD_ZERO (&fds);
+  FD_SET (sigchld_pipe[0], &fds);
+  struct timeval timeout;
+  timeout.tv_sec = ms / 1000;
+  timeout.tv_usec = (ms % 1000) * 1000;
+  if (select (sigchld_pipe[0] + 1, &fds, NULL, NULL, &timeout) > 0) {
+    char buf[64];
+    while (read (sigchld_pipe[0], buf, sizeof (buf)) > 0)
+      ;
+  }
+}
+
+//
+// Function: find_descendants()
+//
+// Description:
+//  Given the parent of each process, set watched_pids to the process to watch
+//  and all of its descendants.
+//
+// Return value:
+//  false - The process to watch was not among the processes.
+//
+static bool
+find_descendants (const std::vector<pid_t> & pids,
+                  const std::vector<pid_t> & parents) {
+  watched_pids.clear ();
+  for (size_t i = 0; i < pids.size (); ++i)
+    if (pids[i] == pid_to_watch)
+      watched_pids.push_back (pid_to_watch);
+  if (watched_pids.empty ())
+    return false;
+
+  //
+  // Each process has one parent, so a breadth first walk down from the
+  // process to watch finds each descendant once.
+  //
+  for (size_t n = 0; n < watched_pids.size (); ++n)
+    for (size_t i = 0; i < pids.size (); ++i)
+      if (parents[i] == watched_pids[n] && pids[i] != pid_to_watch)
+        watched_pids.push_back (pids[i]);
+  return true;
+}
 
 //
 // Function: create_process()
@@ -85,81 +247,350 @@ create_process (int argc, char ** argv) {
   exit (1);
 }
 
-#if defined(__APPLE__)
+#if defined(__linux__)
 //
-// Function: check_process()
+// Structure: ProcStat
 //
 // Description:
-//  This function is a signal handler.  It is called on receipt of an alarm
-//  signal to check the memory usage of a child process.
+//  The fields of /proc/PID/stat which we use.
 //
-static void
-check_process (int sig) {
-  char cmd[256];
-  int rss;
-  FILE *fp;
+struct ProcStat {
+  pid_t pid;
+  pid_t ppid;
+  unsigned long minor_faults;
+  unsigned long major_faults;
+  unsigned long utime;
+  unsigned long stime;
+};
+
+static bool
+read_proc_stat (pid_t pid, ProcStat & stat) {
+  char path[64];
+  char buf[1024];
+  FILE * fp;
 
   //
-  // If we caught a signal, check on the child process's memory usage.
+  // The command name in the stat file may contain spaces and parentheses, so
+  // start scanning after the last closing parenthesis.
   //
-  snprintf(cmd, 255, "ps -p %d -o rss | tail -1", pid_to_watch);
-  if ((fp = popen(cmd, "r")) != NULL) {
-    if (fscanf(fp, "%d", &rss) == 1) {
-      if (rss > rss_max_allowable) {
-        fprintf (stderr, "WatchDog: Terminating bad process %d!\n", pid_to_watch);
-        kill (pid_to_watch, SIGKILL);
-        return;
+  snprintf (path, sizeof (path), "/proc/%d/stat", pid);
+  if ((fp = fopen (path, "r")) == NULL)
+    return false;
+  size_t len = fread (buf, 1, sizeof (buf) - 1, fp);
+  fclose (fp);
+  buf[len] = '\0';
+  char * fields = strrchr (buf, ')');
+  int ppid;
+  if (!fields ||
+      sscanf (fields + 2, "%*c %d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu",
+              &ppid, &stat.minor_faults, &stat.major_faults, &stat.utime,
+              &stat.stime) != 5)
+    return false;
+  stat.pid = pid;
+  stat.ppid = ppid;
+  return true;
+}
+
+//
+// Function: read_sample()
+//
+// Description:
+//  Read the resource usage of the child process and its descendants from
+//  /proc.
+//
+// Return value:
+//  true  - The sample was read.
+//  false - The process has gone away.
+//
+static bool
+read_sample (Sample & sample) {
+  static long ticks = sysconf (_SC_CLK_TCK);
+  std::vector<ProcStat> stats;
+  std::vector<pid_t> pids, parents;
+
+  DIR * dir = opendir ("/proc");
+  if (!dir)
+    return false;
+  while (struct dirent * entry = readdir (dir)) {
+    char * end;
+    long pid = strtol (entry->d_name, &end, 10);
+    ProcStat stat;
+    if (*end || pid <= 0 || !read_proc_stat (pid, stat))
+      continue;
+    stats.push_back (stat);
+    pids.push_back (stat.pid);
+    parents.push_back (stat.ppid);
+  }
+  closedir (dir);
+  if (!find_descendants (pids, parents))
+    return false;
+
+  memset (&sample, 0, sizeof (sample));
+  unsigned long utime = 0, stime = 0;
+  for (size_t i = 0; i < stats.size (); ++i) {
+    bool watched = false;
+    for (size_t n = 0; n < watched_pids.size () && !watched; ++n)
+      watched = stats[i].pid == watched_pids[n];
+    if (!watched)
+      continue;
+    sample.minor_faults += stats[i].minor_faults;
+    sample.major_faults += stats[i].major_faults;
+    utime += stats[i].utime;
+    stime += stats[i].stime;
+
+    //
+    // A process which exits after we read its stat file simply drops out of
+    // the resident set size total.
+    //
+    char path[64];
+    char buf[1024];
+    FILE * fp;
+    snprintf (path, sizeof (path), "/proc/%d/status", stats[i].pid);
+    if ((fp = fopen (path, "r")) == NULL)
+      continue;
+    while (fgets (buf, sizeof (buf), fp)) {
+      if (strncmp (buf, "VmRSS:", 6) == 0) {
+        sample.rss += strtoul (buf + 6, NULL, 10);
+      } else if (strncmp (buf, "VmHWM:", 6) == 0) {
+        unsigned long hwm = strtoul (buf + 6, NULL, 10);
+        if (hwm > sample.process_peak_rss)
+          sample.process_peak_rss = hwm;
       }
     }
-    pclose(fp);
+    fclose (fp);
   }
+  sample.user_time = (double) utime / ticks;
+  sample.system_time = (double) stime / ticks;
+  return true;
+}
+#else
+//
+// Function: read_sample()
+//
+// Description:
+//  Read the resident set size of the child process and its descendants using
+//  ps.  The other fields of the sample are left zero.
+//
+static bool
+read_sample (Sample & sample) {
+  std::vector<pid_t> pids, parents;
+  FILE *fp;
 
-  //
-  // Reset the alarm.
-  //
-  signal (SIGALRM, check_process);
-  alarm (check_interval);
-  return;
+  if ((fp = popen("ps -A -o pid= -o ppid= -o rss=", "r")) == NULL)
+    return false;
+  int pid, ppid;
+  unsigned long rss;
+  std::vector<unsigned long> rss_of;
+  while (fscanf(fp, "%d %d %lu", &pid, &ppid, &rss) == 3) {
+    pids.push_back(pid);
+    parents.push_back(ppid);
+    rss_of.push_back(rss);
+  }
+  pclose(fp);
+  if (!find_descendants (pids, parents))
+    return false;
+
+  memset (&sample, 0, sizeof (sample));
+  for (size_t i = 0; i < pids.size (); ++i)
+    for (size_t n = 0; n < watched_pids.size (); ++n)
+      if (pids[i] == watched_pids[n]) {
+        sample.rss += rss_of[i];
+        if (rss_of[i] > sample.process_peak_rss)
+          sample.process_peak_rss = rss_of[i];
+      }
+  return true;
 }
 #endif
 
+//
+// Function: record_sample()
+//
+// Description:
+//  Add a sample to the summary, and write it to the output file if there is
+//  one.  The area under the resident set size curve is found with the
+//  trapezoidal rule.
+//
+static void
+record_sample (FILE * out, Summary & summary, const Sample & sample) {
+  if (summary.samples)
+    summary.rss_area += (sample.time - summary.last_time) *
+                        (sample.rss + summary.last_rss) / 2.0;
+  summary.last_time = sample.time;
+  summary.last_rss = sample.rss;
+  if (sample.rss > summary.peak_rss)
+    summary.peak_rss = sample.rss;
+  if (sample.process_peak_rss > summary.process_peak_rss)
+    summary.process_peak_rss = sample.process_peak_rss;
+  ++summary.samples;
+
+  if (out)
+    fprintf (out, "%.3f,%lu,%.2f,%.2f,%lu,%lu\n", sample.time, sample.rss,
+             sample.user_time, sample.system_time, sample.minor_faults,
+             sample.major_faults);
+}
+
+//
+// Function: print_summary()
+//
+// Description:
+//  Print the totals of the run.  The peak and the area of the resident set
+//  size are those of the sampled process tree totals, and agree with each
+//  other.  The largest resident set size of a single process also takes the
+//  kernel's accounting into account, and so covers peaks between samples.
+//  The CPU time and page faults come from the kernel's accounting of the
+//  child and the descendants it waited for, which also covers the time after
+//  the last sample.
+//
+static void
+print_summary (FILE * out, const char * prefix, const Summary & summary,
+               double wall_time, const struct rusage & usage) {
+  unsigned long process_peak_rss = summary.process_peak_rss;
+#if defined(__linux__)
+  if ((unsigned long) usage.ru_maxrss > process_peak_rss)
+    process_peak_rss = usage.ru_maxrss;
+#endif
+  fprintf (out, "%speak_rss_kb %lu\n", prefix, summary.peak_rss);
+  fprintf (out, "%srss_area_kb_s %.1f\n", prefix, summary.rss_area);
+  fprintf (out, "%smax_process_rss_kb %lu\n", prefix, process_peak_rss);
+  fprintf (out, "%swall_s %.3f\n", prefix, wall_time);
+  fprintf (out, "%suser_s %.3f\n", prefix,
+           usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6);
+  fprintf (out, "%ssystem_s %.3f\n", prefix,
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6);
+  fprintf (out, "%sminor_faults %ld\n", prefix, usage.ru_minflt);
+  fprintf (out, "%smajor_faults %ld\n", prefix, usage.ru_majflt);
+  fprintf (out, "%ssamples %lu\n", prefix, summary.samples);
+}
+
+//
+// Function: parse_size()
+//
+// Description:
+//  Parse a memory limit given in kilobytes, or with an M or G suffix.
+//
+static bool
+parse_size (const char * arg, unsigned long & size) {
+  char * end;
+  errno = 0;
+  size = strtoul (arg, &end, 10);
+  if (errno || end == arg)
+    return false;
+  switch (*end) {
+    case 'G': case 'g': size *= 1024; // Fall through
+    case 'M': case 'm': size *= 1024; ++end; break;
+    case 'K': case 'k': ++end; break;
+  }
+  return *end == '\0';
+}
+
+static void
+usage (const char * name) {
+  fprintf (stderr, "Usage: %s [-i interval-ms] [-m max-rss] [-o file] [-v] "
+                   "<command> [args ...]\n", name);
+  exit (1);
+}
+
 int
 main (int argc, char ** argv) {
+  const char * output_file = NULL;
+  bool verbose = false;
+  int opt;
+
+  //
+  // Parse our options; the first argument which is not one starts the command.
+  //
+  while ((opt = getopt (argc, argv, "+i:m:o:v")) != -1) {
+    switch (opt) {
+      case 'i':
+        check_interval = strtoul (optarg, NULL, 10);
+        if (!check_interval)
+          usage (argv[0]);
+        break;
+      case 'm':
+        if (!parse_size (optarg, rss_max_allowable))
+          usage (argv[0]);
+        break;
+      case 'o':
+        output_file = optarg;
+        break;
+      case 'v':
+        verbose = true;
+        break;
+      default:
+        usage (argv[0]);
+    }
+  }
+
   //
   // Verify that we have sufficient command line arguments.
   //
-  if (argc < 2) {
-    fprintf (stderr, "Usage: %s <command> [args ...]\n", argv[0]);
+  if (optind >= argc)
+    usage (argv[0]);
+
+  FILE * out = NULL;
+  if (output_file && (out = fopen (output_file, "w")) == NULL) {
+    perror (output_file);
+    exit (1);
+  }
+  if (out)
+    fprintf (out, "time_s,rss_kb,user_s,system_s,minor_faults,major_faults\n");
+
+  if (!watch_children ()) {
+    perror ("WatchDog");
     exit (1);
   }
 
   //
   // Execute the program to watch.
   //
-  pid_to_watch = create_process (argc, argv);
+  double start = now ();
+  pid_to_watch = create_process (argc - optind + 1, argv + optind - 1);
   if (!pid_to_watch) {
     fprintf (stderr, "Failed to create child process\n");
     exit (1);
   }
 
   //
-  // Set up an alarm to wake us up.
+  // Sample the child until it terminates or we terminate it.
   //
-#if defined(__APPLE__)
-  signal (SIGALRM, check_process);
-  alarm (check_interval);
-#endif
+  Summary summary;
+  memset (&summary, 0, sizeof (summary));
 
-  //
-  // Keep looping until the child terminates or we terminate it.
-  //
-  int status;
-  waitpid (pid_to_watch, &status, 0);
+  int status = 0;
+  struct rusage usage;
+  memset (&usage, 0, sizeof (usage));
+  for (;;) {
+    pid_t done = wait4 (pid_to_watch, &status, WNOHANG, &usage);
+    if (done == pid_to_watch || (done == -1 && errno != EINTR))
+      break;
+
+    Sample sample;
+    if (read_sample (sample)) {
+      sample.time = now () - start;
+      record_sample (out, summary, sample);
+      if (rss_max_allowable && sample.rss > rss_max_allowable) {
+        fprintf (stderr, "WatchDog: Terminating bad process %d!\n", pid_to_watch);
+        for (size_t i = 0; i < watched_pids.size (); ++i)
+          kill (watched_pids[i], SIGKILL);
+      }
+    }
+
+    wait_for_child (check_interval);
+  }
+  double wall_time = now () - start;
+
+  if (out) {
+    print_summary (out, "# ", summary, wall_time, usage);
+    fclose (out);
+  }
+  if (verbose)
+    print_summary (stderr, "WatchDog: ", summary, wall_time, usage);
 
   //
   // The program has terminated.  Get its exit status and use that as our
   // exit status.
   //
+  if (WIFSIGNALED (status))
+    exit (128 + WTERMSIG (status));
   exit (WEXITSTATUS (status));
 }
-